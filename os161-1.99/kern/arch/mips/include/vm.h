@@ -119,5 +119,14 @@ struct tlbshootdown {
 
 #define TLBSHOOTDOWN_MAX 16
 
+/*
+ * A batch of invalidations being collected to send out in one
+ * shootdown round (see vm_tlbbatch_add).
+ */
+struct tlbbatch {
+	unsigned tb_count;
+	struct tlbshootdown tb_entries[TLBSHOOTDOWN_MAX];
+};
+
 
 #endif /* _MIPS_VM_H_ */
@@ -29,6 +29,7 @@
 
 #include <types.h>
 #include <signal.h>
+#include <kern/wait.h>
 #include <lib.h>
 #include <mips/specialreg.h>
 #include <mips/trapframe.h>
@@ -37,6 +38,7 @@
 #include <kern/errno.h>
 #include <thread.h>
 #include <current.h>
+#include <proc.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <syscall.h>
@@ -110,13 +112,22 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 		break;
 	}
 
-	/*
-	 * You will probably want to change this.
-	 */
-
 	kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, vaddr 0x%x)\n",
 		code, sig, trapcodenames[code], epc, vaddr);
-	panic("I don't know how to handle this\n");
+	proc_exit(_MKWAIT_SIG(sig));
+}
+
+/*
+ * Called on the way back to user mode, with interrupts on: if the OOM
+ * killer has picked this process, exit instead of returning to it.
+ */
+static
+void
+exit_if_killed(void)
+{
+	if (curproc != NULL && curproc->p_killed) {
+		proc_exit(_MKWAIT_SIG(SIGKILL));
+	}
 }
 
 /*
@@ -196,6 +207,13 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		if (!iskern && curproc != NULL && curproc->p_killed) {
+			/* Catch victims that never make a syscall. */
+			spl = splhigh();
+			splx(spl);
+			exit_if_killed();
+		}
 		goto done2;
 	}
 
@@ -316,6 +334,10 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	if (!iskern) {
+		exit_if_killed();
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
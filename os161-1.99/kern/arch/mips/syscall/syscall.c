@@ -110,6 +110,11 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
 #ifdef OPT_A2
 
 	case SYS_fork:
@@ -143,6 +148,20 @@ syscall(struct trapframe *tf)
 	  break;
 #endif // UW
 
+	    case SYS_sbrk:
+		err = sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
+		break;
+
+	    case SYS_mmap:
+		err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+			       (int)tf->tf_a2, (int)tf->tf_a3,
+			       (vaddr_t *)&retval);
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
 	    /* Add stuff here */
  
 	default:
@@ -193,7 +212,10 @@ enter_forked_process(void * tf, unsigned long n)
 {
 	(void)n;
 	struct trapframe tf_c = *(struct trapframe *)tf;
-	
+
+	/* sys_fork's copy; we have ours now, on this thread's stack. */
+	kfree(tf);
+
 	tf_c.tf_v0 = 0;
 	tf_c.tf_a3 = 0;
 	tf_c.tf_epc += 4;
@@ -32,93 +32,166 @@
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <thread.h>
 #include <proc.h>
 #include <current.h>
+#include <clock.h>
 #include <mips/tlb.h>
+#include <platform/maxcpus.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <coremap.h>
+#include <kmalloc.h>
+#include <kmem_cache.h>
+#include <pagetable.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <zeropool.h>
+#include <uw-vmstats.h>
 
 /*
- * Dumb MIPS-only "VM system" that is intended to only be just barely
- * enough to struggle off the ground.
+ * MIPS-specific part of the VM system: the TLB refill path (vm_fault)
+ * and address space switching. Address spaces themselves, with their
+ * regions and page tables, are in kern/vm/addrspace.c.
  */
 
-/* under dumbvm, always have 48k of user stack */
-#define DUMBVM_STACKPAGES    12
-
 /*
  * Wrap rma_stealmem in a spinlock.
  */
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 
-bool CORE_MAP_CREATED = false;
-int frame_num = 0;
-int *CORE_MAP;
-paddr_t mem_start;
+/* Set once the coremap has taken over physical memory. */
+static bool coremap_created = false;
+
+/* Shootdown statistics. */
+static struct spinlock tlbstats_lock = SPINLOCK_INITIALIZER;
+static unsigned tlbstats_rounds;	/* batches flushed */
+static unsigned tlbstats_pages;		/* invalidations requested */
+static unsigned tlbstats_ipis;		/* IPIs sent */
+static unsigned tlbstats_waitusec;	/* time spent waiting for acks */
+
+/* Fault-around window, in pages. */
+unsigned vm_faultaround = VM_FAULTAROUND;
+
+static void asid_bootstrap(void);
 
 void
 vm_bootstrap(void)
 {
-	// TO DO: make sure pages are all PAGE ALIGNED - i.e. divisible by 4096 ?
-	paddr_t lo; paddr_t hi;
-	CORE_MAP_CREATED = true;
-	ram_getsize(&lo, &hi);
+	coremap_bootstrap();
+	coremap_created = true;
+	vmstats_init();
+	kmalloc_bootstrap();
+	kmem_cache_bootstrap();
+	asid_bootstrap();
+	swap_bootstrap();
+	pagecache_bootstrap();
+	zeropool_bootstrap();
+}
+
+/*
+ * Reclaim hooks; see <vm.h>. Entries are only ever added, and the
+ * count goes up only after an entry is filled in, so reclaim_ppages
+ * reads the array without the lock.
+ */
+struct vm_reclaimer {
+	const char *vr_name;
+	vm_reclaim_func vr_func;
+};
+static struct vm_reclaimer vm_reclaimers[VM_RECLAIM_MAX];
+static volatile unsigned vm_reclaim_count;
+static struct spinlock vm_reclaim_lock = SPINLOCK_INITIALIZER;
 
-	// check this
-	int space = hi - lo;
-	int num_pages = space / (PAGE_SIZE + sizeof(int));
-	frame_num = num_pages;
-	paddr_t map_start = ROUNDUP(frame_num * sizeof(int) + lo, PAGE_SIZE);
-	mem_start = map_start;
-	CORE_MAP = (int*) PADDR_TO_KVADDR(lo);
+int
+vm_reclaim_register(const char *name, vm_reclaim_func func)
+{
+	spinlock_acquire(&vm_reclaim_lock);
+	if (vm_reclaim_count == VM_RECLAIM_MAX) {
+		spinlock_release(&vm_reclaim_lock);
+		return ENOSPC;
+	}
+	vm_reclaimers[vm_reclaim_count].vr_name = name;
+	vm_reclaimers[vm_reclaim_count].vr_func = func;
+	vm_reclaim_count++;
+	spinlock_release(&vm_reclaim_lock);
+	return 0;
+}
 
-	kprintf("Frame count: %d\n", frame_num);
+/*
+ * Make room: first let subsystems drop memory they can do without,
+ * then take back the frames other cpus have cached, then page out
+ * user pages. A single page can be handed over
+ * directly; for a longer run, give the frames back and hope they
+ * coalesce. Returns 0 if nothing more can be freed.
+ */
+static
+paddr_t
+reclaim_ppages(unsigned long npages)
+{
+	paddr_t addr;
+	unsigned long i;
+	unsigned freed, n;
+
+	freed = 0;
+	n = vm_reclaim_count;
+	for (i=0; i<n; i++) {
+		freed += vm_reclaimers[i].vr_func();
+	}
+	if (freed > 0) {
+		addr = coremap_alloc(npages);
+		if (addr != 0) {
+			return addr;
+		}
+	}
 
-	// set all values to 0
-	for (int i = 0; i < frame_num; i ++) {
-		CORE_MAP[i] = 0;
+	coremap_flushall();
+	addr = coremap_alloc(npages);
+	if (addr != 0) {
+		return addr;
 	}
+
+	for (i=0; i<2*npages; i++) {
+		addr = swap_evict();
+		if (addr == 0) {
+			return 0;
+		}
+		if (npages == 1) {
+			return addr;
+		}
+		coremap_free(addr);
+		addr = coremap_alloc(npages);
+		if (addr != 0) {
+			return addr;
+		}
+	}
+	return 0;
 }
 
+/*
+ * Returns 0 when memory is exhausted; the caller turns that into
+ * ENOMEM.
+ */
 static
 paddr_t
 getppages(unsigned long npages)
 {
-	paddr_t addr = -1;
+	paddr_t addr;
 
-	if (!CORE_MAP_CREATED) {
+	if (!coremap_created) {
 		spinlock_acquire(&stealmem_lock);
 
 		addr = ram_stealmem(npages);
 		
 		spinlock_release(&stealmem_lock);
+	} else if (npages > (1UL << COREMAP_MAXORDER)) {
+		/* Bigger than any block; freeing memory can't help. */
+		addr = 0;
 	} else {
-		spinlock_acquire(&stealmem_lock);
-		int num_pages = (int)npages;
-		for (int i = 0; i < frame_num - num_pages; i ++) {
-			int loc = 0;
-			while (loc < num_pages) {
-				if (CORE_MAP[i + loc] == 0) loc ++;
-				else break;
-				
-			}
-
-			if (loc == num_pages) {
-				int counter = 1;
-				addr = (paddr_t)ROUNDUP(mem_start + i*PAGE_SIZE, PAGE_SIZE);
-				while (counter <= num_pages) {
-					CORE_MAP[i + counter - 1] = counter;
-					counter ++;
-				}
-				break;
-			}
+		addr = coremap_alloc(npages);
+		if (addr == 0) {
+			addr = reclaim_ppages(npages);
 		}
-		// print_coremap();
-		spinlock_release(&stealmem_lock);
-	}
-
-	if ((int)addr < 0) {
-		panic("Ran out of address space! Please free things!!\n");
 	}
 
 	return addr;
@@ -142,342 +215,720 @@ free_kpages(vaddr_t addr)
 	paddr_t pa = KVADDR_TO_PADDR(addr);
 	KASSERT(pa % PAGE_SIZE == 0);
 
-	for (int i = 0; i < frame_num; i ++) {
-		paddr_t myAddr = (paddr_t)ROUNDUP(mem_start + i*PAGE_SIZE, PAGE_SIZE);
-		if (myAddr == pa) {
-			// kprintf("Trying to free page %d\n", i);
-			if (CORE_MAP[i] == 0) {
-				kprintf("There was an error freeing unused space\n");
-				break;
-			}
+	coremap_free(pa);
+}
 
-			int j = i;
-			while (CORE_MAP[j] > 0) {
-				// kprintf("Freeing page %d\n", j);
-				CORE_MAP[j] = 0;
-				j ++;
-			}
-			break;
-		}
-	}
+/*
+ * Address space IDs.
+ *
+ * Each cpu hands out ASIDs 1..NUM_ASID-1 in turn. When it runs out it
+ * starts a new generation: it flushes its TLB, which forgets every
+ * ASID it has handed out, and address spaces get a fresh one the next
+ * time they are activated there. as_asid[cpu] holds the generation
+ * above the ASID itself, so an ASID from an old generation is seen to
+ * be stale without visiting every address space. A zero as_asid never
+ * matches (generations start at 1).
+ *
+ * This is only ever touched by its own cpu with interrupts off.
+ */
+struct asid_info {
+	uint32_t ai_gen;	/* current generation */
+	uint32_t ai_next;	/* next ASID to hand out */
+	uint32_t ai_cur;	/* ASID now loaded in c0_entryhi */
+};
+static struct asid_info asids[MAXCPUS];
 
-}
+#define ASID_NUM(a)   ((a) & (NUM_ASID - 1))
+#define ASID_GEN(a)   ((a) >> TLBHI_PIDSHIFT)
+#define ASID_MAKE(gen, num)  (((gen) << TLBHI_PIDSHIFT) | (num))
 
+static
 void
-vm_tlbshootdown_all(void)
+asid_bootstrap(void)
 {
-	panic("dumbvm tried to do tlb shootdown?!\n");
-}
+	unsigned i;
 
-void
-vm_tlbshootdown(const struct tlbshootdown *ts)
-{
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	for (i=0; i<MAXCPUS; i++) {
+		asids[i].ai_gen = 1;
+		asids[i].ai_next = 1;
+		asids[i].ai_cur = 0;
+	}
 }
 
-int
-vm_fault(int faulttype, vaddr_t faultaddress)
+/*
+ * Invalidate this cpu's whole TLB. Call with interrupts off.
+ */
+static
+void
+tlb_flush(void)
 {
-	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
-	paddr_t paddr;
 	int i;
-	uint32_t ehi, elo;
-	struct addrspace *as;
-	int spl;
-	bool READONLY = false;
 
-	faultaddress &= PAGE_FRAME;
-
-	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
-
-	switch (faulttype) {
-	    case VM_FAULT_READONLY:
-			return EPERM; // tried to read to write-only
-	    case VM_FAULT_READ:
-	    case VM_FAULT_WRITE:
-		break;
-	    default:
-		return EINVAL;
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+	vmstats_inc(VMSTAT_TLB_INVALIDATE);
+}
 
-	if (curproc == NULL) {
-		/*
-		 * No process. This is probably a kernel fault early
-		 * in boot. Return EFAULT so as to panic instead of
-		 * getting into an infinite faulting loop.
-		 */
-		return EFAULT;
-	}
+/*
+ * AS's ASID on this cpu, or 0 if it has none in the current generation
+ * (in which case this cpu's TLB holds nothing of AS's). Call with
+ * interrupts off.
+ */
+static
+uint32_t
+asid_lookup(struct addrspace *as)
+{
+	struct asid_info *ai = &asids[curcpu->c_number];
+	uint32_t a;
 
-	as = curproc_getas();
-	if (as == NULL) {
-		/*
-		 * No address space set up. This is probably also a
-		 * kernel fault early in boot.
-		 */
-		return EFAULT;
+	a = as->as_asid[curcpu->c_number];
+	if (ASID_GEN(a) != ai->ai_gen) {
+		return 0;
 	}
+	return ASID_NUM(a);
+}
 
-	/* Assert that the address space has been set up properly. */
-	KASSERT(as->as_vbase1 != 0);
-	KASSERT(as->as_pbase1 != 0);
-	KASSERT(as->as_npages1 != 0);
-	KASSERT(as->as_vbase2 != 0);
-	KASSERT(as->as_pbase2 != 0);
-	KASSERT(as->as_npages2 != 0);
-	KASSERT(as->as_stackpbase != 0);
-	KASSERT((as->as_vbase1 & PAGE_FRAME) == as->as_vbase1);
-	KASSERT((as->as_pbase1 & PAGE_FRAME) == as->as_pbase1);
-	KASSERT((as->as_vbase2 & PAGE_FRAME) == as->as_vbase2);
-	KASSERT((as->as_pbase2 & PAGE_FRAME) == as->as_pbase2);
-	KASSERT((as->as_stackpbase & PAGE_FRAME) == as->as_stackpbase);
+/*
+ * Make AS's translations the ones the TLB matches on this cpu, giving
+ * it an ASID first if it doesn't have one. Returns the ASID. Call with
+ * interrupts off.
+ */
+static
+uint32_t
+asid_activate(struct addrspace *as)
+{
+	struct asid_info *ai = &asids[curcpu->c_number];
+	uint32_t asid;
+
+	asid = asid_lookup(as);
+	if (asid == 0) {
+		if (ai->ai_next == NUM_ASID) {
+			/* Out of ASIDs; start a new generation. */
+			ai->ai_gen++;
+			ai->ai_next = 1;
+			tlb_flush();
+		}
+		asid = ai->ai_next++;
+		as->as_asid[curcpu->c_number] = ASID_MAKE(ai->ai_gen, asid);
+	}
 
-	vbase1 = as->as_vbase1;
-	vtop1 = vbase1 + as->as_npages1 * PAGE_SIZE;
-	vbase2 = as->as_vbase2;
-	vtop2 = vbase2 + as->as_npages2 * PAGE_SIZE;
-	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
-	stacktop = USERSTACK;
+	ai->ai_cur = asid;
+	tlb_setasid(asid);
+	return asid;
+}
 
+/*
+ * Drop this cpu's TLB entry for VADDR in AS, if it has one. Call with
+ * interrupts off.
+ */
+static
+void
+tlb_unload(struct addrspace *as, vaddr_t vaddr)
+{
+	uint32_t asid;
+	int i;
 
-	// check to make sure this actually points to the code area!
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		if (as->LOADED) READONLY = true;
+	asid = asid_lookup(as);
+	if (asid == 0) {
+		return;
 	}
 
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
-		paddr = (faultaddress - vbase1) + as->as_pbase1;
-	}
-	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
-		paddr = (faultaddress - vbase2) + as->as_pbase2;
-	}
-	else if (faultaddress >= stackbase && faultaddress < stacktop) {
-		paddr = (faultaddress - stackbase) + as->as_stackpbase;
-	}
-	else {
-		return EFAULT;
+	i = tlb_probe(vaddr | (asid << TLBHI_PIDSHIFT), 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
 	}
+	tlb_setasid(asids[curcpu->c_number].ai_cur);
+}
 
-	/* make sure it's page-aligned */
-	KASSERT((paddr & PAGE_FRAME) == paddr);
+void
+vm_tlbshootdown_all(void)
+{
+	int spl;
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
-
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
-			continue;
-		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		if (READONLY) elo &= ~TLBLO_DIRTY;
-		DEBUG(DB_THREADS, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
-	}
-
-	ehi = faultaddress;
-	elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-	if (READONLY) elo &= ~TLBLO_DIRTY;
-	tlb_random(ehi, elo);
+	tlb_flush();
+	tlb_setasid(asids[curcpu->c_number].ai_cur);
 	splx(spl);
-	return 0;
 }
 
-struct addrspace *
-as_create(void)
+void
+vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	struct addrspace *as = kmalloc(sizeof(struct addrspace));
-	if (as==NULL) {
-		return NULL;
-	}
-
-	as->as_vbase1 = 0;
-	as->as_pbase1 = 0;
-	as->as_npages1 = 0;
-	as->as_vbase2 = 0;
-	as->as_pbase2 = 0;
-	as->as_npages2 = 0;
-	as->as_stackpbase = 0;
+	int spl;
 
-	as->LOADED = false;
+	spl = splhigh();
+	tlb_unload(ts->ts_addrspace, ts->ts_vaddr);
+	splx(spl);
+}
 
-	return as;
+void
+vm_tlbbatch_init(struct tlbbatch *tb)
+{
+	tb->tb_count = 0;
 }
 
 void
-as_destroy(struct addrspace *as)
+vm_tlbbatch_add(struct tlbbatch *tb, struct addrspace *as, vaddr_t vaddr)
 {
-	kfree(as);
+	if (tb->tb_count == TLBSHOOTDOWN_MAX) {
+		vm_tlbbatch_flush(tb);
+	}
+	tb->tb_entries[tb->tb_count].ts_addrspace = as;
+	tb->tb_entries[tb->tb_count].ts_vaddr = vaddr;
+	tb->tb_count++;
+}
+
+/*
+ * Could cpu number CPU have TLB entries for AS? Only if AS has an ASID
+ * there from that cpu's current generation. This is read without any
+ * locking, which is safe because callers have already stopped new
+ * entries for the pages in question from being loaded (PTE_BUSY): a
+ * cpu that gives AS a fresh ASID after our check can only load entries
+ * for other pages.
+ */
+static
+bool
+asid_live(struct addrspace *as, unsigned cpu)
+{
+	uint32_t a = as->as_asid[cpu];
+
+	return ASID_NUM(a) != 0 && ASID_GEN(a) == asids[cpu].ai_gen;
 }
 
 void
-as_activate(void)
+vm_tlbbatch_flush(struct tlbbatch *tb)
 {
-	int i, spl;
-	struct addrspace *as;
+	unsigned tickets[MAXCPUS];
+	bool sent[MAXCPUS];
+	struct cpu *c;
+	unsigned i, j, ncpus, nipis, usec;
+	time_t secs1, secs2, rsecs;
+	uint32_t nsecs1, nsecs2, rnsecs;
+	bool need;
+	int spl;
 
-	as = curproc_getas();
-#ifdef UW
-        /* Kernel threads don't have an address spaces to activate */
-#endif
-	if (as == NULL) {
+	if (tb->tb_count == 0) {
 		return;
 	}
 
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+	/*
+	 * Interrupts stay off while the IPIs go out so that we cannot
+	 * migrate and miss a cpu.
+	 */
+	ncpus = cpu_count();
+	nipis = 0;
 	spl = splhigh();
+	for (j=0; j<tb->tb_count; j++) {
+		tlb_unload(tb->tb_entries[j].ts_addrspace,
+			   tb->tb_entries[j].ts_vaddr);
+	}
+	for (i=0; i<ncpus; i++) {
+		sent[i] = false;
+		c = cpu_get(i);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		need = false;
+		for (j=0; j<tb->tb_count && !need; j++) {
+			need = asid_live(tb->tb_entries[j].ts_addrspace,
+					 c->c_number);
+		}
+		if (need) {
+			tickets[i] = ipi_tlbshootdown_batch(c, tb->tb_entries,
+							    tb->tb_count);
+			sent[i] = true;
+			nipis++;
+		}
+	}
+	splx(spl);
 
-	for (i=0; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	usec = 0;
+	if (nipis > 0) {
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<ncpus; i++) {
+			if (sent[i]) {
+				ipi_tlbshootdown_wait(cpu_get(i), tickets[i]);
+			}
+		}
+		gettime(&secs2, &nsecs2);
+		getinterval(secs1, nsecs1, secs2, nsecs2, &rsecs, &rnsecs);
+		usec = rsecs * 1000000 + rnsecs / 1000;
 	}
 
-	splx(spl);
+	spinlock_acquire(&tlbstats_lock);
+	tlbstats_rounds++;
+	tlbstats_pages += tb->tb_count;
+	tlbstats_ipis += nipis;
+	tlbstats_waitusec += usec;
+	spinlock_release(&tlbstats_lock);
+
+	tb->tb_count = 0;
 }
 
 void
-as_deactivate(void)
+vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr)
 {
-	/* nothing */
+	struct tlbbatch tb;
+
+	vm_tlbbatch_init(&tb);
+	vm_tlbbatch_add(&tb, as, vaddr);
+	vm_tlbbatch_flush(&tb);
 }
 
-int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
-		 int readable, int writeable, int executable)
+void
+vm_tlbstats_print(void)
 {
-	size_t npages; 
+	unsigned rounds, pages, ipis, usec;
 
-	/* Align the region. First, the base... */
-	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
-	vaddr &= PAGE_FRAME;
+	spinlock_acquire(&tlbstats_lock);
+	rounds = tlbstats_rounds;
+	pages = tlbstats_pages;
+	ipis = tlbstats_ipis;
+	usec = tlbstats_waitusec;
+	spinlock_release(&tlbstats_lock);
 
-	/* ...and now the length. */
-	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+	kprintf("TLB shootdown: %u rounds, %u pages, %u IPIs, "
+		"%u usec waiting for acks\n", rounds, pages, ipis, usec);
+}
 
-	npages = sz / PAGE_SIZE;
+/*
+ * Put a translation for VADDR in AS into the TLB. If the page is
+ * already there (a write to a read-only entry that we have just made
+ * writable) overwrite that entry; otherwise prefer an empty slot over
+ * evicting a random one. Call with interrupts off.
+ */
+static
+void
+tlb_load(struct addrspace *as, vaddr_t vaddr, uint32_t elo)
+{
+	uint32_t ehi, oldehi, oldelo;
+	uint32_t asid;
+	int i;
 
-	/* We don't use these - all pages are read-write */
-	(void)readable;
-	(void)writeable;
-	(void)executable;
+	asid = asid_activate(as);
+	ehi = vaddr | (asid << TLBHI_PIDSHIFT);
 
-	if (as->as_vbase1 == 0) {
-		as->as_vbase1 = vaddr;
-		as->as_npages1 = npages;
-		return 0;
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		goto done;
 	}
 
-	if (as->as_vbase2 == 0) {
-		as->as_vbase2 = vaddr;
-		as->as_npages2 = npages;
-		return 0;
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&oldehi, &oldelo, i);
+		if (oldelo & TLBLO_VALID) {
+			continue;
+		}
+		tlb_write(ehi, elo, i);
+		vmstats_inc(VMSTAT_TLB_FAULT_FREE);
+		goto done;
 	}
 
-	/*
-	 * Support for more than two regions is not available.
-	 */
-	kprintf("dumbvm: Warning: too many regions\n");
-	return EUNIMP;
+	tlb_random(ehi, elo);
+	vmstats_inc(VMSTAT_TLB_FAULT_REPLACE);
+
+ done:
+	/* All of the above clobbered c0_entryhi. */
+	tlb_setasid(asid);
 }
 
+/*
+ * Fault-around. Having just loaded VADDR, also load the other resident
+ * pages of region VR that are in the same aligned window, so a program
+ * walking through memory takes one miss per window instead of one per
+ * page. Only free TLB slots are used; entries the program is actively
+ * using are never pushed out for a guess. Call with AS's as_lock held.
+ */
 static
 void
-as_zero_region(paddr_t paddr, unsigned npages)
-{
-	bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
-}
-
-int
-as_prepare_load(struct addrspace *as)
+tlb_faultaround(struct addrspace *as, struct vm_region *vr, vaddr_t vaddr,
+		bool writeable)
 {
-	KASSERT(as->as_pbase1 == 0);
-	KASSERT(as->as_pbase2 == 0);
-	KASSERT(as->as_stackpbase == 0);
-
-	as->as_pbase1 = getppages(as->as_npages1);
-	if (as->as_pbase1 == 0) {
-		return ENOMEM;
+	vaddr_t start, end, va;
+	uint32_t ehi, elo, oldehi, oldelo, asid;
+	pte_t *pte;
+	unsigned window;
+	int slot;
+
+	window = vm_faultaround;
+	if (window <= 1) {
+		return;
 	}
 
-	as->as_pbase2 = getppages(as->as_npages2);
-	if (as->as_pbase2 == 0) {
-		return ENOMEM;
+	/* The window, clipped to the region. */
+	start = vaddr & ~(vaddr_t)(window * PAGE_SIZE - 1);
+	end = start + window * PAGE_SIZE;
+	if (start < vr->vr_base) {
+		start = vr->vr_base;
+	}
+	if (end > vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+		end = vr->vr_base + vr->vr_npages * PAGE_SIZE;
 	}
 
-	as->as_stackpbase = getppages(DUMBVM_STACKPAGES);
-	if (as->as_stackpbase == 0) {
-		return ENOMEM;
+	asid = asid_activate(as);
+	slot = 0;
+	for (va = start; va < end; va += PAGE_SIZE) {
+		if (va == vaddr) {
+			continue;
+		}
+		pte = pt_lookup(as->as_pt, va, false);
+		if (pte == NULL ||
+		    (*pte & (PTE_VALID | PTE_BUSY)) != PTE_VALID) {
+			continue;
+		}
+
+		ehi = va | (asid << TLBHI_PIDSHIFT);
+		if (tlb_probe(ehi, 0) >= 0) {
+			continue;
+		}
+
+		/* Next free slot, if any are left. */
+		for (; slot < NUM_TLB; slot++) {
+			tlb_read(&oldehi, &oldelo, slot);
+			if ((oldelo & TLBLO_VALID) == 0) {
+				break;
+			}
+		}
+		if (slot == NUM_TLB) {
+			break;
+		}
+
+		/* Same rules as vm_fault for making it writable. */
+		elo = (*pte & PTE_FRAME) | TLBLO_VALID;
+		if (writeable && (*pte & PTE_DIRTY) && !(*pte & PTE_COW)) {
+			elo |= TLBLO_DIRTY;
+		}
+		tlb_write(ehi, elo, slot);
+		slot++;
+		vmstats_inc(VMSTAT_TLB_FAULTAROUND);
 	}
-	
-	as_zero_region(as->as_pbase1, as->as_npages1);
-	as_zero_region(as->as_pbase2, as->as_npages2);
-	as_zero_region(as->as_stackpbase, DUMBVM_STACKPAGES);
 
-	return 0;
+	tlb_setasid(asid);
 }
 
 int
-as_complete_load(struct addrspace *as)
+vm_setfaultaround(unsigned npages)
 {
-	(void)as;
+	if (npages == 0 || npages > VM_FAULTAROUND_MAX ||
+	    (npages & (npages - 1)) != 0) {
+		return EINVAL;
+	}
+	vm_faultaround = npages;
 	return 0;
 }
 
-int
-as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+/*
+ * Get a frame for a user page, paging something else out if need be.
+ * If there is truly nothing left, have the OOM killer pick a victim
+ * and wait for it to exit. Returns 0 if this process is the victim
+ * (so its fault fails and it dies) or memory never turns up.
+ */
+static
+paddr_t
+getuserpage(void)
 {
-	KASSERT(as->as_stackpbase != 0);
+	struct proc *victim;
+	paddr_t paddr;
+	unsigned tries;
 
-	*stackptr = USERSTACK;
+	for (tries = 0; tries <= VM_OOM_RETRIES; tries++) {
+		paddr = coremap_alloc(1);
+		if (paddr == 0) {
+			paddr = reclaim_ppages(1);
+		}
+		if (paddr != 0) {
+			return paddr;
+		}
+
+		victim = proc_oom_kill();
+		if (victim == NULL || victim == curproc) {
+			return 0;
+		}
+		thread_yield();
+	}
 	return 0;
 }
 
+/*
+ * Produce a frame for page VADDR of region VR whose entry was OLD (and
+ * is now marked busy): a private copy of a shared frame, the page read
+ * back from swap, or the page's initial contents. Sets *NEW to the
+ * entry to install. Sleeps; call with no spinlocks held.
+ */
+static
 int
-as_copy(struct addrspace *old, struct addrspace **ret)
+vm_pagein(struct vm_region *vr, vaddr_t vaddr, pte_t old, pte_t *new)
 {
-	struct addrspace *new;
+	paddr_t paddr;
+	bool readfile;
+	unsigned pcgen;
+	int result;
+
+	pcgen = 0;
+	if (old == 0 && pagecache_cacheable(vr)) {
+		/* Someone else running this program may have it already. */
+		paddr = pagecache_lookup(vr, vaddr, &pcgen);
+		if (paddr != 0) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_CACHED);
+			*new = paddr | PTE_VALID | PTE_COW;
+			return 0;
+		}
+	}
 
-	new = as_create();
-	if (new==NULL) {
+	if (old == 0 && !as_page_hasfile(vr, vaddr)) {
+		/* All zeros; see if the zeroing thread got here first. */
+		paddr = zeropool_get();
+		if (paddr != 0) {
+			vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+			*new = paddr | PTE_VALID;
+			return 0;
+		}
+	}
+
+	paddr = getuserpage();
+	if (paddr == 0) {
 		return ENOMEM;
 	}
 
-	new->as_vbase1 = old->as_vbase1;
-	new->as_npages1 = old->as_npages1;
-	new->as_vbase2 = old->as_vbase2;
-	new->as_npages2 = old->as_npages2;
+	if (old & PTE_VALID) {
+		/* First write to a shared page since fork. */
+		memmove((void *)PADDR_TO_KVADDR(paddr),
+			(const void *)PADDR_TO_KVADDR(old & PTE_FRAME),
+			PAGE_SIZE);
+		*new = paddr | PTE_VALID | PTE_DIRTY;
+		return 0;
+	}
+
+	if (old & PTE_SWAPPED) {
+		result = swap_in(PTE_SLOT(old), paddr);
+		if (result) {
+			coremap_free(paddr);
+			return result;
+		}
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		/* The slot is about to go, so memory is the only copy. */
+		*new = paddr | PTE_VALID | PTE_DIRTY;
+		return 0;
+	}
+
+	/* First touch: zeroes, or read from the executable. */
+	result = as_fill_page(vr, vaddr, paddr, &readfile);
+	if (result) {
+		coremap_free(paddr);
+		return result;
+	}
+	*new = paddr | PTE_VALID;
+	if (readfile) {
+		vmstats_inc(VMSTAT_ELF_FILE_READ);
+		vmstats_inc(VMSTAT_PAGE_FAULT_DISK);
+		if (pagecache_cacheable(vr) &&
+		    pagecache_insert(vr, vaddr, paddr, pcgen)) {
+			/* Shared with the cache now. */
+			*new |= PTE_COW;
+		}
+	}
+	else {
+		vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
+	}
+	return 0;
+}
 
-	/* (Mis)use as_prepare_load to allocate some physical memory. */
-	if (as_prepare_load(new)) {
-		as_destroy(new);
+int
+vm_fault(int faulttype, vaddr_t faultaddress)
+{
+	struct addrspace *as;
+	struct vm_region *vr;
+	pte_t *pte, old, new;
+	paddr_t paddr;
+	uint32_t elo;
+	bool writeable, write;
+	int result;
+
+	faultaddress &= PAGE_FRAME;
+
+	DEBUG(DB_VM, "dumbvm: fault: 0x%x\n", faultaddress);
+
+	switch (faulttype) {
+	    case VM_FAULT_READONLY:
+	    case VM_FAULT_READ:
+	    case VM_FAULT_WRITE:
+		break;
+	    default:
+		return EINVAL;
+	}
+
+	if (curproc == NULL) {
+		/*
+		 * No process. This is probably a kernel fault early
+		 * in boot. Return EFAULT so as to panic instead of
+		 * getting into an infinite faulting loop.
+		 */
+		return EFAULT;
+	}
+
+	as = curproc_getas();
+	if (as == NULL) {
+		/*
+		 * No address space set up. This is probably also a
+		 * kernel fault early in boot.
+		 */
+		return EFAULT;
+	}
+
+	vmstats_inc(VMSTAT_TLB_FAULT);
+
+	vr = as_find_region(as, faultaddress);
+	if (vr == NULL) {
+		vr = as_grow_stack(as, faultaddress);
+		if (vr == NULL) {
+			return EFAULT;
+		}
+	}
+
+	/* load_elf needs to be able to fill in read-only segments. */
+	writeable = (vr->vr_flags & VR_WRITE) || as->as_loading;
+	write = faulttype != VM_FAULT_READ;
+	if (faulttype == VM_FAULT_READONLY && !writeable) {
+		return EPERM; // tried to write to a read-only page
+	}
+
+	/* Allocate the second-level table, if needed, before locking. */
+	pte = pt_lookup(as->as_pt, faultaddress, true);
+	if (pte == NULL) {
 		return ENOMEM;
 	}
 
-	KASSERT(new->as_pbase1 != 0);
-	KASSERT(new->as_pbase2 != 0);
-	KASSERT(new->as_stackpbase != 0);
+	spinlock_acquire(&as->as_lock);
+
+	if (*pte & PTE_BUSY) {
+		/* Pageout has it. Back off; we'll fault again. */
+		spinlock_release(&as->as_lock);
+		thread_yield();
+		return 0;
+	}
+
+	if ((*pte & PTE_VALID) && (*pte & PTE_COW) &&
+	    coremap_refcount(*pte & PTE_FRAME) == 1) {
+		/* Nobody is sharing it any more; it's ours. */
+		*pte &= ~PTE_COW;
+		coremap_setuser(*pte & PTE_FRAME, as, faultaddress);
+	}
+
+	if ((*pte & PTE_VALID) == 0 ||
+	    (write && writeable && (*pte & PTE_COW))) {
+		/* Needs a frame. Do the slow part without the lock. */
+		old = *pte;
+		*pte |= PTE_BUSY;
+		spinlock_release(&as->as_lock);
+
+		result = vm_pagein(vr, faultaddress, old, &new);
+
+		spinlock_acquire(&as->as_lock);
+		if (result) {
+			*pte = old;
+			spinlock_release(&as->as_lock);
+			return result;
+		}
+		if (vr->vr_flags & VR_SHARED) {
+			new |= PTE_SHARED;
+		}
+		*pte = new;
+		coremap_setuser(new & PTE_FRAME, as, faultaddress);
+	}
+	else {
+		/* Already resident; it just fell out of the TLB. */
+		old = 0;
+		vmstats_inc(VMSTAT_TLB_RELOAD);
+	}
+
+	if (write && writeable) {
+		*pte |= PTE_DIRTY;
+	}
+
+	paddr = *pte & PTE_FRAME;
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase1),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase1),
-		old->as_npages1*PAGE_SIZE);
+	/* make sure it's page-aligned */
+	KASSERT((paddr & PAGE_FRAME) == paddr);
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_pbase2),
-		(const void *)PADDR_TO_KVADDR(old->as_pbase2),
-		old->as_npages2*PAGE_SIZE);
+	/*
+	 * Map it writable only once it has actually been written (so
+	 * pageout can tell clean pages from dirty ones) and only if it
+	 * is not shared.
+	 */
+	elo = paddr | TLBLO_VALID;
+	if (writeable && (*pte & PTE_DIRTY) && !(*pte & PTE_COW)) {
+		elo |= TLBLO_DIRTY;
+	}
+	coremap_touch(paddr);
 
-	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
-		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
-		DUMBVM_STACKPAGES*PAGE_SIZE);
-	
-	*ret = new;
+	/*
+	 * Load the TLB before dropping the lock (which also has
+	 * interrupts off), so pageout cannot slip in between and leave
+	 * this entry behind after its shootdown.
+	 */
+	DEBUG(DB_THREADS, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+	tlb_load(as, faultaddress, elo);
+	tlb_faultaround(as, vr, faultaddress, writeable);
+	spinlock_release(&as->as_lock);
+
+	/* Drop our share of whatever the new frame replaced. */
+	if (old & PTE_VALID) {
+		coremap_free(old & PTE_FRAME);
+	}
+	else if (old & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(old));
+	}
 	return 0;
 }
 
-void print_coremap() {
-	for (int i = 0; i < 900; i ++) {
-		kprintf("Frame %d,      address %x,       page %d\n",i, mem_start + i * PAGE_SIZE, CORE_MAP[i]);
+/*
+ * No TLB flush here: other address spaces' entries carry their own
+ * ASIDs and stay put, ready for when those processes run again.
+ */
+void
+as_activate(void)
+{
+	int spl;
+	struct addrspace *as;
+
+	as = curproc_getas();
+#ifdef UW
+        /* Kernel threads don't have an address spaces to activate */
+#endif
+	if (as == NULL) {
+		return;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+	asid_activate(as);
+	splx(spl);
+}
+
+void
+as_tlbflush(struct addrspace *as)
+{
+	unsigned i;
+	int spl;
+
+	/*
+	 * Orphan AS's ASIDs everywhere rather than hunting down its
+	 * entries. The old ASIDs are never handed out again within
+	 * their generation, so the entries can never match again.
+	 */
+	spl = splhigh();
+	for (i=0; i<MAXCPUS; i++) {
+		as->as_asid[i] = 0;
 	}
+	if (as == curproc_getas()) {
+		asid_activate(as);
+	}
+	splx(spl);
+}
+
+void
+as_deactivate(void)
+{
+	/* nothing */
 }
@@ -73,6 +73,22 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Set c0_count, which the timer counts in.
+ */
+static
+void
+mips_timer_setcount(uint32_t count)
+{
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mtc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		:: "r" (count));
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -242,6 +258,27 @@ mainbus_send_ipi(struct cpu *target)
 	lamebus_assert_ipi(lamebus, target);
 }
 
+/*
+ * Stop and restart the on-chip timer. There is no way to turn it off,
+ * so push the next interrupt as far out as it goes (about three
+ * minutes at 25 MHz); a stray hardclock on an idle cpu just stops it
+ * again. Restarting starts a full tick from now, wherever the count
+ * had got to.
+ */
+void
+mainbus_hardclock_stop(void)
+{
+	mips_timer_setcount(0);
+	mips_timer_set(0xffffffff);
+}
+
+void
+mainbus_hardclock_start(void)
+{
+	mips_timer_setcount(0);
+	mips_timer_set(CPU_FREQUENCY / HZ);
+}
+
 /*
  * Interrupt dispatcher.
  */
@@ -36,26 +36,93 @@
 
 
 #include <vm.h>
+#include <spinlock.h>
+#include <platform/maxcpus.h>
 
 struct vnode;
 
 
+/*
+ * A region is a contiguous, page-aligned range of the address space
+ * that the program is allowed to touch (a segment from the
+ * executable, or the stack). Pages in a region are not backed by
+ * physical memory until they are first touched; see vm_fault.
+ *
+ * A region loaded from the executable also records where its contents
+ * live: the vr_filesz bytes starting at vr_filestart come from the
+ * vnode at offset vr_fileoff, and everything else is zero-filled. The
+ * region holds a reference to the vnode.
+ *
+ * The stack region (VR_STACK) starts out one page long and grows down
+ * when the program faults below it (as_grow_stack), up to as_stacklimit
+ * pages. It never grows to within VM_STACKGUARD pages of the region
+ * below it, so running off the end of the stack is a fault rather than
+ * quiet corruption of the heap or data.
+ *
+ * The heap region (VR_HEAP) sits on top of the executable's segments,
+ * from as_heapbase up to the break, as_heaptop, rounded up to a page.
+ * It is created by the first sbrk that grows it past as_heapbase and
+ * goes away again if sbrk shrinks it back to nothing. It may not grow
+ * into the range the stack is allowed to grow into.
+ *
+ * mmap regions (VR_MMAP) are file-backed regions placed as high as
+ * they fit below the stack's range. With VR_SHARED, changes are
+ * written back to the file; otherwise they are private to the process.
+ */
+
+#define VR_READ   0x1
+#define VR_WRITE  0x2
+#define VR_EXEC   0x4
+#define VR_STACK  0x8
+#define VR_HEAP   0x10
+#define VR_MMAP   0x20
+#define VR_SHARED 0x40
+
+#define VM_STACKLIMIT  256	/* default maximum stack size, in pages */
+#define VM_STACKGUARD  4	/* unmapped pages kept below the stack */
+
+struct vm_region {
+	vaddr_t vr_base;		/* first address (page-aligned) */
+	size_t vr_npages;		/* length in pages */
+	unsigned vr_flags;		/* VR_* permissions */
+	struct vm_region *vr_next;	/* next region, in address order */
+
+	struct vnode *vr_vnode;		/* backing file, or NULL */
+	off_t vr_fileoff;		/* file offset of vr_filestart */
+	vaddr_t vr_filestart;		/* first address backed by the file */
+	size_t vr_filesz;		/* number of bytes backed by the file */
+};
+
 /* 
  * Address space - data structure associated with the virtual memory
  * space of a process.
  *
- * You write this.
+ * as_loading is set between as_prepare_load and as_complete_load so
+ * that load_elf can write into read-only segments.
+ *
+ * as_lock protects the page table entries, which pageout may change
+ * behind the owning process's back (see <swap.h>). Regions are only
+ * unlinked with it held, so pageout may search the list under it.
+ *
+ * as_asid is the hardware address space ID the address space has on
+ * each cpu; it belongs to the machine-dependent code (see as_activate).
+ *
+ * Every address space is on one list (as_next/as_prev), so that pageout
+ * can find all the mappings of a frame several of them share. The list
+ * is protected by the pageout lock.
  */
 
 struct addrspace {
-  vaddr_t as_vbase1;
-  paddr_t as_pbase1;
-  size_t as_npages1;
-  vaddr_t as_vbase2;
-  paddr_t as_pbase2;
-  size_t as_npages2;
-  paddr_t as_stackpbase;
-  bool LOADED;
+	struct vm_region *as_regions;	/* sorted by address */
+	struct pagetable *as_pt;	/* virtual -> physical mappings */
+	struct spinlock as_lock;
+	bool as_loading;
+	size_t as_stacklimit;		/* in pages */
+	vaddr_t as_heapbase;		/* start of the heap */
+	vaddr_t as_heaptop;		/* the break; see as_sbrk */
+	uint32_t as_asid[MAXCPUS];
+	struct addrspace *as_next;	/* list of all address spaces */
+	struct addrspace *as_prev;
 };
 
 /*
@@ -77,6 +144,9 @@ struct addrspace {
  *    as_deactivate - unload curproc's address space so it isn't
  *                currently "seen" by the processor.
  *
+ *    as_tlbflush - make every cpu forget the address space's TLB
+ *                entries, e.g. after making pages read-only.
+ *
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
@@ -92,12 +162,54 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_define_filebacked - make the region containing VADDR load its
+ *                contents on demand from FILESZ bytes of V at OFFSET.
+ *
+ *    as_find_region - return the region containing VADDR, or NULL.
+ *
+ *    as_grow_stack - if VADDR is just below the stack and within its
+ *                limit, extend the stack down to cover it and return
+ *                the stack region; otherwise return NULL.
+ *
+ *    as_sbrk   - move the break by AMOUNT bytes (which may be negative)
+ *                and hand back the old break in *OLDTOP. Pages released
+ *                by shrinking are freed. Fails with EINVAL if the break
+ *                would drop below as_heapbase and ENOMEM if the heap
+ *                would run into the stack.
+ *
+ *    as_mmap   - map the first FILESZ bytes of V into a new region of
+ *                LENGTH bytes with VR_* flags FLAGS, and hand back its
+ *                address in *ADDR. The rest of the region reads as zeros.
+ *
+ *    as_munmap - remove the mmap region at ADDR, which must be LENGTH
+ *                bytes long, writing back its dirty shared pages.
+ *
+ *    as_fill_page - fill the frame PADDR with the initial contents of
+ *                the page at VADDR in region VR: zeros, plus whatever
+ *                part of the page is backed by the file. Sets *READFILE
+ *                if the file was read.
+ *
+ *    as_write_page - write page VADDR of shared mapping VR, held in
+ *                the frame PADDR, back to the file.
+ *
+ *    as_page_hasfile - true if any of page VADDR of region VR comes
+ *                from the file (so it is not simply zero-filled).
+ *
+ *    as_rss    - number of pages of AS resident in memory, including
+ *                frames it shares with others.
+ *
+ *    as_foreach - call FUNC on every address space, stopping at and
+ *                returning the first nonzero value FUNC returns. Call
+ *                with the pageout lock held, which keeps address spaces
+ *                from being created or destroyed meanwhile.
  */
 
 struct addrspace *as_create(void);
 int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
+void              as_tlbflush(struct addrspace *as);
 void              as_destroy(struct addrspace *);
 
 int               as_define_region(struct addrspace *as, 
@@ -108,6 +220,26 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_define_filebacked(struct addrspace *as, vaddr_t vaddr,
+                                       struct vnode *v, off_t offset,
+                                       size_t filesz);
+struct vm_region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+struct vm_region *as_grow_stack(struct addrspace *as, vaddr_t vaddr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldtop);
+int               as_mmap(struct addrspace *as, struct vnode *v,
+                          size_t length, unsigned flags, size_t filesz,
+                          vaddr_t *addr);
+int               as_munmap(struct addrspace *as, vaddr_t addr,
+                            size_t length);
+int               as_fill_page(struct vm_region *vr, vaddr_t vaddr,
+                               paddr_t paddr, bool *readfile);
+int               as_write_page(struct vm_region *vr, vaddr_t vaddr,
+                                paddr_t paddr);
+bool              as_page_hasfile(struct vm_region *vr, vaddr_t vaddr);
+unsigned          as_rss(struct addrspace *as);
+int               as_foreach(int (*func)(struct addrspace *as, void *data),
+                             void *data);
 
 
 /*
@@ -35,8 +35,10 @@
 /*
  * Time-related definitions.
  *
- * hardclock() is called on every CPU HZ times a second, possibly only
- * when the CPU is not idle, for scheduling.
+ * hardclock() is called on every CPU HZ times a second, for
+ * scheduling, but only while the CPU is busy. A CPU that goes idle
+ * stops its hardclock; thread_switch calls hardclock_resume() when it
+ * has a thread to run again.
  *
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -57,6 +59,7 @@
 #endif
 
 void hardclock_bootstrap(void);
+void hardclock_resume(void);
 
 void hardclock(void);
 void timerclock(void);
@@ -71,7 +74,8 @@ void getinterval(time_t secs1, uint32_t nsecs,
  * clocksleep() suspends execution for the requested number of seconds,
  * like userlevel sleep(3). (Don't confuse it with wchan_sleep.)
  *
- *  this will be more efficient than clocknap() for longer sleeps
+ * Sleepers wait on a timer wheel (see clock.c), so only the ones whose
+ * time is up wake on each timer tick.
  */
 void clocksleep(int seconds);
 
@@ -83,5 +87,11 @@ void clocksleep(int seconds);
  */
 void clocknap(int ticks);
 
+/*
+ * clocknanosleep() suspends execution for at least SECS seconds and
+ * NSECS nanoseconds, in whole timer ticks. (For nanosleep.)
+ */
+void clocknanosleep(time_t secs, uint32_t nsecs);
+
 
 #endif /* _CLOCK_H_ */
@@ -0,0 +1,186 @@
+#ifndef _COREMAP_H_
+#define _COREMAP_H_
+
+/*
+ * Physical page frame allocator.
+ *
+ * Once vm_bootstrap has run, all physical memory that is not already
+ * occupied by the kernel image or by pages stolen during early boot
+ * is managed here, one struct coremap_entry per page frame.
+ *
+ * Frames are handed out by a binary buddy allocator: free memory is
+ * kept as naturally aligned blocks of 2^k frames on per-order free
+ * lists, so allocating or freeing a run is O(log frames) and never
+ * needs to walk the coremap. A physical address is turned into its
+ * coremap entry by direct indexing. Runs are exactly as long as asked
+ * for (the rest of the buddy block goes back), and the first frame
+ * records the length.
+ *
+ *    coremap_bootstrap - take over the rest of physical memory. Called
+ *                        once from vm_bootstrap.
+ *
+ *    coremap_alloc     - allocate NPAGES physically contiguous frames.
+ *                        Returns 0 if no suitable block is free.
+ *
+ *    coremap_free      - free a run previously returned by
+ *                        coremap_alloc. PADDR must be the first frame
+ *                        of the run. If the frame has been shared with
+ *                        coremap_share, this only drops one reference
+ *                        and the frame is freed when the last one goes.
+ *
+ *    coremap_resize    - make the run at PADDR, which must be a single
+ *                        unshared kernel allocation, NPAGES long, in
+ *                        place. Shrinking always works; growing fails
+ *                        with ENOMEM unless the frames just after the
+ *                        run are free.
+ *
+ *    coremap_npages    - length of the allocated run at PADDR, or 0 for
+ *                        memory stolen before the coremap existed.
+ *
+ *    coremap_freecount - number of frames currently free.
+ *
+ *    coremap_freeblocks - copy the number of free blocks of each order
+ *                        (not counting frames in cpu magazines) into
+ *                        COUNTS, which has COREMAP_MAXORDER+1 slots.
+ *
+ *    coremap_printstats - print free-list and usage information.
+ *
+ *    coremap_share     - add a reference to the single frame at PADDR
+ *                        (used for copy-on-write).
+ *
+ *    coremap_refcount  - number of references to the frame at PADDR. A
+ *                        caller holding the only reference can rely on
+ *                        the answer staying 1; anything else is a
+ *                        snapshot.
+ *
+ *    coremap_setkdata  - attach KDATA to the kernel frame at PADDR, for
+ *                        the allocator that has carved it up (kmalloc
+ *                        records the page's pageref; kheapprof tags
+ *                        multi-page blocks), or to a user frame the
+ *                        page cache holds (its entry). Ignored for frames
+ *                        stolen before the coremap existed. Cleared when
+ *                        the frame is freed.
+ *
+ *    coremap_kdata     - what was attached to the frame at PADDR, or
+ *                        NULL. Only meaningful to the frame's owner.
+ *
+ * User pages are candidates for replacement (see <swap.h>):
+ *
+ *    coremap_setuser   - record that the frame at PADDR holds page
+ *                        VADDR of AS and may be paged out. Call with
+ *                        AS's as_lock held, after installing the PTE.
+ *
+ *    coremap_touch     - note that the frame has been referenced.
+ *
+ *    coremap_clock     - advance the clock hand to a user frame that
+ *                        has not been referenced since the hand last
+ *                        passed and is not already being paged out.
+ *                        Marks it busy and returns it with its owner
+ *                        in *AS and the page it holds in *VADDR, or
+ *                        returns 0 if there is no such frame. *AS is
+ *                        NULL if the frame is shared, or has stopped
+ *                        being shared and the remaining user hasn't
+ *                        claimed it with coremap_setuser yet; every
+ *                        user maps it at *VADDR.
+ *
+ *    coremap_release   - finish with a frame from coremap_clock. If
+ *                        EVICTED, the frame now belongs to the caller
+ *                        as if it came from coremap_alloc, whatever
+ *                        references it had before; otherwise
+ *                        it is left with its owner.
+ *
+ * Single frames, which are by far the most common request, are served
+ * from a small per-cpu cache (struct frame_cache, hung off struct cpu)
+ * in front of the buddy lists. Each cpu holds a "loaded" and a
+ * "previous" magazine of free frames and only touches the coremap lock
+ * to refill an empty magazine or drain a full one, FRAMEMAG_SIZE
+ * frames at a time. This is the cpu layer of a magazine allocator;
+ * the buddy lists themselves play the part of the depot.
+ *
+ *    coremap_cpu_init  - initialize a cpu's frame cache. Called from
+ *                        cpu_create; may run before coremap_bootstrap.
+ *
+ *    coremap_cpu_flush - give this cpu's cached frames back to the buddy
+ *                        lists. Called from interprocessor_interrupt
+ *                        for IPI_FRAMEFLUSH.
+ *
+ *    coremap_flushall  - get every cpu to flush its frame cache, so
+ *                        that none of the free frames are out of reach
+ *                        (or kept from coalescing), and wait for them
+ *                        to do it. Sleeps; if called where it can't,
+ *                        only flushes this cpu's.
+ */
+
+#include <vm.h>
+
+struct addrspace;
+
+/* Largest block order we ever build: 2^16 frames = 256M of RAM. */
+#define COREMAP_MAXORDER  16
+
+/* Frame states. */
+#define CM_FREE    0	/* on (or part of a block on) a buddy free list */
+#define CM_KERNEL  1	/* allocated via alloc_kpages (or not yet mapped) */
+#define CM_USER    2	/* mapped in a user address space; evictable */
+
+/* Frames per magazine. */
+#define FRAMEMAG_SIZE  16
+
+struct frame_magazine {
+	unsigned fm_rounds;			/* frames present */
+	paddr_t fm_frames[FRAMEMAG_SIZE];
+};
+
+/*
+ * Per-cpu frame cache. Accessed only by its own cpu, with interrupts
+ * off; no lock.
+ */
+struct frame_cache {
+	struct frame_magazine *fc_loaded;
+	struct frame_magazine *fc_previous;
+	struct frame_magazine fc_mags[2];
+
+	/* statistics */
+	unsigned fc_hits;		/* allocations served from a magazine */
+	unsigned fc_misses;		/* allocations that had to refill */
+	unsigned fc_frees;		/* frees absorbed by a magazine */
+	unsigned fc_drains;		/* full magazines sent back */
+	volatile unsigned fc_flushes;	/* times flushed by IPI */
+};
+
+struct coremap_entry {
+	uint8_t cm_state;	/* CM_* */
+	uint8_t cm_order;	/* block order; valid for a free cm_head */
+	bool cm_head;		/* true for the first frame of a block */
+	uint16_t cm_refcount;	/* references to an allocated block */
+	uint32_t cm_npages;	/* run length; valid for an allocated cm_head */
+	bool cm_busy;		/* being paged out */
+	bool cm_referenced;	/* touched since the clock hand passed */
+	int32_t cm_next;	/* free list links (frame numbers, -1 = none) */
+	int32_t cm_prev;
+	struct addrspace *cm_as;	/* owner, if CM_USER */
+	vaddr_t cm_vaddr;		/* page in cm_as, if CM_USER */
+	void *cm_kdata;			/* see coremap_setkdata */
+};
+
+void coremap_bootstrap(void);
+void coremap_cpu_init(struct frame_cache *fc);
+void coremap_cpu_flush(void);
+void coremap_flushall(void);
+paddr_t coremap_alloc(unsigned long npages);
+void coremap_free(paddr_t paddr);
+int coremap_resize(paddr_t paddr, unsigned long npages);
+unsigned long coremap_npages(paddr_t paddr);
+unsigned coremap_freecount(void);
+void coremap_freeblocks(unsigned *counts);
+void coremap_printstats(void);
+void coremap_share(paddr_t paddr);
+unsigned coremap_refcount(paddr_t paddr);
+void coremap_setkdata(paddr_t paddr, void *kdata);
+void *coremap_kdata(paddr_t paddr);
+void coremap_setuser(paddr_t paddr, struct addrspace *as, vaddr_t vaddr);
+void coremap_touch(paddr_t paddr);
+paddr_t coremap_clock(struct addrspace **as, vaddr_t *vaddr);
+void coremap_release(paddr_t paddr, bool evicted);
+
+#endif /* _COREMAP_H_ */
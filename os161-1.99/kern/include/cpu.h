@@ -34,8 +34,17 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <coremap.h>     /* for struct frame_cache */
+#include <kmalloc.h>     /* for struct kmalloc_cache */
+#include <uw-vmstats.h>  /* for VMSTAT_COUNT */
 
 
+/*
+ * Priority levels in each cpu's run queue; level 0 runs first. See
+ * schedule() in thread.c.
+ */
+#define SCHED_NLEVELS  4
+
 /*
  * Per-cpu structure
  *
@@ -60,13 +69,19 @@ struct cpu {
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
+	bool c_tickless;		/* Hardclock stopped while idle */
+	unsigned c_stealclock;		/* c_hardclocks at last failed steal */
+	uint32_t c_stealseed;		/* Picks steal victims */
+	struct frame_cache c_framecache; /* Free page frames (coremap.c) */
+	struct kmalloc_cache c_kmalloccache; /* Free heap blocks (kmalloc.c) */
+	unsigned c_vmstats[VMSTAT_COUNT]; /* This cpu's share of vmstats */
 
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
 	 */
 	bool c_isidle;			/* True if this cpu is idle */
-	struct threadlist c_runqueue;	/* Run queue for this cpu */
+	struct threadlist c_runqueue[SCHED_NLEVELS]; /* Run queue, by level */
 	struct spinlock c_runqueue_lock;
 
 	/*
@@ -86,6 +101,8 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	unsigned c_shootdown_posted;	/* batches queued (tickets issued) */
+	volatile unsigned c_shootdown_acked;	/* batches done */
 	struct spinlock c_ipi_lock;
 };
 
@@ -109,6 +126,14 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Access to the set of all CPUs, for code that needs to visit each
+ * one (e.g. to sum per-cpu statistics). CPU numbers run from 0 to
+ * cpu_count()-1; cpu_get returns the struct cpu for one of them.
+ */
+unsigned cpu_count(void);
+struct cpu *cpu_get(unsigned num);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -152,6 +177,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_batch queues several mappings with a single IPI and
+ * returns a ticket; ipi_tlbshootdown_wait waits until the target has
+ * invalidated everything up to and including that ticket. If the
+ * target's queue overflows it flushes its whole TLB instead.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -162,10 +191,16 @@ void cpu_halt(void);
 #define IPI_OFFLINE		1	/* CPU is requested to go offline */
 #define IPI_UNIDLE		2	/* Runnable threads are available */
 #define IPI_TLBSHOOTDOWN	3	/* MMU mapping(s) need invalidation */
+#define IPI_FRAMEFLUSH		4	/* Free cached frames (coremap_flushall) */
+#define IPI_KMALLOCFLUSH	5	/* Free cached heap blocks (kmalloc reclaim) */
 
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+unsigned ipi_tlbshootdown_batch(struct cpu *target,
+				const struct tlbshootdown *mappings,
+				unsigned n);
+void ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket);
 
 void interprocessor_interrupt(void);
 
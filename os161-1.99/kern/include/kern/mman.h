@@ -0,0 +1,26 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Definitions for mmap().
+ *
+ * OS/161 has no file descriptors in the kernel yet, so mmap takes a
+ * pathname and always maps the file from offset 0:
+ *
+ *    void *mmap(const char *path, size_t length, int prot, int flags);
+ */
+
+/* Protection bits for mmap's PROT argument. */
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4
+
+/* Flags for mmap's FLAGS argument; exactly one must be given. */
+#define MAP_SHARED    1		/* writes go back to the file */
+#define MAP_PRIVATE   2		/* writes stay in this process */
+
+/* Returned by mmap on failure. */
+#define MAP_FAILED    ((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,67 @@
+#ifndef _KHEAPPROF_H_
+#define _KHEAPPROF_H_
+
+/*
+ * Kernel heap profiling (options kheapprof).
+ *
+ * With the option on, kmalloc charges every block to its call site,
+ * the return address kmalloc was called from, and kheapprof keeps
+ * per-site counts of live blocks and bytes, total allocations, and the
+ * most bytes the site has ever had live at once. The "khp" menu
+ * command prints the sites with the most live bytes.
+ *
+ * Each subpage block carries a KHEAPPROF_TAGSIZE-byte tag in front of
+ * what the caller sees, naming its site and size class; kfree reads it
+ * back to know whom to credit. (So with profiling on, blocks are 8
+ * bytes bigger, and some requests move up a size class.) Multi-page
+ * blocks have to stay page-aligned, so instead their site and length
+ * go in the coremap entry of the first page (coremap_setkdata), where
+ * kmalloc keeps pagerefs for subpage pages; tags are odd and pageref
+ * pointers are not. Bytes are counted as requested for subpage blocks
+ * and in whole pages for multi-page ones.
+ *
+ * Call sites live in a fixed table of KHEAPPROF_NSITES entries. Once
+ * it fills up, new sites are lumped together under a NULL caller.
+ *
+ *    kheapprof_tag      - charge the subpage block BLOCK, of class
+ *                         BLKTYPE, to CALLER for SZ bytes; returns
+ *                         the pointer to give kmalloc's caller.
+ *
+ *    kheapprof_tagpages - charge the NPAGES-page block at ADDR to
+ *                         CALLER.
+ *
+ *    kheapprof_untag    - credit the site of PTR, which kmalloc
+ *                         returned, and return the block to free.
+ *
+ *    kheapprof_size     - bytes charged for PTR, which kmalloc
+ *                         returned (for krealloc).
+ *
+ *    kheapprof_report   - print the sites with the most live bytes.
+ *
+ *    kheapprof_reset    - zero the allocation totals and set each
+ *                         site's peak to what it has live now.
+ */
+
+#define KHEAPPROF_NSITES   512	/* call sites tracked */
+#define KHEAPPROF_TAGSIZE  8	/* keeps blocks 8-byte aligned */
+#define KHEAPPROF_REPORT   32	/* sites printed by the report */
+
+struct kheapprof_site {
+	vaddr_t ks_caller;		/* return address into the caller */
+	unsigned ks_liveblocks;
+	size_t ks_livebytes;
+	size_t ks_peakbytes;		/* highest ks_livebytes */
+	unsigned ks_allocs;		/* kmalloc calls, ever */
+	size_t ks_minsize;		/* smallest and largest requests */
+	size_t ks_maxsize;
+};
+
+void *kheapprof_tag(void *block, size_t sz, unsigned blktype,
+		    vaddr_t caller);
+void kheapprof_tagpages(vaddr_t addr, unsigned npages, vaddr_t caller);
+void *kheapprof_untag(void *ptr);
+size_t kheapprof_size(void *ptr);
+void kheapprof_report(void);
+void kheapprof_reset(void);
+
+#endif /* _KHEAPPROF_H_ */
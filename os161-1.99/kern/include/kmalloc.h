@@ -0,0 +1,70 @@
+#ifndef _KMALLOC_H_
+#define _KMALLOC_H_
+
+/*
+ * Per-cpu caches for the subpage allocator.
+ *
+ * kmalloc and kfree themselves are declared in <lib.h>. Behind them,
+ * the subpage allocator (kmalloc.c) carves pages into blocks of one of
+ * KMALLOC_NSIZES sizes and keeps each page's free blocks on a list,
+ * all under one spinlock. To keep the common kmalloc/kfree pairs off
+ * that lock, each cpu keeps a "loaded" and a "previous" magazine of
+ * free blocks for every size, the same scheme the coremap uses for
+ * single frames (see <coremap.h>). A magazine is just a chain of free
+ * blocks linked through their first word, so it costs no memory of
+ * its own.
+ *
+ * Between the cpus and the page lists sits a depot of full magazines
+ * for each size, with its own lock. A cpu whose magazines are both
+ * full hands one to the depot, and one whose magazines are both empty
+ * takes one back, so a block freed on one cpu and wanted on another
+ * still never goes near the page lists. Only when the depot is empty
+ * (or full) does a cpu go to the page lists, moving a whole magazine
+ * in one trip.
+ *
+ * kfree finds a block's size through the coremap (coremap_kdata),
+ * which records the page's pageref, rather than by searching.
+ *
+ *    kmalloc_bootstrap - register the reclaim hook that empties the
+ *                        depot, and every cpu's magazines, when memory
+ *                        is short. Called from vm_bootstrap.
+ *
+ *    kmalloc_cpu_init  - initialize a cpu's caches. Called from
+ *                        cpu_create.
+ *
+ *    kmalloc_cpu_flush - send this cpu's magazines back to the page
+ *                        lists. Called from interprocessor_interrupt
+ *                        for IPI_KMALLOCFLUSH.
+ */
+
+#define KMALLOC_NSIZES     8	/* block sizes; see sizes[] in kmalloc.c */
+#define KMALLOC_MAGSIZE    16	/* most blocks in a magazine */
+#define KMALLOC_MAGBYTES   2048	/* ...or this many bytes, if fewer */
+#define KMALLOC_DEPOTMAX   4	/* full magazines kept per size */
+
+struct kmalloc_magazine {
+	void *km_head;			/* chain of free blocks */
+	unsigned km_rounds;		/* blocks on the chain */
+};
+
+/*
+ * Per-cpu kmalloc cache. Accessed only by its own cpu, with
+ * interrupts off; no lock.
+ */
+struct kmalloc_cache {
+	struct kmalloc_magazine kc_loaded[KMALLOC_NSIZES];
+	struct kmalloc_magazine kc_previous[KMALLOC_NSIZES];
+
+	/* statistics */
+	unsigned kc_hits;		/* allocations served from a magazine */
+	unsigned kc_misses;		/* allocations that went further */
+	unsigned kc_frees;		/* frees absorbed by a magazine */
+	unsigned kc_drains;		/* full magazines sent away */
+	volatile unsigned kc_flushes;	/* times flushed by IPI */
+};
+
+void kmalloc_bootstrap(void);
+void kmalloc_cpu_init(struct kmalloc_cache *kc);
+void kmalloc_cpu_flush(void);
+
+#endif /* _KMALLOC_H_ */
@@ -0,0 +1,108 @@
+#ifndef _KMEM_CACHE_H_
+#define _KMEM_CACHE_H_
+
+/*
+ * Object caches.
+ *
+ * A kmem_cache hands out objects of one type, carved from one-page
+ * slabs. What makes it cheaper than kmalloc for structures that are
+ * created and destroyed all the time (threads, processes, locks,
+ * vnodes) is that a freed object stays constructed: the cache's
+ * constructor runs only the first time a slot is handed out, and the
+ * destructor only when the slab's page goes back to the system. So a
+ * lock that is destroyed and recreated keeps its wait channel and
+ * spinlock, and a thread keeps its stack, instead of tearing them
+ * down and building them again. Callers must leave an object in its
+ * constructed state when they free it.
+ *
+ * Objects are rounded up to KMEM_ALIGN bytes and start on a KMEM_ALIGN
+ * boundary, so two objects never share a cache line and cpus working
+ * on neighbouring locks or threads do not fight over one.
+ *
+ * A slab is a single page, with a header (struct kmem_slab) at the
+ * front, so the slab an object belongs to is just its page. Each cache
+ * keeps a list of partly used slabs, which allocation prefers, and a
+ * few completely free ones; beyond KMEM_EMPTYMAX free slabs, the
+ * extras are destructed and released, and the reclaim hook releases
+ * the rest when memory is short.
+ *
+ * Caches are defined statically with KMEM_CACHE_INITIALIZER, like
+ * spinlocks, so they work from the first moment of boot, before there
+ * is anywhere to allocate a cache from. A cache joins the list that
+ * reclaim and kmem_cache_printstats walk when it gets its first slab.
+ *
+ *    kmem_cache_alloc  - get an object, constructed. Returns NULL if
+ *                        out of memory or if the constructor fails.
+ *
+ *    kmem_cache_free   - return an object.
+ *
+ *    kmem_cache_bootstrap - register the reclaim hook. Called from
+ *                        vm_bootstrap.
+ *
+ *    kmem_cache_printstats - print the state of every cache.
+ *
+ * The constructor returns 0 or an error code; the destructor cannot
+ * fail. Both are called without any cache lock held, so they may use
+ * kmalloc and other caches.
+ */
+
+#include <spinlock.h>
+#include <vm.h>
+
+#define KMEM_ALIGN     32	/* cache line size */
+#define KMEM_EMPTYMAX  2	/* free slabs kept per cache */
+#define KMEM_SLABMAX   (PAGE_SIZE / KMEM_ALIGN)	/* most objects in a slab */
+
+/*
+ * Slab header, at the start of each slab page. The objects follow,
+ * from KMEM_SLABHDR on. Free objects are not linked through their own
+ * memory, since they are still constructed; instead the header keeps
+ * a stack of their indexes.
+ */
+struct kmem_slab {
+	struct kmem_cache *ks_cache;
+	struct kmem_slab *ks_next;	/* on kc_partial or kc_empty */
+	struct kmem_slab *ks_prev;
+	unsigned ks_nfree;		/* entries on ks_free */
+	uint8_t ks_free[KMEM_SLABMAX];	/* indexes of free objects */
+	uint8_t ks_constructed[KMEM_SLABMAX];	/* ctor has run */
+};
+
+#define KMEM_SLABHDR   ROUNDUP(sizeof(struct kmem_slab), KMEM_ALIGN)
+
+struct kmem_cache {
+	const char *kc_name;
+	size_t kc_objsize;		/* rounded to KMEM_ALIGN */
+	unsigned kc_perslab;		/* objects per slab */
+	int (*kc_ctor)(void *obj);
+	void (*kc_dtor)(void *obj);
+
+	struct spinlock kc_lock;
+	struct kmem_slab *kc_partial;	/* slabs with some objects free */
+	struct kmem_slab *kc_empty;	/* slabs with all objects free */
+	unsigned kc_nempty;
+	struct kmem_cache *kc_next;	/* on the list of all caches */
+	bool kc_listed;
+
+	/* statistics */
+	unsigned kc_nslabs;		/* slabs (pages) held */
+	unsigned kc_inuse;		/* objects allocated */
+	unsigned kc_allocs;		/* kmem_cache_alloc calls */
+	unsigned kc_ctors;		/* constructor calls */
+};
+
+#define KMEM_CACHE_OBJSIZE(size)  ROUNDUP((size), KMEM_ALIGN)
+
+#define KMEM_CACHE_INITIALIZER(name, size, ctor, dtor) {		\
+	(name), KMEM_CACHE_OBJSIZE(size),				\
+	(PAGE_SIZE - KMEM_SLABHDR) / KMEM_CACHE_OBJSIZE(size),		\
+	(ctor), (dtor), SPINLOCK_INITIALIZER,				\
+	NULL, NULL, 0, NULL, false, 0, 0, 0, 0 }
+
+void *kmem_cache_alloc(struct kmem_cache *kc);
+void kmem_cache_free(struct kmem_cache *kc, void *obj);
+
+void kmem_cache_bootstrap(void);
+void kmem_cache_printstats(void);
+
+#endif /* _KMEM_CACHE_H_ */
@@ -120,13 +120,26 @@ uint32_t randmax(void);
 uint32_t random(void);
 
 /*
- * Kernel heap memory allocation. Like malloc/free.
- * If out of memory, kmalloc returns NULL.
+ * Kernel heap memory allocation. Like malloc/free/realloc.
+ * If out of memory, kmalloc and krealloc return NULL (and krealloc
+ * leaves the old block alone). krealloc grows and shrinks multi-page
+ * blocks in place when it can.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
+void *krealloc(void *ptr, size_t size);
 void kheap_printstats(void);
 
+/*
+ * kmalloc and krealloc for wrappers that allocate on their caller's
+ * behalf, like kstrdup: the heap profiler (OPT_KHEAPPROF) charges the
+ * block to CALLER, which the wrapper gets with KMALLOC_CALLER, rather
+ * than to the wrapper itself.
+ */
+#define KMALLOC_CALLER ((vaddr_t)__builtin_return_address(0))
+void *kmalloc_caller(size_t size, vaddr_t caller);
+void *krealloc_caller(void *ptr, size_t size, vaddr_t caller);
+
 /*
  * C string functions. 
  *
@@ -0,0 +1,78 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+/*
+ * Page cache for read-only file pages.
+ *
+ * When several processes run the same executable, each would
+ * otherwise read its own copy of the text segment from disk. Instead,
+ * the first process to fault in a page of program text (an executable,
+ * non-writable region loaded from the ELF file; not mmap) puts the
+ * frame in the cache, keyed by vnode and file offset,
+ * and everyone after it maps that same frame. Cached frames are shared
+ * through the coremap reference count like frames shared by fork, and
+ * are mapped copy-on-write, so nobody can change the cached copy.
+ *
+ * The cache holds its own reference to each frame, but not to the
+ * vnode, so it doesn't keep deleted files alive; instead vnode_cleanup
+ * drops a vnode's pages when it is reclaimed. VOP_WRITE and
+ * VOP_TRUNCATE drop them too, and bump the vnode's vn_pcgen so that a
+ * page read before the write can't be inserted afterwards. A cached
+ * page that no process maps any more is only using memory, so
+ * pagecache_reclaim throws such pages away when memory runs low.
+ * Pages that are still mapped go through pageout like any other
+ * shared frame: pageout unmaps them everywhere and then takes the
+ * cache's copy with pagecache_evict.
+ *
+ *    pagecache_bootstrap - register pagecache_reclaim as a reclaim
+ *                          hook. Called from vm_bootstrap.
+ *
+ *    pagecache_cacheable - true if pages of region VR can be cached.
+ *
+ *    pagecache_lookup    - return a new reference to the cached frame
+ *                          for page VADDR of VR, or 0 if it isn't
+ *                          cached. On a miss, sets *GEN to pass to
+ *                          pagecache_insert.
+ *
+ *    pagecache_insert    - offer PADDR, just filled with page VADDR of
+ *                          VR, to the cache. Returns true if the cache
+ *                          took it (and a reference to it), in which
+ *                          case the caller must map it copy-on-write.
+ *                          Refuses it if the file has been written
+ *                          since the lookup that returned GEN.
+ *
+ *    pagecache_reclaim   - free cached pages nobody maps. Returns the
+ *                          number of frames freed.
+ *
+ *    pagecache_evict     - for pageout, which has unmapped NMAPPED
+ *                          entries for the frame at PADDR: if those and
+ *                          the cache's (if it has the frame) are all its
+ *                          references, drop the frame from the cache,
+ *                          handing the cache's reference to the caller,
+ *                          set *CACHED to say whether there was one, and
+ *                          return true. Otherwise return false.
+ *
+ *    pagecache_invalidate - drop all cached pages of vnode V.
+ *
+ *    pagecache_printstats - print hit, miss and size counts.
+ */
+
+#include <vm.h>
+
+struct vm_region;
+struct vnode;
+
+/* Hash buckets; a power of two. */
+#define PAGECACHE_HASHSIZE  64
+
+void pagecache_bootstrap(void);
+bool pagecache_cacheable(struct vm_region *vr);
+paddr_t pagecache_lookup(struct vm_region *vr, vaddr_t vaddr, unsigned *gen);
+bool pagecache_insert(struct vm_region *vr, vaddr_t vaddr, paddr_t paddr,
+		      unsigned gen);
+unsigned pagecache_reclaim(void);
+bool pagecache_evict(paddr_t paddr, unsigned nmapped, bool *cached);
+void pagecache_invalidate(struct vnode *v);
+void pagecache_printstats(void);
+
+#endif /* _PAGECACHE_H_ */
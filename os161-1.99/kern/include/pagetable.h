@@ -0,0 +1,77 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+/*
+ * Two-level page tables for user address spaces.
+ *
+ * A virtual address splits into a 10-bit directory index, a 10-bit
+ * table index and the 12-bit page offset. The directory is one page
+ * of pointers to second-level tables; each second-level table is one
+ * page of page table entries and covers 4M of address space. Tables
+ * are only allocated for the parts of the address space that are
+ * actually touched, so a sparse address space (code at the bottom,
+ * stack at the top) costs three pages of tables.
+ *
+ * A page table entry holds the physical frame in its top 20 bits and
+ * flags in the bottom 12, the same split as TLBLO. When the page is
+ * out on swap (PTE_SWAPPED), the top 20 bits hold the swap slot
+ * instead. PTE_BUSY marks an entry that is being paged in or out;
+ * whoever set it owns the entry until it is cleared, and anyone else
+ * who finds it set must back off and retry. Entries are protected by
+ * the address space's as_lock.
+ *
+ * PTE_SHARED marks a page of a MAP_SHARED file mapping. Such a page is
+ * never copied on write, and when dirty it is written back to its file
+ * (on munmap or exit) rather than to swap.
+ *
+ *    pt_create  - make an empty page table. Returns NULL if out of
+ *                 memory.
+ *
+ *    pt_destroy - free the table pages. Does not touch the frames the
+ *                 entries refer to; the caller must deal with those
+ *                 first (e.g. with pt_foreach).
+ *
+ *    pt_lookup  - return a pointer to the entry for VADDR. If CREATE
+ *                 is true, allocate the second-level table if needed
+ *                 (returns NULL if that fails); otherwise returns NULL
+ *                 if there is no table covering VADDR.
+ *
+ *    pt_foreach - call FUNC on every entry that is not zero (i.e. every
+ *                 page the address space has ever touched), in address
+ *                 order. Stops and returns the first nonzero value
+ *                 FUNC returns.
+ */
+
+typedef uint32_t pte_t;
+
+#define PTE_FRAME     0xfffff000	/* physical frame */
+#define PTE_VALID     0x00000001	/* page is resident in PTE_FRAME */
+#define PTE_COW       0x00000002	/* frame may be shared; copy on write */
+#define PTE_DIRTY     0x00000004	/* written since it was filled */
+#define PTE_SWAPPED   0x00000008	/* contents are in swap slot PTE_SLOT */
+#define PTE_BUSY      0x00000010	/* in transit; see above */
+#define PTE_SHARED    0x00000020	/* MAP_SHARED file page; see above */
+
+#define PTE_SLOT(pte)     ((pte) >> 12)
+#define PTE_FROMSLOT(s)   ((pte_t)(s) << 12)
+
+#define PT_DIRBITS    10
+#define PT_TABLEBITS  10
+#define PT_NDIR       (1 << PT_DIRBITS)
+#define PT_NTABLE     (1 << PT_TABLEBITS)
+
+#define PT_DIRINDEX(va)    ((va) >> 22)
+#define PT_TABLEINDEX(va)  (((va) >> 12) & (PT_NTABLE - 1))
+
+struct pagetable {
+	pte_t *pt_dir[PT_NDIR];
+};
+
+struct pagetable *pt_create(void);
+void pt_destroy(struct pagetable *pt);
+pte_t *pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create);
+int pt_foreach(struct pagetable *pt,
+	       int (*func)(vaddr_t vaddr, pte_t *pte, void *data),
+	       void *data);
+
+#endif /* _PAGETABLE_H_ */
@@ -41,6 +41,7 @@
 #include <spinlock.h>
 #include <array.h>
 #include <thread.h> /* required for struct threadarray */
+#include <uw-vmstats.h> /* for VMSTAT_COUNT */
 
 struct addrspace;
 struct vnode;
@@ -58,6 +59,11 @@ struct proc {
 
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	unsigned p_vmstats[VMSTAT_COUNT]; /* VM events caused by this process */
+	volatile bool p_killed;		/* chosen by the OOM killer */
+	time_t p_killtime;		/* when it last made progress dying */
+	unsigned p_killrss;		/* resident pages at p_killtime */
+	struct proc *p_listnext;	/* in the list of user processes */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -79,7 +85,7 @@ struct proc {
 	// struct proc *children[65];
 	struct array *children;
 	struct semaphore *sem;
-	int exit_val;
+	int exit_val;			/* wait status, from _MKWAIT_* */
 
 	#endif
 };
@@ -120,4 +126,29 @@ struct addrspace *curproc_setas(struct addrspace *);
 
 struct addrspace *childproc_setas(struct addrspace *, struct proc *);
 
+/*
+ * Out-of-memory handling. When the VM system cannot find a frame even
+ * after reclaiming caches and paging out, it calls proc_oom_kill to
+ * pick the user process with the most resident pages and set its
+ * p_killed. The victim exits (as if killed by SIGKILL) the next time
+ * it is about to return to user mode; see mips_trap.
+ *
+ * Returns the victim, or NULL if there is no candidate. If a victim
+ * is already on its way out, returns that one rather than picking
+ * another, so one shortage does not cost several processes. A victim
+ * counts as on its way out while its resident set keeps shrinking, or
+ * for PROC_OOM_GRACE seconds after it last shrank; one that sits
+ * longer than that without freeing anything (say, asleep somewhere it
+ * won't wake from) is passed over for the next largest. Sleeps.
+ */
+#define PROC_OOM_GRACE  2
+
+struct proc *proc_oom_kill(void);
+
+/*
+ * Print the VM stats (p_vmstats) of user process PID so far, or of
+ * every user process if PID is -1. Returns ESRCH if there is none.
+ */
+int proc_printvmstats(pid_t pid);
+
 #endif /* _PROC_H_ */
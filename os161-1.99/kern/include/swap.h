@@ -0,0 +1,76 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+/*
+ * Swap space and page replacement.
+ *
+ * Swap lives on a raw disk device (SWAP_DEVICE), divided into
+ * page-sized slots. A page that has been pushed out has PTE_SWAPPED
+ * set in its page table entry and its slot number where the frame
+ * number would be. Slots are reference counted so that a swapped-out
+ * page can be shared between parent and child after fork.
+ *
+ * Victims are chosen by the coremap's clock hand (coremap_clock),
+ * which gives each user frame a second chance if it has been
+ * referenced since the last sweep. A clean page is simply dropped,
+ * since it can be refilled from its region (zeros or the executable);
+ * a dirty one is written to a fresh slot. Dirty pages of shared file
+ * mappings are written back to the file instead, and then dropped
+ * like clean pages.
+ *
+ * A frame shared by several address spaces after fork is mapped at
+ * the same address in each, so pageout finds the sharers by looking
+ * there in every address space (as_foreach) and unmaps them all. If
+ * the page is dirty it goes to one slot, which each sharer gets a
+ * reference to. If some of the frame's references can't be found
+ * that way (someone is mapping or unmapping it right now) the frame
+ * is skipped this time round. A frame of program text that the page
+ * cache also holds leaves the cache with it (pagecache_evict).
+ *
+ * Only one pageout runs at a time, under the pageout lock. as_create
+ * and as_destroy also take the lock, so the address spaces a victim
+ * belongs to cannot come or go while it is being paged out.
+ *
+ *    swap_bootstrap - open the swap device. Called from vm_bootstrap.
+ *                     If there is no swap device, pageout can still
+ *                     reclaim clean pages.
+ *
+ *    swap_evict     - push up to SWAP_CLUSTER user pages out and return
+ *                     one of their frames, now owned by the caller (as
+ *                     if from coremap_alloc); the others are freed.
+ *                     Returns 0 if nothing could be evicted, or if the
+ *                     caller cannot sleep.
+ *
+ *    swap_in        - read slot SLOT into the frame at PADDR.
+ *
+ *    swap_share     - add a reference to SLOT.
+ *
+ *    swap_free      - drop a reference to SLOT.
+ *
+ *    pageout_lock_acquire, pageout_lock_release - exclude pageout.
+ *
+ *    pageout_lock_held - true if the current thread has the pageout lock.
+ */
+
+#include <pagetable.h>
+
+/* Raw disk used for swap. */
+#define SWAP_DEVICE  "lhd1raw:"
+
+/* Pages pushed out per pageout round (one TLB shootdown each). */
+#define SWAP_CLUSTER  8
+
+/* Give up on finding victims after this many candidates are refused. */
+#define SWAP_EVICT_TRIES  8
+
+void swap_bootstrap(void);
+paddr_t swap_evict(void);
+int swap_in(unsigned slot, paddr_t paddr);
+void swap_share(unsigned slot);
+void swap_free(unsigned slot);
+
+void pageout_lock_acquire(void);
+void pageout_lock_release(void);
+bool pageout_lock_held(void);
+
+#endif /* _SWAP_H_ */
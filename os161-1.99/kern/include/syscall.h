@@ -58,6 +58,11 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t user_req, userptr_t user_rem);
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t path, size_t length, int prot, int flags,
+	     vaddr_t *retval);
+int sys_munmap(vaddr_t addr, size_t length);
 
 
 
@@ -70,6 +75,7 @@ pid_t sys_fork(struct trapframe *, pid_t *);
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
 void sys__exit(int exitcode);
+void proc_exit(int waitstatus);
 int sys_getpid(pid_t *retval);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retval);
 int sys_execv(userptr_t prog, userptr_t argv);
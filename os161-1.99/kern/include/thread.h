@@ -84,6 +84,18 @@ struct thread {
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduling fields; see schedule() in thread.c. Changed by the
+	 * thread itself while it runs, by its waker while it sleeps,
+	 * and under the run queue lock while it is on a run queue.
+	 */
+	unsigned t_priority;		/* Run queue level; 0 runs first */
+	unsigned t_ticks;		/* Hardclocks run at this level */
+	unsigned t_quantum;		/* Hardclocks left before preemption */
+	bool t_background;		/* Pinned to the bottom level */
+
+	unsigned t_wakeup;		/* Timer tick to wake at (clocknap) */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -163,10 +175,24 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge a hardclock to the current thread's quantum. Returns true if
+ * it should yield: its quantum is used up, or a thread at a higher
+ * level is waiting. Called from the timer interrupt.
+ */
+bool thread_quantum_tick(void);
+
+/*
+ * True if another thread is waiting to run on this cpu. Only a hint,
+ * for background threads deciding whether to get out of the way.
+ */
+bool thread_others_ready(void);
+
+/*
+ * Move the current thread to the bottom run queue level for good:
+ * waking up and aging no longer move it up. For background work that
+ * should only use cpu time nobody else wants.
  */
-void thread_consider_migration(void);
+void thread_setbackground(void);
 
 
 #endif /* _THREAD_H_ */
@@ -10,11 +10,10 @@
 /* Tracks stats on user programs */
 
 /* NOTE !!!!!! WARNING !!!!!
- * All of the functions (except vmstats_print) whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
- * All of the functions whose names do not begin
- * with '_' ensure atomicity locally (except vmstats_print).
+ * Counters are sharded per cpu and also kept per process; see
+ * uw-vmstats.c. The functions whose names begin with '_' assume
+ * interrupts are already off. The functions whose names do not begin
+ * with '_' turn them off themselves (except vmstats_print).
  *
  * Generally you will use the functions whose names
  * do not begin with '_'.
@@ -36,23 +35,32 @@
 #define VMSTAT_ELF_FILE_READ          (7)
 #define VMSTAT_SWAP_FILE_READ         (8)
 #define VMSTAT_SWAP_FILE_WRITE        (9)
-#define VMSTAT_COUNT                 (10)
+#define VMSTAT_TLB_FAULTAROUND       (10)
+#define VMSTAT_PAGE_FAULT_CACHED     (11)
+#define VMSTAT_ZERO_POOL_HIT         (12)
+#define VMSTAT_ZERO_POOL_MISS        (13)
+#define VMSTAT_COUNT                 (14)
 
 /* ----------------------------------------------------------------------- */
 
 /* Initialize the statistics: must be called before using */
-void vmstats_init(void);                     /* uses locking */
-void _vmstats_init(void);                    /* atomicity must be ensured elsewhere */
+void vmstats_init(void);                     /* disables interrupts */
+void _vmstats_init(void);                    /* interrupts must be off */
 
 /* Increment the specified count 
  * Example use: 
  *   vmstats_inc(VMSTAT_TLB_FAULT);
  *   vmstats_inc(VMSTAT_PAGE_FAULT_ZERO);
  */
-void vmstats_inc(unsigned int index);    /* uses locking */
-void _vmstats_inc(unsigned int index);   /* atomicity must be ensured elsewhere */
+void vmstats_inc(unsigned int index);    /* disables interrupts */
+void _vmstats_inc(unsigned int index);   /* interrupts must be off */
 
 /* Print the statistics: assumes that at least vmstats_init has been called */
 void vmstats_print(void);                    /* Does NOT use locking */
 
+/* Print one process's statistics, and whether to do so at exit */
+struct proc;
+void vmstats_print_proc(struct proc *p);
+extern bool vmstats_perproc;
+
 #endif /* VM_STATS_H */
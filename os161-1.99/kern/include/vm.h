@@ -51,14 +51,70 @@ void vm_bootstrap(void);
 /* Fault handling function called by trap code */
 int vm_fault(int faulttype, vaddr_t faultaddress);
 
-/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
+/*
+ * Allocate/free kernel heap pages (called by kmalloc/kfree).
+ * alloc_kpages returns 0 if memory cannot be found even after
+ * reclaiming; callers must be ready for that.
+ */
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/*
+ * Reclaim hooks. A subsystem that keeps memory it could do without
+ * (a cache, a pool of spare frames) registers a function that gives
+ * some or all of it back and returns the number of pages freed. When
+ * an allocation finds no free frames, the hooks run, in the order
+ * they were registered, before anything is paged out. Hooks run in
+ * the allocating thread, with no VM locks held.
+ *
+ * vm_reclaim_register returns ENOSPC if all VM_RECLAIM_MAX slots are
+ * taken.
+ */
+#define VM_RECLAIM_MAX  8
+
+typedef unsigned (*vm_reclaim_func)(void);
+int vm_reclaim_register(const char *name, vm_reclaim_func func);
+
+/*
+ * Give up on a user page fault once this many OOM victims have been
+ * waited for without a frame turning up (see proc_oom_kill).
+ */
+#define VM_OOM_RETRIES  16
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
-void print_coremap(void);
+/*
+ * Removing TLB entries on every cpu.
+ *
+ * Collect invalidations with vm_tlbbatch_add, then vm_tlbbatch_flush
+ * removes them from this cpu's TLB and sends each other cpu one IPI
+ * carrying the whole batch, and waits for all of them to acknowledge.
+ * A batch flushes itself when it fills up. vm_tlbinvalidate is a batch
+ * of one. Call with interrupts enabled.
+ *
+ * vm_tlbstats_print reports shootdown rounds, pages, and time spent
+ * waiting for acknowledgements.
+ */
+struct addrspace;
+void vm_tlbbatch_init(struct tlbbatch *tb);
+void vm_tlbbatch_add(struct tlbbatch *tb, struct addrspace *as, vaddr_t vaddr);
+void vm_tlbbatch_flush(struct tlbbatch *tb);
+void vm_tlbinvalidate(struct addrspace *as, vaddr_t vaddr);
+void vm_tlbstats_print(void);
+
+/*
+ * Fault-around: on a TLB miss, vm_fault also loads any resident pages
+ * in the surrounding aligned window of vm_faultaround pages, as long
+ * as there are free TLB slots for them. vm_setfaultaround changes the
+ * window; it must be a power of two no bigger than VM_FAULTAROUND_MAX,
+ * and 1 turns fault-around off.
+ */
+#define VM_FAULTAROUND      8
+#define VM_FAULTAROUND_MAX  32
+
+extern unsigned vm_faultaround;
+int vm_setfaultaround(unsigned npages);
 
 #endif /* _VM_H_ */
@@ -44,6 +44,12 @@ struct wchan; /* Opaque */
  */
 struct wchan *wchan_create(const char *name);
 
+/*
+ * Change the name of a wait channel. The same rules apply to NAME as
+ * for wchan_create.
+ */
+void wchan_setname(struct wchan *wc, const char *name);
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  */
@@ -81,5 +87,12 @@ void wchan_sleep(struct wchan *wc);
 void wchan_wakeone(struct wchan *wc);
 void wchan_wakeall(struct wchan *wc);
 
+/*
+ * Wake the threads on the channel whose t_wakeup is NOW or earlier,
+ * comparing as (int)(t_wakeup - now), and leave the rest asleep. For
+ * the timer wheel in clock.c.
+ */
+void wchan_wakeexpired(struct wchan *wc, unsigned now);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,36 @@
+#ifndef _ZEROPOOL_H_
+#define _ZEROPOOL_H_
+
+/*
+ * Pool of pre-zeroed frames.
+ *
+ * Most first-touch faults (stack, heap, bss) want a frame full of
+ * zeros. Rather than clearing 4K on the fault path, a kernel thread
+ * clears free frames ahead of time, when its cpu has nothing else to
+ * run, and keeps up to ZEROPOOL_SIZE of them in a pool. It stops when
+ * free memory drops to ZEROPOOL_RESERVE frames, so the pool never
+ * pushes anything out to swap.
+ *
+ *    zeropool_bootstrap - start the zeroing thread and register
+ *                         zeropool_reclaim as a reclaim hook. Called
+ *                         from vm_bootstrap.
+ *
+ *    zeropool_get       - take a zeroed frame from the pool, or return
+ *                         0 if it is empty. Counts a pool hit or miss
+ *                         in vmstats.
+ *
+ *    zeropool_reclaim   - give every frame in the pool back to the
+ *                         coremap (when memory is short). Returns the
+ *                         number of frames freed.
+ */
+
+#include <vm.h>
+
+#define ZEROPOOL_SIZE     32	/* frames kept zeroed */
+#define ZEROPOOL_RESERVE  64	/* free frames the pool leaves alone */
+
+void zeropool_bootstrap(void);
+paddr_t zeropool_get(void);
+unsigned zeropool_reclaim(void);
+
+#endif /* _ZEROPOOL_H_ */
@@ -32,14 +32,15 @@
 #include <lib.h>
 
 /*
- * Like strdup, but calls kmalloc.
+ * Like strdup, but calls kmalloc. The string is charged to our caller
+ * in heap profiles.
  */
 char *
 kstrdup(const char *s)
 {
 	char *z;
 
-	z = kmalloc(strlen(s)+1);
+	z = kmalloc_caller(strlen(s)+1, KMALLOC_CALLER);
 	if (z == NULL) {
 		return NULL;
         }
@@ -49,6 +49,10 @@
 #include <vnode.h>
 #include <vfs.h>
 #include <synch.h>
+#include <swap.h>
+#include <clock.h>
+#include <kmem_cache.h>
+#include <kern/errno.h>
 #include <kern/fcntl.h>  
 
 #include "opt-A2.h"
@@ -71,8 +75,43 @@ static struct semaphore *proc_count_mutex;
 struct semaphore *no_proc_sem;   
 #endif  // UW
 
+/*
+ * Every user process, for the OOM killer. Linked through p_listnext
+ * and protected by proc_list_lock.
+ */
+static struct proc *proc_list;
+static struct lock *proc_list_lock;
 
 
+/*
+ * Proc structures come from an object cache; a cached one keeps its
+ * (empty) thread array, with its storage, and its spinlock.
+ */
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_init(&proc->p_threads);
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	threadarray_cleanup(&proc->p_threads);
+	spinlock_cleanup(&proc->p_lock);
+}
+
+static struct kmem_cache proc_cache =
+	KMEM_CACHE_INITIALIZER("proc", sizeof(struct proc),
+			       proc_ctor, proc_dtor);
+
 /*
  * Create a proc structure.
  */
@@ -81,19 +120,19 @@ struct proc *
 proc_create(const char *name)
 {
 	struct proc *proc;
+	unsigned i;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = kmem_cache_alloc(&proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		kmem_cache_free(&proc_cache, proc);
 		return NULL;
 	}
 
-	threadarray_init(&proc->p_threads);
-	spinlock_init(&proc->p_lock);
+	/* p_threads and p_lock are set up by proc_ctor */
 
 	#ifdef OPT_A2
 	if (proc->pid < 0) proc->pid = pid_count;
@@ -108,6 +147,13 @@ proc_create(const char *name)
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	for (i=0; i<VMSTAT_COUNT; i++) {
+		proc->p_vmstats[i] = 0;
+	}
+	proc->p_killed = false;
+	proc->p_killtime = 0;
+	proc->p_killrss = 0;
+	proc->p_listnext = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -119,6 +165,32 @@ proc_create(const char *name)
 	return proc;
 }
 
+static
+void
+proc_list_add(struct proc *proc)
+{
+	lock_acquire(proc_list_lock);
+	proc->p_listnext = proc_list;
+	proc_list = proc;
+	lock_release(proc_list_lock);
+}
+
+static
+void
+proc_list_remove(struct proc *proc)
+{
+	struct proc **pp;
+
+	lock_acquire(proc_list_lock);
+	for (pp = &proc_list; *pp != NULL; pp = &(*pp)->p_listnext) {
+		if (*pp == proc) {
+			*pp = proc->p_listnext;
+			break;
+		}
+	}
+	lock_release(proc_list_lock);
+}
+
 /*
  * Destroy a proc structure.
  */
@@ -137,6 +209,8 @@ proc_destroy(struct proc *proc)
 	KASSERT(proc != NULL);
 	KASSERT(proc != kproc);
 
+	proc_list_remove(proc);
+
 	/*
 	 * We don't take p_lock in here because we must have the only
 	 * reference to this structure. (Otherwise it would be
@@ -176,11 +250,10 @@ proc_destroy(struct proc *proc)
 	}
 #endif // UW
 
-	threadarray_cleanup(&proc->p_threads);
-	spinlock_cleanup(&proc->p_lock);
+	KASSERT(threadarray_num(&proc->p_threads) == 0);
 
 	kfree(proc->p_name);
-	kfree(proc);
+	kmem_cache_free(&proc_cache, proc);
 
 #ifdef UW
 	/* decrement the process count */
@@ -210,6 +283,11 @@ proc_bootstrap(void)
   if (kproc == NULL) {
     panic("proc_create for kproc failed\n");
   }
+  proc_list = NULL;
+  proc_list_lock = lock_create("proc_list");
+  if (proc_list_lock == NULL) {
+    panic("could not create proc_list lock\n");
+  }
 #ifdef UW
   proc_count = 0;
   proc_count_mutex = sem_create("proc_count_mutex",1);
@@ -292,6 +370,8 @@ proc_create_runprogram(const char *name)
 	V(proc_count_mutex);
 #endif // UW
 
+	proc_list_add(proc);
+
 	return proc;
 }
 
@@ -398,3 +478,93 @@ struct addrspace *childproc_setas(struct addrspace *newas, struct proc *childPro
 	spinlock_release(&childProc->p_lock);
 	return oldas;
 }
+
+struct proc *
+proc_oom_kill(void)
+{
+	struct proc *p, *victim, *dying;
+	struct addrspace *as;
+	unsigned rss, most;
+	time_t now;
+	uint32_t nsecs;
+
+	if (pageout_lock_held()) {
+		/* Called from pageout or as_destroy; don't wait on ourselves. */
+		return NULL;
+	}
+
+	gettime(&now, &nsecs);
+
+	/*
+	 * Holding the pageout lock keeps as_destroy from freeing an
+	 * address space while we count its pages.
+	 */
+	pageout_lock_acquire();
+	lock_acquire(proc_list_lock);
+
+	victim = NULL;
+	dying = NULL;
+	most = 0;
+	for (p = proc_list; p != NULL; p = p->p_listnext) {
+		spinlock_acquire(&p->p_lock);
+		as = p->p_addrspace;
+		spinlock_release(&p->p_lock);
+		if (as == NULL) {
+			/* Not started, or already gave its memory back. */
+			continue;
+		}
+		rss = as_rss(as);
+		if (p->p_killed) {
+			if (rss < p->p_killrss) {
+				/* Letting go; give it time to finish. */
+				p->p_killrss = rss;
+				p->p_killtime = now;
+				dying = p;
+			}
+			else if (now - p->p_killtime < PROC_OOM_GRACE) {
+				/* Hasn't had a chance to run yet. */
+				dying = p;
+			}
+			/* Otherwise it's stuck; look past it. */
+			continue;
+		}
+		if (rss > most) {
+			most = rss;
+			victim = p;
+		}
+	}
+
+	if (dying != NULL) {
+		victim = dying;
+	}
+	else if (victim != NULL) {
+		kprintf("Out of memory: killing %s (%u pages)\n",
+			victim->p_name, most);
+		victim->p_killrss = most;
+		victim->p_killtime = now;
+		victim->p_killed = true;
+	}
+
+	lock_release(proc_list_lock);
+	pageout_lock_release();
+	return victim;
+}
+
+int
+proc_printvmstats(pid_t pid)
+{
+	struct proc *p;
+	bool found;
+
+	found = false;
+	lock_acquire(proc_list_lock);
+	for (p = proc_list; p != NULL; p = p->p_listnext) {
+		if (pid == -1 || p->pid == pid) {
+			kprintf("pid %d: ", (int)p->pid);
+			vmstats_print_proc(p);
+			found = true;
+		}
+	}
+	lock_release(proc_list_lock);
+	return found ? 0 : ESRCH;
+}
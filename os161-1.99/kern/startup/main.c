@@ -48,6 +48,7 @@
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
+#include <uw-vmstats.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
 
@@ -153,6 +154,8 @@ shutdown(void)
 
 	thread_shutdown();
 
+	vmstats_print();
+
 	splhigh();
 }
 
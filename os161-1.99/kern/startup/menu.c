@@ -42,9 +42,18 @@
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
+#include <vm.h>
+#include <coremap.h>
+#include <kmem_cache.h>
+#include <pagecache.h>
+#include <uw-vmstats.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-kheapprof.h"
+#if OPT_KHEAPPROF
+#include <kheapprof.h>
+#endif
 
 /*
  * In-kernel menu and command dispatcher.
@@ -401,6 +410,141 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_KHEAPPROF
+/*
+ * Command for the heap profile. "khp reset" starts the totals and
+ * peaks over.
+ */
+static
+int
+cmd_kheapprof(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		kheapprof_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: khp [reset]\n");
+		return EINVAL;
+	}
+
+	kheapprof_report();
+
+	return 0;
+}
+#endif
+
+static
+int
+cmd_kcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kmem_cache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_coremapstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	coremap_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_pagecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pagecache_printstats();
+
+	return 0;
+}
+
+/*
+ * vmp: with no argument, toggle printing each process's VM stats when
+ * it exits; with a pid, or "all", print them for running processes.
+ */
+static
+int
+cmd_vmstatsperproc(int nargs, char **args)
+{
+	pid_t pid;
+	int result;
+
+	if (nargs == 1) {
+		vmstats_perproc = !vmstats_perproc;
+		kprintf("Per-process VM stats at exit: %s\n",
+			vmstats_perproc ? "on" : "off");
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: vmp [pid | all]\n");
+		return EINVAL;
+	}
+
+	if (!strcmp(args[1], "all")) {
+		pid = -1;
+	}
+	else {
+		pid = atoi(args[1]);
+		if (pid <= 0) {
+			kprintf("Usage: vmp [pid | all]\n");
+			return EINVAL;
+		}
+	}
+
+	result = proc_printvmstats(pid);
+	if (result) {
+		kprintf("vmp: %s: no such process\n", args[1]);
+	}
+	return result;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_tlbstats_print();
+
+	return 0;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 1) {
+		kprintf("Fault-around window: %u pages\n", vm_faultaround);
+		return 0;
+	}
+	if (nargs != 2) {
+		kprintf("Usage: fa [pages]\n");
+		return EINVAL;
+	}
+
+	result = vm_setfaultaround(atoi(args[1]));
+	if (result) {
+		kprintf("fa: window must be a power of two from 1 to %d\n",
+			VM_FAULTAROUND_MAX);
+	}
+	return result;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -462,6 +606,8 @@ static const char *testmenu[] = {
 	"[bt]  Bitmap test                   ",
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
+	"[km3] krealloc test                 ",
+	"[cm1] Coremap test                  ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -511,6 +657,15 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[kc] Object cache stats             ",
+#if OPT_KHEAPPROF
+	"[khp] Heap profile by call site     ",
+#endif
+	"[cm] Coremap stats                  ",
+	"[pc] Page cache stats               ",
+	"[vmp] Per-process VM stats          ",
+	"[tlb] TLB shootdown stats           ",
+	"[fa] Set fault-around window        ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -568,12 +723,23 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "kc",         cmd_kcachestats },
+#if OPT_KHEAPPROF
+	{ "khp",        cmd_kheapprof },
+#endif
+	{ "cm",         cmd_coremapstats },
+	{ "pc",         cmd_pagecachestats },
+	{ "vmp",        cmd_vmstatsperproc },
+	{ "tlb",        cmd_tlbstats },
+	{ "fa",         cmd_faultaround },
 
 	/* base system tests */
 	{ "at",		arraytest },
 	{ "bt",		bitmaptest },
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
+	{ "km3",	krealloctest },
+	{ "cm1",	coremaptest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
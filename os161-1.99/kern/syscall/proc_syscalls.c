@@ -22,7 +22,9 @@
 pid_t sys_fork(struct trapframe *tf, pid_t *retval) {
   // create empty child process
   struct proc *childProc = proc_create_runprogram("Child");
-  KASSERT(childProc != NULL);
+  if (childProc == NULL) {
+    return ENOMEM;
+  }
   
   // create new address space and store it in variable
   struct addrspace *child_addr;
@@ -44,40 +46,71 @@ pid_t sys_fork(struct trapframe *tf, pid_t *retval) {
   childProc->pid = pid_count;
   spinlock_release(&childProc->p_lock);
 
-  // add assignments to parent and child
-  array_add(curproc->children, childProc, NULL);
-  childProc->parent = curproc;
-
   // create new thread
   struct trapframe *tf_c = kmalloc(sizeof(struct trapframe));
+  if (tf_c == NULL) {
+    err = ENOMEM;
+    goto fail;
+  }
   *tf_c = *tf;
+
+  // add assignments to parent and child
+  err = array_add(curproc->children, childProc, NULL);
+  if (err) {
+    kfree(tf_c);
+    goto fail;
+  }
+  childProc->parent = curproc;
+
   err = thread_fork("Child thread", childProc, (void *)enter_forked_process, (void *)tf_c, childProc->pid);
   if (err) {
     kprintf("Error: %s\n", strerror(err));
     kfree(tf_c);
-    return err;
+    array_remove(curproc->children, array_num(curproc->children) - 1);
+    goto fail;
   }
 
   // return child pid to parent
   *retval = childProc->pid;
 
   return 0;
+
+ fail:
+  // the child never ran, so its address space is ours to clean up
+  spinlock_acquire(&childProc->p_lock);
+  childProc->p_addrspace = NULL;
+  spinlock_release(&childProc->p_lock);
+  as_destroy(child_addr);
+  proc_destroy(childProc);
+  return err;
 }
 
 void sys__exit(int exitcode) {
+  proc_exit(_MKWAIT_EXIT(exitcode));
+}
+
+/*
+ * Exit the current process with wait status WAITSTATUS (from the
+ * _MKWAIT_* macros), for _exit and for processes killed by the kernel.
+ */
+void proc_exit(int waitstatus) {
 
   struct addrspace *as;
   struct proc *p = curproc;
   
   spinlock_acquire(&curproc->p_lock);
-  p->exit_val = exitcode;
+  p->exit_val = waitstatus;
   array_set(exit_codes, (int)p->pid, (void *)p->exit_val);
   spinlock_release(&curproc->p_lock);
 
-  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
+  DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",waitstatus);
 
   KASSERT(curproc->p_addrspace != NULL);
 
+  if (vmstats_perproc) {
+    vmstats_print_proc(p);
+  }
+
   // destroy space
   as_deactivate();
   as = curproc_setas(NULL);
@@ -119,7 +152,6 @@ int sys_waitpid(pid_t pid,
   exitstatus = (int)array_get(exit_codes, (int)pid);
 
   if (exitstatus != EMPTY_EXIT_CODE) {
-    exitstatus = _MKWAIT_EXIT(exitstatus);
     result = copyout((void *)&exitstatus,status,sizeof(int));
     if (result) return result;
     *retval = pid;
@@ -150,7 +182,6 @@ int sys_waitpid(pid_t pid,
 
   KASSERT(exitstatus != EMPTY_EXIT_CODE);
 
-  exitstatus = _MKWAIT_EXIT(exitstatus);
   result = copyout((void *)&exitstatus,status,sizeof(int));
   // V(child->sem);
   if (result) {
@@ -160,6 +191,29 @@ int sys_waitpid(pid_t pid,
   return 0;
 }
 
+/*
+ * Double the krealloc'd buffer *BUF, of *SIZE bytes, starting at
+ * MINSIZE bytes if it has none; E2BIG once it would pass MAXSIZE.
+ */
+static int grow_argbuf(void **buf, size_t *size, size_t minsize, size_t maxsize) {
+  size_t newsize = (*size == 0) ? minsize : *size * 2;
+  void *newbuf;
+
+  if (*size >= maxsize) {
+    return E2BIG;
+  }
+  if (newsize > maxsize) {
+    newsize = maxsize;
+  }
+  newbuf = krealloc(*buf, newsize);
+  if (newbuf == NULL) {
+    return ENOMEM;
+  }
+  *buf = newbuf;
+  *size = newsize;
+  return 0;
+}
+
 int sys_execv(userptr_t prog, userptr_t argv) {
   struct addrspace *as;
 	struct vnode *v;
@@ -167,6 +221,9 @@ int sys_execv(userptr_t prog, userptr_t argv) {
 	int result;
 
   char *progname =  kmalloc(PATH_MAX);
+  if (progname == NULL) {
+    return ENOMEM;
+  }
   size_t accSize;
   result = copyinstr(prog, (void*)progname, PATH_MAX, &accSize);
   if (result) {
@@ -174,30 +231,40 @@ int sys_execv(userptr_t prog, userptr_t argv) {
     return result;
   }
 
-  // kprintf("%s\n", progname);
-
-  char ** argsArray = (char **)argv;
+  /*
+   * Copy the argument strings in end to end, into one buffer that
+   * krealloc grows (in place, when the frames after it are free) as
+   * they come. argvec holds each string's offset in the buffer, and
+   * later its address on the new stack.
+   */
+  char *argbuf = NULL;
+  vaddr_t *argvec = NULL;
+  size_t buflen = 0, bufsize = 0, vecsize = 0, got;
+  userptr_t argp;
   int argc = 0;
-  while (argsArray[argc] != NULL) argc ++;
 
-  char **arguments = kmalloc(argc * sizeof(char*));
+  for (;;) {
+    result = copyin((userptr_t)((userptr_t *)argv + argc), &argp, sizeof(argp));
+    if (result) goto fail;
+    if ((argc + 1) * sizeof(vaddr_t) > vecsize) {
+      result = grow_argbuf((void **)&argvec, &vecsize, 16 * sizeof(vaddr_t), ARG_MAX);
+      if (result) goto fail;
+    }
+    if (argp == NULL) break;
 
-  for (int i = 0; i < argc; i ++) {
-    size_t argSize = (strlen(argsArray[i]) + 1) * sizeof(char);
-    arguments[i] = kmalloc(argSize);
-    result = copyin((userptr_t)argsArray[i], (void *)arguments[i], argSize);
-    if (result) {
-      for (int j = 0; i <= i; j ++) kfree(arguments[j]);
-      kfree(arguments);
+    while (buflen == bufsize ||
+           (result = copyinstr(argp, argbuf + buflen, bufsize - buflen, &got)) == ENAMETOOLONG) {
+      result = grow_argbuf((void **)&argbuf, &bufsize, PAGE_SIZE, ARG_MAX);
+      if (result) goto fail;
     }
+    if (result) goto fail;
+    argvec[argc++] = buflen;
+    buflen += got;
   }
 
-  // for (int i = 0; i < argc; i ++) kprintf("%s\n", arguments[i]);
-
 	/* Open the file. */
 	result = vfs_open(progname, O_RDONLY, 0, &v);
-	if (result) return result;
-
+	if (result) goto fail;
 
 	KASSERT(v != NULL);
 
@@ -205,7 +272,8 @@ int sys_execv(userptr_t prog, userptr_t argv) {
 	as = as_create();
 	if (as ==NULL) {
 		vfs_close(v);
-		return ENOMEM;
+		result = ENOMEM;
+		goto fail;
 	}
 
 
@@ -217,7 +285,7 @@ int sys_execv(userptr_t prog, userptr_t argv) {
 	result = load_elf(v, &entrypoint);
 	if (result) {
 		vfs_close(v);
-		return result;
+		goto fail;
 	}
 
 	// close file
@@ -225,43 +293,42 @@ int sys_execv(userptr_t prog, userptr_t argv) {
 
   // copy arguments from the user space into the new address space
   result = as_define_stack(as, &stackptr);
-  if (result) return result;
+  if (result) goto fail;
 
   // delete old address space
   // as_destroy(old_as);
 
   // push strings onto the stack
-  userptr_t arg_locs[argc];
-
   for (int i = argc-1; i >= 0; i --) {
-    size_t length = (strlen(arguments[i]) + 1)* sizeof(char);
+    char *arg = argbuf + argvec[i];
+    size_t length = strlen(arg) + 1;
     stackptr -= ROUNDUP(length, 8);
-    size_t size = 0;
-    result = copyoutstr(arguments[i], (userptr_t)stackptr, length, &size);
-    if (result) return result;
-    arg_locs[i] = (userptr_t)stackptr;
-    // kprintf("Address %p: %s\n", (void *)stackptr, arguments[i]);
+    result = copyoutstr(arg, (userptr_t)stackptr, length, &got);
+    if (result) goto fail;
+    argvec[i] = stackptr;
   }
-
-  arg_locs[argc] = 0;
+  argvec[argc] = 0;
 
   // push pointers onto the stack
-  for (int i = argc; i >= 0; i --) {
-    stackptr -= sizeof(char **);
-    copyout((void *)&arg_locs[i], (userptr_t)stackptr, sizeof(char **));
-    // kprintf("Address %p: %p\n", (void *)stackptr, (void *)arg_locs);
-  }
+  stackptr -= ROUNDUP((argc + 1) * sizeof(vaddr_t), 8);
+  result = copyout(argvec, (userptr_t)stackptr, (argc + 1) * sizeof(vaddr_t));
+  if (result) goto fail;
+
+  kfree(progname);
+  kfree(argbuf);
+  kfree(argvec);
 
 	enter_new_process(argc, (userptr_t)stackptr, stackptr, entrypoint);
 	
 	// enter_new_process does not return.
 	panic("enter_new_process returned\n");
-  kfree(progname);
-  for (int i = 0; i < argc; i ++) {
-    kfree(arguments[i]);
-  }
-  kfree(arguments);
 	return EINVAL;
+
+ fail:
+  kfree(progname);
+  kfree(argbuf);
+  kfree(argvec);
+  return result;
 }
 
 
@@ -305,6 +372,12 @@ void sys__exit(int exitcode) {
   panic("return from thread_exit in sys_exit\n");
 }
 
+/* exit statuses are not kept before A2 either */
+void proc_exit(int waitstatus) {
+  (void)waitstatus;
+  sys__exit(0);
+}
+
 
 /* stub handler for getpid() system call                */
 int sys_getpid(pid_t *retval) {
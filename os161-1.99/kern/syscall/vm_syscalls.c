@@ -0,0 +1,120 @@
+/*
+ * VM system calls.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+#include <limits.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <copyinout.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <syscall.h>
+
+/*
+ * sbrk: move the end of the heap by AMOUNT bytes and return the old
+ * end. The user malloc grows its heap with this.
+ */
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_sbrk(as, amount, retval);
+}
+
+/*
+ * mmap: map the file at PATH. With no file descriptors to hand, this
+ * takes a pathname and maps from the start of the file; see
+ * <kern/mman.h>.
+ */
+int
+sys_mmap(userptr_t path, size_t length, int prot, int flags,
+	 vaddr_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *v;
+	struct stat st;
+	char *kpath;
+	size_t filesz;
+	unsigned vrflags;
+	int result;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	if (length == 0 || (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))) {
+		return EINVAL;
+	}
+	if (flags != MAP_SHARED && flags != MAP_PRIVATE) {
+		return EINVAL;
+	}
+
+	vrflags = 0;
+	if (prot & PROT_READ) {
+		vrflags |= VR_READ;
+	}
+	if (prot & PROT_WRITE) {
+		vrflags |= VR_WRITE;
+	}
+	if (prot & PROT_EXEC) {
+		vrflags |= VR_EXEC;
+	}
+	if (flags == MAP_SHARED) {
+		vrflags |= VR_SHARED;
+	}
+
+	kpath = kmalloc(PATH_MAX);
+	if (kpath == NULL) {
+		return ENOMEM;
+	}
+	result = copyinstr(path, kpath, PATH_MAX, NULL);
+	if (result) {
+		kfree(kpath);
+		return result;
+	}
+
+	/* A shared writable mapping needs to be able to write the file. */
+	result = vfs_open(kpath,
+			  (vrflags & VR_SHARED) && (vrflags & VR_WRITE) ?
+			  O_RDWR : O_RDONLY, 0, &v);
+	kfree(kpath);
+	if (result) {
+		return result;
+	}
+
+	result = VOP_MMAP(v);
+	if (result == 0) {
+		result = VOP_STAT(v, &st);
+	}
+	if (result == 0) {
+		filesz = st.st_size < (off_t)length ? st.st_size : length;
+		/* The region takes its own reference to the vnode. */
+		result = as_mmap(as, v, length, vrflags, filesz, retval);
+	}
+	vfs_close(v);
+	return result;
+}
+
+int
+sys_munmap(vaddr_t addr, size_t length)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	if (as == NULL) {
+		return EINVAL;
+	}
+	return as_munmap(as, addr, length);
+}
@@ -0,0 +1,121 @@
+/*
+ * Test code for the physical frame allocator.
+ */
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <coremap.h>
+#include <test.h>
+
+/*
+ * Allocate NRUNS runs of assorted sizes with alloc_kpages, fill each
+ * with a pattern, check that no run stomped on another, then free
+ * them in a scrambled order. Afterwards the free frame count should
+ * be back where it started, and so should the number of free blocks
+ * of each order: the frame count alone would match even if the
+ * buddies never coalesced again. Both snapshots are taken with every
+ * cpu's frame magazines flushed, so the single frames they hold are
+ * back on the buddy lists too.
+ *
+ * Keep NRUNS * the average run size well under the size of RAM; if
+ * alloc_kpages runs out it returns 0 and the test fails.
+ */
+
+#define NRUNS 24
+
+static vaddr_t runs[NRUNS];
+static unsigned runpages[NRUNS];
+
+static
+void
+fillrun(unsigned n)
+{
+	uint32_t *p = (uint32_t *)runs[n];
+	unsigned i, words;
+
+	words = runpages[n] * PAGE_SIZE / sizeof(uint32_t);
+	for (i=0; i<words; i++) {
+		p[i] = (n << 24) ^ i;
+	}
+}
+
+static
+bool
+checkrun(unsigned n)
+{
+	uint32_t *p = (uint32_t *)runs[n];
+	unsigned i, words;
+
+	words = runpages[n] * PAGE_SIZE / sizeof(uint32_t);
+	for (i=0; i<words; i++) {
+		if (p[i] != ((n << 24) ^ i)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+coremaptest(int nargs, char **args)
+{
+	unsigned i, before, after;
+	unsigned blocksbefore[COREMAP_MAXORDER+1];
+	unsigned blocksafter[COREMAP_MAXORDER+1];
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting coremap test...\n");
+
+	coremap_flushall();
+	before = coremap_freecount();
+	coremap_freeblocks(blocksbefore);
+
+	for (i=0; i<NRUNS; i++) {
+		/* 1, 2, 3, 5, 8 pages: powers of two and not */
+		runpages[i] = (i % 5 == 4) ? 8 : (i % 5 == 3) ? 5 : i % 5 + 1;
+		runs[i] = alloc_kpages(runpages[i]);
+		if (runs[i] == 0) {
+			kprintf("alloc_kpages(%u) returned 0; test failed.\n",
+				runpages[i]);
+			return 0;
+		}
+		KASSERT(runs[i] % PAGE_SIZE == 0);
+		fillrun(i);
+	}
+
+	for (i=0; i<NRUNS; i++) {
+		if (!checkrun(i)) {
+			kprintf("run %u (%u pages at 0x%x) was overwritten\n",
+				i, runpages[i], runs[i]);
+			ok = false;
+		}
+	}
+
+	/* Free odd runs first, then even ones, to exercise merging. */
+	for (i=1; i<NRUNS; i+=2) {
+		free_kpages(runs[i]);
+	}
+	for (i=0; i<NRUNS; i+=2) {
+		free_kpages(runs[i]);
+	}
+
+	coremap_flushall();
+	after = coremap_freecount();
+	coremap_freeblocks(blocksafter);
+	if (after != before) {
+		kprintf("free frames: %u before, %u after\n", before, after);
+		ok = false;
+	}
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		if (blocksafter[i] != blocksbefore[i]) {
+			kprintf("free blocks of order %u: %u before, %u after\n",
+				i, blocksbefore[i], blocksafter[i]);
+			ok = false;
+		}
+	}
+
+	kprintf("coremap test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
@@ -34,7 +34,10 @@
 #include <lib.h>
 #include <thread.h>
 #include <synch.h>
+#include <vm.h>
+#include <coremap.h>
 #include <test.h>
+#include "opt-kheapprof.h"
 
 /*
  * Test kmalloc; allocate ITEMSIZE bytes NTRIES times, freeing
@@ -137,3 +140,176 @@ mallocstress(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Test krealloc. Grows a multi-page block both where it must move
+ * (another block right behind it) and where it can grow in place,
+ * shrinks it in place, checks that a krealloc that fails leaves the
+ * block alone, and moves blocks between the subpage allocator and
+ * whole pages. The contents must survive every step. With
+ * OPT_KHEAPPROF every krealloc moves the block instead.
+ *
+ * Afterwards the free frame count should be back where it started.
+ * Only the multi-page steps are counted: the subpage allocator may
+ * keep a page it took for the subpage ones.
+ */
+
+/* Far bigger than any block the coremap can build. */
+#define KREALLOC_HUGE  (((size_t)2 << COREMAP_MAXORDER) * PAGE_SIZE)
+
+static
+void
+kreallocfill(void *ptr, size_t start, size_t end)
+{
+	unsigned char *p = ptr;
+	size_t i;
+
+	for (i=start; i<end; i++) {
+		p[i] = (unsigned char)(i * 7 + i / PAGE_SIZE);
+	}
+}
+
+static
+bool
+kreallocchk(void *ptr, size_t end, const char *what)
+{
+	unsigned char *p = ptr;
+	size_t i;
+
+	for (i=0; i<end; i++) {
+		if (p[i] != (unsigned char)(i * 7 + i / PAGE_SIZE)) {
+			kprintf("%s: byte %u of %p lost\n", what,
+				(unsigned)i, ptr);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * krealloc PTR to SZ bytes, of which the first KEEP must survive.
+ * Expects it to stay put if INPLACE is 1 and to move if it is 0;
+ * -1 means either will do. Returns the new block, or NULL (having
+ * freed PTR) on failure.
+ */
+static
+void *
+kreallocstep(void *ptr, size_t sz, size_t keep, int inplace,
+	     const char *what)
+{
+	void *newptr;
+
+#if OPT_KHEAPPROF
+	/* Every block moves. */
+	inplace = 0;
+#endif
+	newptr = krealloc(ptr, sz);
+	if (newptr == NULL) {
+		kprintf("%s: krealloc returned NULL\n", what);
+		kfree(ptr);
+		return NULL;
+	}
+	if ((inplace == 1 && newptr != ptr) ||
+	    (inplace == 0 && newptr == ptr)) {
+		kprintf("%s: block %s\n", what,
+			inplace ? "moved" : "did not move");
+		kfree(newptr);
+		return NULL;
+	}
+	if (!kreallocchk(newptr, keep, what)) {
+		kfree(newptr);
+		return NULL;
+	}
+	kreallocfill(newptr, keep, sz);
+	return newptr;
+}
+
+int
+krealloctest(int nargs, char **args)
+{
+	void *a, *b, *p;
+	unsigned before, after;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting krealloc test...\n");
+
+	/* Subpage to multi-page and back. */
+	p = kmalloc(100);
+	if (p == NULL) {
+		kprintf("kmalloc returned NULL; test failed.\n");
+		return 0;
+	}
+	kreallocfill(p, 0, 100);
+	p = kreallocstep(p, 3 * PAGE_SIZE, 100, 0, "subpage grow");
+	if (p != NULL) {
+		/* A big block may just stay big. */
+		p = kreallocstep(p, 200, 200, -1, "subpage shrink");
+	}
+	if (p == NULL) {
+		ok = false;
+	}
+	kfree(p);
+
+	coremap_flushall();
+	before = coremap_freecount();
+
+	/*
+	 * Two 2-page blocks in a row usually come out of one 4-page
+	 * buddy block, back to back; then A cannot grow in place.
+	 */
+	a = kmalloc(2 * PAGE_SIZE);
+	b = kmalloc(2 * PAGE_SIZE);
+	if (a == NULL || b == NULL) {
+		kprintf("kmalloc returned NULL; test failed.\n");
+		kfree(a);
+		kfree(b);
+		return 0;
+	}
+	kreallocfill(a, 0, 2 * PAGE_SIZE);
+	a = kreallocstep(a, 4 * PAGE_SIZE, 2 * PAGE_SIZE,
+			 (char *)b == (char *)a + 2 * PAGE_SIZE ? 0 : -1,
+			 "blocked grow");
+	kfree(b);
+
+	/* Shrinking always works in place... */
+	if (a != NULL) {
+		a = kreallocstep(a, 3 * PAGE_SIZE, 3 * PAGE_SIZE, 1,
+				 "shrink");
+	}
+	/* ...and the page it gave back is very likely still free. */
+	if (a != NULL) {
+		a = kreallocstep(a, 4 * PAGE_SIZE, 3 * PAGE_SIZE, -1,
+				 "grow");
+	}
+
+	/* Failing must leave the old block alone. */
+	if (a != NULL) {
+		p = krealloc(a, KREALLOC_HUGE);
+		if (p != NULL) {
+			kprintf("huge krealloc: returned %p\n", p);
+			a = p;
+			ok = false;
+		}
+		else if (!kreallocchk(a, 4 * PAGE_SIZE, "huge krealloc")) {
+			ok = false;
+		}
+	}
+
+	if (a == NULL) {
+		ok = false;
+	}
+	kfree(a);
+
+	coremap_flushall();
+	after = coremap_freecount();
+	if (after != before) {
+		kprintf("free frames: %u before, %u after\n", before, after);
+		ok = false;
+	}
+
+	kprintf("krealloc test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
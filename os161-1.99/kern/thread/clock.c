@@ -32,6 +32,7 @@
 #include <cpu.h>
 #include <wchan.h>
 #include <clock.h>
+#include <mainbus.h>
 #include <thread.h>
 #include <lamebus/ltimer.h>
 #include <current.h>
@@ -52,26 +53,34 @@
  * the scheduler.
  */
 #define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
 
 /*
- * Once a second, everything waiting on lbolt is awakened by CPU 0.
- */
-static struct wchan *lbolt;
-/*
- * Once every LT_GRANULARITY usec, everything on minibolt is awakenened by CPU 0
+ * Timed sleeps.
+ *
+ * Sleepers wait on a hashed timer wheel: TIMERWHEEL_SLOTS wait
+ * channels, one per timer tick, used round and round. A thread that
+ * is to wake at tick T records T in t_wakeup and sleeps on slot
+ * T % TIMERWHEEL_SLOTS. Each tick, timerclock looks at the one slot
+ * for that tick and wakes the threads in it whose time has come;
+ * those due on a later lap of the wheel stay asleep. So a tick costs
+ * the threads in one slot, not every sleeper in the system, and no
+ * sleeper wakes up before its time just to go back to sleep.
  */
-static struct wchan *minibolt;
+#define TIMERWHEEL_SLOTS	256	/* 2.56 seconds of ticks */
 
-/* 
- * number of minibolts per second
- */
-#define MINI_PER_SECOND (1000000/LT_GRANULARITY);
+static struct wchan *timerwheel[TIMERWHEEL_SLOTS];
 
 /*
- * minibolt countdown
+ * Timer ticks since boot, counted by timerclock. It wraps, so compare
+ * ticks with (int)(a - b), and never sleep for half its range or more.
  */
-static int minicount;
+static volatile unsigned timerticks;
+
+/* timer ticks per second */
+#define MINI_PER_SECOND		(1000000/LT_GRANULARITY)
+
+/* Longest sleep in whole seconds that fits in one clocknap. */
+#define NAP_MAXSECS		(0x7fffffff / MINI_PER_SECOND - 1)
 
 /*
  * Setup.
@@ -79,17 +88,18 @@ static int minicount;
 void
 hardclock_bootstrap(void)
 {
-	lbolt = wchan_create("lbolt");
-	if (lbolt == NULL) {
-		panic("Couldn't create lbolt\n");
-	}
-	minibolt = wchan_create("minibolt");
-	if (minibolt == NULL) {
-		panic("Couldn't create minibolt\n");
-	}
-	minicount = MINI_PER_SECOND;
+	unsigned i;
+
 	/* we assume MINI_PER_SECOND > 0 */
-	KASSERT(minicount > 0);
+	KASSERT(MINI_PER_SECOND > 0);
+
+	for (i=0; i<TIMERWHEEL_SLOTS; i++) {
+		timerwheel[i] = wchan_create("timer");
+		if (timerwheel[i] == NULL) {
+			panic("Couldn't create timer wheel\n");
+		}
+	}
+	timerticks = 0;
 }
 
 /*
@@ -99,13 +109,11 @@ hardclock_bootstrap(void)
 void
 timerclock(void)
 {
-	/* Broadcast on minibolt */
-	wchan_wakeall(minibolt);
-	/* Broadcast on lbolt if a second has elapsed */
-	if (--minicount <= 0) {
-	  minicount = MINI_PER_SECOND;
-	  wchan_wakeall(lbolt);
-	}
+	unsigned now;
+
+	/* Count the tick before looking at the slot; see clocknap. */
+	now = ++timerticks;
+	wchan_wakeexpired(timerwheel[now % TIMERWHEEL_SLOTS], now);
 }
 
 /*
@@ -120,13 +128,43 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
+
+	if (curcpu->c_isidle) {
+		/*
+		 * Nothing is running, so there is nothing to charge or
+		 * preempt. Stop the timer until there is (see
+		 * hardclock_resume); meanwhile only IPIs and device
+		 * interrupts wake the idle loop.
+		 */
+		if (!curcpu->c_tickless) {
+			curcpu->c_tickless = true;
+			mainbus_hardclock_stop();
+		}
+		return;
+	}
+
+	/* Charge the tick to the thread it interrupted. */
+	curthread->t_ticks++;
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
+	if (thread_quantum_tick()) {
+		thread_yield();
+	}
+}
+
+/*
+ * Restart the current cpu's hardclock if going idle stopped it.
+ * Called by thread_switch, with interrupts off, when it has found a
+ * thread to run.
+ */
+void
+hardclock_resume(void)
+{
+	if (curcpu->c_tickless) {
+		curcpu->c_tickless = false;
+		mainbus_hardclock_start();
 	}
-	thread_yield();
 }
 
 /*
@@ -135,11 +173,9 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
-  while (num_secs > 0) {
-    wchan_lock(lbolt);
-    wchan_sleep(lbolt);
-    num_secs--;
-  }
+	if (num_secs > 0) {
+		clocknanosleep(num_secs, 0);
+	}
 }
 
 /*
@@ -149,9 +185,52 @@ clocksleep(int num_secs)
 void
 clocknap(int num_ticks)
 {
-  while (num_ticks > 0) {
-    wchan_lock(minibolt);
-    wchan_sleep(minibolt);
-    num_ticks--;
-  }
+	struct wchan *wc;
+	unsigned when;
+
+	if (num_ticks <= 0) {
+		return;
+	}
+
+	when = timerticks + num_ticks;
+	wc = timerwheel[when % TIMERWHEEL_SLOTS];
+	curthread->t_wakeup = when;
+
+	/*
+	 * timerclock counts a tick before it locks that tick's slot. So
+	 * if, with the slot locked, our tick has not come, timerclock
+	 * will find us in the slot when it does.
+	 */
+	while (1) {
+		wchan_lock(wc);
+		if ((int)(when - timerticks) <= 0) {
+			wchan_unlock(wc);
+			break;
+		}
+		wchan_sleep(wc);
+	}
+}
+
+/*
+ * Suspend execution for secs seconds and nsecs nanoseconds, rounded
+ * up to whole timer ticks. Part of the current tick has already gone
+ * by, so wait one more to be sure of sleeping at least that long.
+ */
+void
+clocknanosleep(time_t secs, uint32_t nsecs)
+{
+	int ticks;
+
+	KASSERT(secs >= 0);
+	KASSERT(nsecs < 1000000000);
+
+	if (secs == 0 && nsecs == 0) {
+		return;
+	}
+	ticks = DIVROUNDUP(nsecs, LT_GRANULARITY * 1000) + 1;
+	while (secs > NAP_MAXSECS) {
+		clocknap(NAP_MAXSECS * MINI_PER_SECOND);
+		secs -= NAP_MAXSECS;
+	}
+	clocknap(secs * MINI_PER_SECOND + ticks);
 }
@@ -50,6 +50,8 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <clock.h>
+#include <kmem_cache.h>
 
 #include "opt-synchprobs.h"
 
@@ -111,9 +113,43 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Threads come from an object cache. A cached thread keeps its list
+ * node and, once it has one, its stack, so thread_fork does not have
+ * to allocate a fresh stack every time.
+ */
+static
+int
+thread_ctor(void *obj)
+{
+	struct thread *thread = obj;
+
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_stack = NULL;
+	return 0;
+}
+
+static
+void
+thread_dtor(void *obj)
+{
+	struct thread *thread = obj;
+
+	if (thread->t_stack != NULL) {
+		kfree(thread->t_stack);
+	}
+}
+
+static struct kmem_cache thread_cache =
+	KMEM_CACHE_INITIALIZER("thread", sizeof(struct thread),
+			       thread_ctor, thread_dtor);
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
+ *
+ * The new thread may already have a stack, left over from an earlier
+ * thread that used the same structure.
  */
 static
 struct thread *
@@ -123,14 +159,14 @@ thread_create(const char *name)
 
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
+	thread = kmem_cache_alloc(&thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
 
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
+		kmem_cache_free(&thread_cache, thread);
 		return NULL;
 	}
 	thread->t_wchan_name = "NEW";
@@ -138,11 +174,15 @@ thread_create(const char *name)
 
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
+	/* t_listnode and t_stack are set up by thread_ctor */
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_quantum = 0;
+	thread->t_background = false;
+	thread->t_wakeup = 0;
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
@@ -168,6 +208,7 @@ cpu_create(unsigned hardware_number)
 	struct cpu *c;
 	int result;
 	char namebuf[16];
+	unsigned i;
 
 	c = kmalloc(sizeof(*c));
 	if (c == NULL) {
@@ -180,13 +221,25 @@ cpu_create(unsigned hardware_number)
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
+	c->c_tickless = false;
+	c->c_stealclock = 0;
+	c->c_stealseed = hardware_number + 1;
+	for (i=0; i<VMSTAT_COUNT; i++) {
+		c->c_vmstats[i] = 0;
+	}
+	coremap_cpu_init(&c->c_framecache);
+	kmalloc_cpu_init(&c->c_kmalloccache);
 
 	c->c_isidle = false;
-	threadlist_init(&c->c_runqueue);
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		threadlist_init(&c->c_runqueue[i]);
+	}
 	spinlock_init(&c->c_runqueue_lock);
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_posted = 0;
+	c->c_shootdown_acked = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -212,11 +265,14 @@ cpu_create(unsigned hardware_number)
 		 * make it possible to free the boot stack?)
 		 */
 		/*c->c_curthread->t_stack = ... */
+		KASSERT(c->c_curthread->t_stack == NULL);
 	}
 	else {
-		c->c_curthread->t_stack = kmalloc(STACK_SIZE);
 		if (c->c_curthread->t_stack == NULL) {
-			panic("cpu_create: couldn't allocate stack");
+			c->c_curthread->t_stack = kmalloc(STACK_SIZE);
+			if (c->c_curthread->t_stack == NULL) {
+				panic("cpu_create: couldn't allocate stack");
+			}
 		}
 		thread_checkstack_init(c->c_curthread);
 	}
@@ -227,6 +283,21 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Number of CPUs, and the CPU with a given (software) number.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
+struct cpu *
+cpu_get(unsigned num)
+{
+	return cpuarray_get(&allcpus, num);
+}
+
 /*
  * Destroy a thread.
  *
@@ -249,9 +320,7 @@ thread_destroy(struct thread *thread)
 
 	/* Thread subsystem fields */
 	KASSERT(thread->t_proc == NULL);
-	if (thread->t_stack != NULL) {
-		kfree(thread->t_stack);
-	}
+	/* The stack stays with the structure; see thread_ctor. */
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
@@ -259,7 +328,7 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	kmem_cache_free(&thread_cache, thread);
 }
 
 /*
@@ -289,6 +358,8 @@ exorcise(void)
 void
 thread_panic(void)
 {
+	unsigned i;
+
 	/*
 	 * Kill off other CPUs.
 	 *
@@ -303,9 +374,11 @@ thread_panic(void)
 	 * to.  Instead, blat the list structure by hand, and take the
 	 * risk that it might not be quite atomic.
 	 */
-	curcpu->c_runqueue.tl_count = 0;
-	curcpu->c_runqueue.tl_head.tln_next = NULL;
-	curcpu->c_runqueue.tl_tail.tln_prev = NULL;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		curcpu->c_runqueue[i].tl_count = 0;
+		curcpu->c_runqueue[i].tl_head.tln_next = NULL;
+		curcpu->c_runqueue[i].tl_tail.tln_prev = NULL;
+	}
 
 	/*
 	 * Ideally, we want to make sure sleeping threads don't wake
@@ -426,6 +499,212 @@ thread_start_cpus(void)
 	cpu_startup_sem = NULL;
 }
 
+/*
+ * Scheduler tuning; see schedule() below.
+ */
+
+/* Quantum at LEVEL, in hardclocks: one tick at the top, doubling. */
+#define SCHED_QUANTUM_TICKS	1
+#define SCHED_QUANTUM(level)	(SCHED_QUANTUM_TICKS << (level))
+
+/* Ticks at LEVEL before moving down: 40ms at the top, doubling. */
+#define SCHED_ALLOTMENT(level)	((HZ / 25) << (level))
+
+/* Hardclocks between agings: 1s. A multiple of SCHEDULE_HARDCLOCKS. */
+#define SCHED_AGE_HARDCLOCKS	HZ
+
+/*
+ * Run queue operations. A cpu's run queue is a threadlist for each
+ * priority level (see schedule() below). Call with the cpu's run
+ * queue lock held.
+ */
+
+/*
+ * Number of threads waiting to run on C.
+ */
+static
+unsigned
+runqueue_count(struct cpu *c)
+{
+	unsigned i, n;
+
+	n = 0;
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		n += c->c_runqueue[i].tl_count;
+	}
+	return n;
+}
+
+/*
+ * Highest level (lowest number) with a thread waiting on C, or
+ * SCHED_NLEVELS if none.
+ */
+static
+unsigned
+runqueue_toplevel(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Take the thread that should run next off C's run queue, or NULL.
+ */
+static
+struct thread *
+runqueue_remhead(struct cpu *c)
+{
+	unsigned level;
+
+	level = runqueue_toplevel(c);
+	if (level == SCHED_NLEVELS) {
+		return NULL;
+	}
+	return threadlist_remhead(&c->c_runqueue[level]);
+}
+
+/*
+ * Take the thread that would run last off C's run queue, or NULL.
+ */
+static
+struct thread *
+runqueue_remtail(struct cpu *c)
+{
+	unsigned i;
+
+	for (i=SCHED_NLEVELS; i-- > 0; ) {
+		if (!threadlist_isempty(&c->c_runqueue[i])) {
+			return threadlist_remtail(&c->c_runqueue[i]);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Queue T on C, behind the other threads at its level.
+ */
+static
+void
+runqueue_add(struct cpu *c, struct thread *t)
+{
+	KASSERT(t->t_priority < SCHED_NLEVELS);
+	threadlist_addtail(&c->c_runqueue[t->t_priority], t);
+}
+
+/*
+ * Thread migration.
+ *
+ * Work moves between cpus by stealing: a cpu that has run out of
+ * threads, just before it would go idle in thread_switch, takes the
+ * thread that would run last on some busy cpu's run queue and runs it
+ * instead. Busy cpus spend nothing on balancing, and nobody looks at
+ * the other run queues unless it has nothing better to do.
+ *
+ * Migrating threads isn't free because of cache affinity; a thread's
+ * working cache set will end up having to be moved to the other CPU,
+ * which is fairly slow. System/161 does not (yet) model such cache
+ * effects, so the only restraint is on the thief: after a sweep that
+ * finds nothing, a cpu waits STEAL_HARDCLOCKS before looking again,
+ * so idle cpus do not hammer the busy ones' run queue locks. Victims
+ * are tried starting from a random cpu, so that thieves spread out
+ * instead of all queueing up on the first busy cpu.
+ */
+
+/* Hardclocks between steal sweeps that found nothing. */
+#define STEAL_HARDCLOCKS	2
+
+/*
+ * Try to take a thread from another cpu's run queue. Returns it,
+ * already moved to the current cpu, or NULL. Call with interrupts off
+ * and without our own run queue lock, since we take another's.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	unsigned i, numcpus, start;
+	struct cpu *c;
+	struct thread *t;
+
+	if (curcpu->c_hardclocks - curcpu->c_stealclock < STEAL_HARDCLOCKS) {
+		return NULL;
+	}
+	numcpus = cpuarray_num(&allcpus);
+
+	/* A cheap random number (an LCG); no need for the random device. */
+	curcpu->c_stealseed = curcpu->c_stealseed * 1103515245 + 12345;
+	start = (curcpu->c_stealseed >> 16) % numcpus;
+
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c == curcpu->c_self) {
+			continue;
+		}
+		/*
+		 * Unlocked peek, to leave idle and empty cpus alone. An
+		 * idle cpu will run its own queue once it notices.
+		 */
+		if (c->c_isidle || runqueue_toplevel(c) == SCHED_NLEVELS) {
+			continue;
+		}
+
+		spinlock_acquire(&c->c_runqueue_lock);
+		t = runqueue_remtail(c);
+		if (t != NULL && t == c->c_curthread) {
+			/*
+			 * The thread went to sleep, c went idle still
+			 * on its stack, and it has been woken up again
+			 * before c got around to noticing. It is still
+			 * running on c as far as its stack goes, so
+			 * leave it there.
+			 */
+			runqueue_add(c, t);
+			t = NULL;
+		}
+		spinlock_release(&c->c_runqueue_lock);
+
+		if (t != NULL) {
+			/* Off every queue, so nobody else can touch it. */
+			t->t_cpu = curcpu->c_self;
+			DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u\n",
+			      t->t_name, c->c_number, curcpu->c_number);
+			return t;
+		}
+	}
+
+	curcpu->c_stealclock = curcpu->c_hardclocks;
+	return NULL;
+}
+
+/*
+ * TARGETCPU, which is busy, has threads waiting. Wake up some idle
+ * cpu, if there is one, to come and steal them. Idle cpus take no
+ * hardclocks, so otherwise they would not look until some device
+ * happened to interrupt them.
+ */
+static
+void
+thread_kick_idle(struct cpu *targetcpu)
+{
+	unsigned i;
+	struct cpu *c;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		/* Unlocked peek; a wasted IPI costs little. */
+		if (c != targetcpu && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
+		}
+	}
+}
+
 /*
  * Make a thread runnable.
  *
@@ -450,7 +729,7 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 	}
 
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_add(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -458,6 +737,9 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else {
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -492,11 +774,13 @@ thread_fork(const char *name,
 		return ENOMEM;
 	}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
+	/* Allocate a stack, unless the structure came with one */
 	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -548,6 +832,7 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc)
 {
 	struct thread *cur, *next;
+	unsigned top;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -573,11 +858,23 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
-		spinlock_release(&curcpu->c_runqueue_lock);
-		splx(spl);
-		return;
+	/*
+	 * If nothing else can run, just return. A thread preempted by
+	 * the timer also keeps the cpu unless something at its own
+	 * level or above is waiting. (A voluntary yield, though, is
+	 * usually waiting for some other thread to do something, so it
+	 * always lets the next one go first; see below.)
+	 */
+	next = NULL;
+	if (newstate == S_READY) {
+		top = runqueue_toplevel(curcpu);
+		if (top == SCHED_NLEVELS ||
+		    (cur->t_in_interrupt && top > cur->t_priority)) {
+			cur->t_quantum = SCHED_QUANTUM(cur->t_priority);
+			spinlock_release(&curcpu->c_runqueue_lock);
+			splx(spl);
+			return;
+		}
 	}
 
 	/* Put the thread in the right place. */
@@ -585,6 +882,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
+		if (!cur->t_in_interrupt) {
+			next = runqueue_remhead(curcpu);
+		}
 		thread_make_runnable(cur, true /*have lock*/);
 		break;
 	    case S_SLEEP:
@@ -613,10 +913,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 	cur->t_state = newstate;
 
 	/*
-	 * Get the next thread. While there isn't one, call md_idle().
+	 * Get the next thread. While there isn't one, try to steal one
+	 * from another cpu, and failing that call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
-	 * called. Unlock the runqueue while idling too, to make sure
-	 * things can be added to it.
+	 * called. Unlock the runqueue while stealing and idling too,
+	 * to make sure things can be added to it.
 	 *
 	 * Note that we don't need to unlock the runqueue atomically
 	 * with idling; becoming unidle requires receiving an
@@ -631,15 +932,20 @@ thread_switch(threadstate_t newstate, struct wchan *wc)
 
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
-	do {
-		next = threadlist_remhead(&curcpu->c_runqueue);
+	while (next == NULL) {
+		next = runqueue_remhead(curcpu);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
-	} while (next == NULL);
+	}
 	curcpu->c_isidle = false;
+	hardclock_resume();
+	next->t_quantum = SCHED_QUANTUM(next->t_priority);
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -824,137 +1130,110 @@ thread_yield(void)
  *
  * This is called periodically from hardclock(). It should reshuffle
  * the current CPU's run queue by job priority.
- */
-
-void
-schedule(void)
-{
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
-}
-
-/*
- * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * The run queue is a multi-level feedback queue: each cpu has
+ * SCHED_NLEVELS queues, thread_switch always takes the next thread
+ * from the highest level that has one (level 0 is highest), and
+ * threads at the same level take turns. New threads start at the
+ * top, and move between levels as follows:
  *
- * Migrating threads isn't free because of cache affinity; a thread's
- * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
+ *    - hardclock charges each tick to the thread it interrupts
+ *      (t_ticks). Once a thread has run for SCHED_ALLOTMENT ticks at
+ *      its level, we move it down one, where the allotment is twice
+ *      as long. Threads that keep the cpu busy sink to the bottom
+ *      and get what the others leave.
+ *
+ *    - A thread woken from wchan_sleep moves up one (thread_wake).
+ *      Threads that mostly wait, for the console or the disk or each
+ *      other, stay near the top and get the cpu when they want it.
  *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ *    - Every SCHED_AGE_HARDCLOCKS, everything on the cpu moves up
+ *      one, so nothing at the bottom starves.
+ *
+ * Background threads (thread_setbackground) are the exception: they
+ * stay at the bottom level whatever they do.
+ *
+ * A thread runs until it sleeps, or for a quantum of SCHED_QUANTUM
+ * ticks, or until a thread at a higher level is waiting
+ * (thread_quantum_tick). The quantum too is longer further down, so
+ * that the threads that get preempted the most are switched the
+ * least often.
  */
+
 void
-thread_consider_migration(void)
+schedule(void)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
-	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
-
-	my_count = total_count = 0;
-	numcpus = cpuarray_num(&allcpus);
-	for (i=0; i<numcpus; i++) {
-		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
-		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
+	struct thread *cur, *t;
+	unsigned level, n;
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
-	}
+	cur = curthread;
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
-	}
-	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
-			continue;
-		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
+	/*
+	 * If we are idle, curthread is asleep, not running, and not
+	 * ours to move.
+	 */
+	if (!curcpu->c_isidle && cur->t_priority < SCHED_NLEVELS - 1 &&
+	    cur->t_ticks >= SCHED_ALLOTMENT(cur->t_priority)) {
+		cur->t_priority++;
+		cur->t_ticks = 0;
+	}
 
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
+	if (curcpu->c_hardclocks % SCHED_AGE_HARDCLOCKS == 0) {
+		/* Level by level, top down, so each moves only once. */
+		for (level=1; level<SCHED_NLEVELS; level++) {
+			n = curcpu->c_runqueue[level].tl_count;
+			while (n-- > 0) {
+				t = threadlist_remhead(
+					&curcpu->c_runqueue[level]);
+				if (!t->t_background) {
+					t->t_priority = level - 1;
+					t->t_ticks = 0;
+				}
+				runqueue_add(curcpu, t);
 			}
 		}
-		spinlock_release(&c->c_runqueue_lock);
+		if (!curcpu->c_isidle && cur->t_priority > 0 &&
+		    !cur->t_background) {
+			cur->t_priority--;
+			cur->t_ticks = 0;
+		}
 	}
 
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
-		}
-		spinlock_release(&curcpu->c_runqueue_lock);
+	spinlock_release(&curcpu->c_runqueue_lock);
+}
+
+bool
+thread_quantum_tick(void)
+{
+	struct thread *cur;
+
+	cur = curthread;
+	if (cur->t_quantum > 0) {
+		cur->t_quantum--;
+	}
+	if (cur->t_quantum == 0) {
+		return true;
 	}
+	/* Unlocked peek; if we miss a waiter, we see it next tick. */
+	return runqueue_toplevel(curcpu) < cur->t_priority;
+}
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+bool
+thread_others_ready(void)
+{
+	/* Unlocked peek; the answer can be stale by the time we use it. */
+	return runqueue_toplevel(curcpu) < SCHED_NLEVELS;
+}
+
+void
+thread_setbackground(void)
+{
+	/* We're running, so not on a run queue; no lock needed. */
+	curthread->t_background = true;
+	curthread->t_priority = SCHED_NLEVELS - 1;
+	curthread->t_ticks = 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -963,6 +1242,35 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Wait channels come from an object cache. A cached wchan keeps its
+ * spinlock and (empty) thread list initialized between uses.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_init(&wc->wc_lock);
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	spinlock_cleanup(&wc->wc_lock);
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+static struct kmem_cache wchan_cache =
+	KMEM_CACHE_INITIALIZER("wchan", sizeof(struct wchan),
+			       wchan_ctor, wchan_dtor);
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -976,26 +1284,35 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = kmem_cache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	spinlock_init(&wc->wc_lock);
-	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
+/*
+ * Change a wait channel's name, for objects that keep their wait
+ * channel across reuse (see synch.c).
+ */
+void
+wchan_setname(struct wchan *wc, const char *name)
+{
+	wc->wc_name = name;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
- * (The corresponding cleanup functions require this.)
+ * (The cache's destructor does the actual cleanup, eventually.)
  */
 void
 wchan_destroy(struct wchan *wc)
 {
-	spinlock_cleanup(&wc->wc_lock);
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(!spinlock_do_i_hold(&wc->wc_lock));
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	wc->wc_name = "DESTROYED";
+	kmem_cache_free(&wchan_cache, wc);
 }
 
 /*
@@ -1028,6 +1345,22 @@ wchan_sleep(struct wchan *wc)
 	thread_switch(S_SLEEP, wc);
 }
 
+/*
+ * Make TARGET, just taken off a wait channel, runnable again. Having
+ * slept, it moves up a level (see schedule()), unless it is a
+ * background thread.
+ */
+static
+void
+thread_wake(struct thread *target)
+{
+	if (target->t_priority > 0 && !target->t_background) {
+		target->t_priority--;
+	}
+	target->t_ticks = 0;
+	thread_make_runnable(target, false);
+}
+
 /*
  * Wake up one thread sleeping on a wait channel.
  */
@@ -1050,7 +1383,7 @@ wchan_wakeone(struct wchan *wc)
 		return;
 	}
 
-	thread_make_runnable(target, false);
+	thread_wake(target);
 }
 
 /*
@@ -1084,7 +1417,39 @@ wchan_wakeall(struct wchan *wc)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
-		thread_make_runnable(target, false);
+		thread_wake(target);
+	}
+
+	threadlist_cleanup(&list);
+}
+
+/*
+ * Wake up the threads sleeping on a wait channel whose wakeup time has
+ * come.
+ */
+void
+wchan_wakeexpired(struct wchan *wc, unsigned now)
+{
+	struct threadlistnode *node;
+	struct thread *target;
+	struct threadlist list;
+
+	threadlist_init(&list);
+
+	spinlock_acquire(&wc->wc_lock);
+	node = wc->wc_threads.tl_head.tln_next;
+	while (node->tln_next != NULL) {
+		target = node->tln_self;
+		node = node->tln_next;
+		if ((int)(target->t_wakeup - now) <= 0) {
+			threadlist_remove(&wc->wc_threads, target);
+			threadlist_addtail(&list, target);
+		}
+	}
+	spinlock_release(&wc->wc_lock);
+
+	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wake(target);
 	}
 
 	threadlist_cleanup(&list);
@@ -1143,23 +1508,53 @@ ipi_broadcast(int code)
 void
 ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 {
-	int n;
+	(void)ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+unsigned
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned n)
+{
+	unsigned i, ticket;
+	int k;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
-	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i=0; i<n; i++) {
+		k = target->c_numshootdown;
+		if (k == TLBSHOOTDOWN_ALL) {
+			/* already flushing everything */
+			break;
+		}
+		if (k == TLBSHOOTDOWN_MAX) {
+			target->c_numshootdown = TLBSHOOTDOWN_ALL;
+			break;
+		}
+		target->c_shootdown[k] = mappings[i];
+		target->c_numshootdown = k+1;
 	}
+	ticket = ++target->c_shootdown_posted;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return ticket;
+}
+
+void
+ipi_tlbshootdown_wait(struct cpu *target, unsigned ticket)
+{
+	/*
+	 * The target acknowledges from its interrupt handler, which
+	 * is quick, so spin rather than sleep. Interrupts must be on so
+	 * we can answer other cpus' shootdowns meanwhile.
+	 */
+	KASSERT(curthread->t_curspl == 0);
+	while ((int)(target->c_shootdown_acked - ticket) < 0) {
+		/* spin */
+	}
 }
 
 void
@@ -1189,8 +1584,10 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt. There is work for us, here or on a busy
+		 * cpu, so let thread_steal look again right away.
 		 */
+		curcpu->c_stealclock = curcpu->c_hardclocks - STEAL_HARDCLOCKS;
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
@@ -1202,6 +1599,15 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		/* Everything queued so far was in the batch just done. */
+		curcpu->c_shootdown_acked = curcpu->c_shootdown_posted;
+	}
+	if (bits & (1U << IPI_KMALLOCFLUSH)) {
+		/* Before the frames, which this may add to. */
+		kmalloc_cpu_flush();
+	}
+	if (bits & (1U << IPI_FRAMEFLUSH)) {
+		coremap_cpu_flush();
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -36,6 +36,7 @@
 #include <synch.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <pagecache.h>
 
 /*
  * Initialize an abstract vnode.
@@ -53,6 +54,8 @@ vnode_init(struct vnode *vn, const struct vnode_ops *ops,
 	vn->vn_opencount = 0;
 	vn->vn_fs = fs;
 	vn->vn_data = fsdata;
+	vn->vn_pcgen = 0;
+	vn->vn_pcpages = 0;
 	return 0;
 }
 
@@ -66,6 +69,9 @@ vnode_cleanup(struct vnode *vn)
 	KASSERT(vn->vn_refcount==1);
 	KASSERT(vn->vn_opencount==0);
 
+	/* The memory may come back as another file; forget this one. */
+	pagecache_invalidate(vn);
+
 	vn->vn_ops = NULL;
 	vn->vn_refcount = 0;
 	vn->vn_opencount = 0;
@@ -74,6 +80,33 @@ vnode_cleanup(struct vnode *vn)
 }
 
 
+/*
+ * Write to a file, or change its length.
+ * Invoked by VOP_WRITE and VOP_TRUNCATE.
+ *
+ * Any cached pages of the file are now stale, so drop them once the
+ * operation is done -- even if it failed, as it may have got partway.
+ */
+int
+vnode_write(struct vnode *vn, struct uio *uio)
+{
+	int result;
+
+	result = __VOP(vn, write)(vn, uio);
+	pagecache_invalidate(vn);
+	return result;
+}
+
+int
+vnode_truncate(struct vnode *vn, off_t len)
+{
+	int result;
+
+	result = __VOP(vn, truncate)(vn, len);
+	pagecache_invalidate(vn);
+	return result;
+}
+
 /*
  * Increment refcount.
  * Called by VOP_INCREF.
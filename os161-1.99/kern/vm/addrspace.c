@@ -0,0 +1,816 @@
+/*
+ * Machine-independent address space management.
+ *
+ * An address space is a list of regions plus a page table. Nothing is
+ * allocated for a page until the program touches it: vm_fault finds
+ * the region, allocates and zeroes a frame, and records it in the page
+ * table. as_activate and as_deactivate, which have to frob the TLB,
+ * live with vm_fault in the machine-dependent VM code.
+ *
+ * Segments of the executable are not read in by load_elf; their
+ * regions remember the vnode and file offset instead, and each page
+ * is read from the file the first time it is touched (as_fill_page).
+ *
+ * as_copy (fork) shares the parent's frames with the child instead of
+ * copying them. Shared frames are reference counted by the coremap
+ * and mapped read-only with PTE_COW set; vm_fault makes the private
+ * copy when one side writes.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vnode.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <swap.h>
+
+static void as_drop_pages(struct addrspace *as, struct vm_region *vr,
+			  vaddr_t start, vaddr_t end);
+
+/* Every address space; see as_foreach. Under the pageout lock. */
+static struct addrspace *as_all;
+
+struct addrspace *
+as_create(void)
+{
+	struct addrspace *as;
+	unsigned i;
+
+	as = kmalloc(sizeof(struct addrspace));
+	if (as == NULL) {
+		return NULL;
+	}
+
+	as->as_pt = pt_create();
+	if (as->as_pt == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->as_regions = NULL;
+	spinlock_init(&as->as_lock);
+	as->as_loading = false;
+	as->as_stacklimit = VM_STACKLIMIT;
+	as->as_heapbase = 0;
+	as->as_heaptop = 0;
+	for (i=0; i<MAXCPUS; i++) {
+		as->as_asid[i] = 0;	/* none yet on any cpu */
+	}
+
+	pageout_lock_acquire();
+	as->as_prev = NULL;
+	as->as_next = as_all;
+	if (as_all != NULL) {
+		as_all->as_prev = as;
+	}
+	as_all = as;
+	pageout_lock_release();
+
+	return as;
+}
+
+static
+int
+as_free_page(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	(void)vaddr;
+	(void)data;
+
+	KASSERT((*pte & PTE_BUSY) == 0);
+	if (*pte & PTE_VALID) {
+		coremap_free(*pte & PTE_FRAME);
+	}
+	else if (*pte & PTE_SWAPPED) {
+		swap_free(PTE_SLOT(*pte));
+	}
+	*pte = 0;
+	return 0;
+}
+
+void
+as_destroy(struct addrspace *as)
+{
+	struct vm_region *vr;
+
+	/* Shared mappings have to reach their files first. */
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vr->vr_flags & VR_SHARED) {
+			as_drop_pages(as, vr, vr->vr_base,
+				      vr->vr_base + vr->vr_npages * PAGE_SIZE);
+		}
+	}
+
+	/*
+	 * Hold off pageout, which may be about to pick one of our
+	 * frames, until none of them belong to us any more, and take
+	 * us off the list it searches for sharers.
+	 */
+	pageout_lock_acquire();
+	if (as->as_prev != NULL) {
+		as->as_prev->as_next = as->as_next;
+	}
+	else {
+		KASSERT(as_all == as);
+		as_all = as->as_next;
+	}
+	if (as->as_next != NULL) {
+		as->as_next->as_prev = as->as_prev;
+	}
+	pt_foreach(as->as_pt, as_free_page, NULL);
+	pageout_lock_release();
+	pt_destroy(as->as_pt);
+
+	while (as->as_regions != NULL) {
+		vr = as->as_regions;
+		as->as_regions = vr->vr_next;
+		if (vr->vr_vnode != NULL) {
+			VOP_DECREF(vr->vr_vnode);
+		}
+		kfree(vr);
+	}
+
+	spinlock_cleanup(&as->as_lock);
+	kfree(as);
+}
+
+struct vm_region *
+as_find_region(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr;
+
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vaddr < vr->vr_base) {
+			/* sorted, so it isn't in any later region either */
+			return NULL;
+		}
+		if (vaddr < vr->vr_base + vr->vr_npages * PAGE_SIZE) {
+			return vr;
+		}
+	}
+	return NULL;
+}
+
+struct vm_region *
+as_grow_stack(struct addrspace *as, vaddr_t vaddr)
+{
+	struct vm_region *vr, *below;
+	vaddr_t base;
+
+	/* The stack is the top region; remember the one under it. */
+	below = NULL;
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		if (vr->vr_flags & VR_STACK) {
+			break;
+		}
+		below = vr;
+	}
+	if (vr == NULL || vaddr >= vr->vr_base) {
+		return NULL;
+	}
+
+	base = vaddr & PAGE_FRAME;
+	if (base < USERSTACK - as->as_stacklimit * PAGE_SIZE) {
+		return NULL;
+	}
+	if (below != NULL &&
+	    base < below->vr_base + (below->vr_npages + VM_STACKGUARD)
+	    * PAGE_SIZE) {
+		/* Would run into the guard gap. */
+		return NULL;
+	}
+
+	/*
+	 * Frames still come one at a time, on first touch. Move both
+	 * ends under as_lock so pageout never sees half the change.
+	 */
+	spinlock_acquire(&as->as_lock);
+	vr->vr_npages += (vr->vr_base - base) / PAGE_SIZE;
+	vr->vr_base = base;
+	spinlock_release(&as->as_lock);
+	return vr;
+}
+
+/*
+ * Insert a region covering [VADDR, VADDR+NPAGES pages), keeping the
+ * list sorted. Fails with EINVAL if it would overlap an existing one.
+ * Hands back the new region in *RET if RET is not NULL.
+ */
+static
+int
+as_add_region(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	      unsigned flags, struct vm_region **ret)
+{
+	struct vm_region *vr, **pp;
+	vaddr_t top;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	top = vaddr + npages * PAGE_SIZE;
+	if (npages == 0 || top > USERSPACETOP || top < vaddr) {
+		return EINVAL;
+	}
+
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->vr_next) {
+		if ((*pp)->vr_base >= top) {
+			break;
+		}
+		if ((*pp)->vr_base + (*pp)->vr_npages * PAGE_SIZE > vaddr) {
+			return EINVAL;
+		}
+	}
+
+	vr = kmalloc(sizeof(*vr));
+	if (vr == NULL) {
+		return ENOMEM;
+	}
+	vr->vr_base = vaddr;
+	vr->vr_npages = npages;
+	vr->vr_flags = flags;
+	vr->vr_vnode = NULL;
+	vr->vr_fileoff = 0;
+	vr->vr_filestart = 0;
+	vr->vr_filesz = 0;
+	vr->vr_next = *pp;
+	/* Pageout may be walking the list (see swap_unmap). */
+	spinlock_acquire(&as->as_lock);
+	*pp = vr;
+	spinlock_release(&as->as_lock);
+	if (ret != NULL) {
+		*ret = vr;
+	}
+	return 0;
+}
+
+int
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
+		 int readable, int writeable, int executable)
+{
+	unsigned flags;
+
+	/* Align the region. First, the base... */
+	sz += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+
+	/* ...and now the length. */
+	sz = (sz + PAGE_SIZE - 1) & PAGE_FRAME;
+
+	flags = 0;
+	if (readable) {
+		flags |= VR_READ;
+	}
+	if (writeable) {
+		flags |= VR_WRITE;
+	}
+	if (executable) {
+		flags |= VR_EXEC;
+	}
+
+	return as_add_region(as, vaddr, sz / PAGE_SIZE, flags, NULL);
+}
+
+int
+as_define_filebacked(struct addrspace *as, vaddr_t vaddr,
+		     struct vnode *v, off_t offset, size_t filesz)
+{
+	struct vm_region *vr;
+
+	vr = as_find_region(as, vaddr);
+	if (vr == NULL || vr->vr_vnode != NULL) {
+		return EINVAL;
+	}
+	if (filesz > vr->vr_base + vr->vr_npages * PAGE_SIZE - vaddr) {
+		return EINVAL;
+	}
+	if (filesz == 0) {
+		/* all bss; nothing to read */
+		return 0;
+	}
+
+	VOP_INCREF(v);
+	vr->vr_vnode = v;
+	vr->vr_fileoff = offset;
+	vr->vr_filestart = vaddr;
+	vr->vr_filesz = filesz;
+	return 0;
+}
+
+int
+as_fill_page(struct vm_region *vr, vaddr_t vaddr, paddr_t paddr,
+	     bool *readfile)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t kvaddr, start, end;
+	int result;
+
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	kvaddr = PADDR_TO_KVADDR(paddr);
+	*readfile = false;
+
+	/* The part of this page that comes from the file, if any. */
+	start = vaddr;
+	end = vaddr + PAGE_SIZE;
+	if (vr->vr_vnode != NULL) {
+		if (start < vr->vr_filestart) {
+			start = vr->vr_filestart;
+		}
+		if (end > vr->vr_filestart + vr->vr_filesz) {
+			end = vr->vr_filestart + vr->vr_filesz;
+		}
+	}
+	if (vr->vr_vnode == NULL || start >= end) {
+		bzero((void *)kvaddr, PAGE_SIZE);
+		return 0;
+	}
+
+	bzero((void *)kvaddr, start - vaddr);
+	bzero((void *)(kvaddr + (end - vaddr)), vaddr + PAGE_SIZE - end);
+
+	uio_kinit(&iov, &u, (void *)(kvaddr + (start - vaddr)), end - start,
+		  vr->vr_fileoff + (start - vr->vr_filestart), UIO_READ);
+	result = VOP_READ(vr->vr_vnode, &u);
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		/* the size was checked at load/mmap, so someone truncated it */
+		kprintf("vm: short read on file-backed page 0x%x\n", vaddr);
+		return ENOEXEC;
+	}
+
+	*readfile = true;
+	return 0;
+}
+
+bool
+as_page_hasfile(struct vm_region *vr, vaddr_t vaddr)
+{
+	KASSERT((vaddr & PAGE_FRAME) == vaddr);
+
+	return vr->vr_vnode != NULL &&
+		vaddr + PAGE_SIZE > vr->vr_filestart &&
+		vaddr < vr->vr_filestart + vr->vr_filesz;
+}
+
+static
+int
+as_count_resident(vaddr_t vaddr, pte_t *pte, void *data)
+{
+	unsigned *count = data;
+
+	(void)vaddr;
+
+	if (*pte & PTE_VALID) {
+		(*count)++;
+	}
+	return 0;
+}
+
+unsigned
+as_rss(struct addrspace *as)
+{
+	unsigned count;
+
+	count = 0;
+	spinlock_acquire(&as->as_lock);
+	pt_foreach(as->as_pt, as_count_resident, &count);
+	spinlock_release(&as->as_lock);
+	return count;
+}
+
+int
+as_foreach(int (*func)(struct addrspace *as, void *data), void *data)
+{
+	struct addrspace *as;
+	int result;
+
+	KASSERT(pageout_lock_held());
+
+	for (as = as_all; as != NULL; as = as->as_next) {
+		result = func(as, data);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the page at VADDR of shared mapping VR, held in the frame at
+ * PADDR, back to the file. Only the part of the page that came from
+ * the file is written; mappings never extend the file.
+ */
+int
+as_write_page(struct vm_region *vr, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+	vaddr_t kvaddr, start, end;
+	int result;
+
+	KASSERT(vr->vr_vnode != NULL);
+
+	start = vaddr;
+	end = vaddr + PAGE_SIZE;
+	if (start < vr->vr_filestart) {
+		start = vr->vr_filestart;
+	}
+	if (end > vr->vr_filestart + vr->vr_filesz) {
+		end = vr->vr_filestart + vr->vr_filesz;
+	}
+	if (start >= end) {
+		return 0;
+	}
+
+	kvaddr = PADDR_TO_KVADDR(paddr);
+	uio_kinit(&iov, &u, (void *)(kvaddr + (start - vaddr)), end - start,
+		  vr->vr_fileoff + (start - vr->vr_filestart), UIO_WRITE);
+	result = VOP_WRITE(vr->vr_vnode, &u);
+	if (result) {
+		kprintf("vm: write-back of page 0x%x failed: %s\n", vaddr,
+			strerror(result));
+	}
+	return result;
+}
+
+/*
+ * Throw away the pages in [START, END), which the program must no
+ * longer be able to fault in. If VR is a shared mapping, dirty pages
+ * are written back to its file first. Works a batch of pages at a
+ * time, since the TLB entries have to be shot down before the frames
+ * can be freed.
+ */
+static
+void
+as_drop_pages(struct addrspace *as, struct vm_region *vr,
+	      vaddr_t start, vaddr_t end)
+{
+	struct tlbbatch tb;
+	pte_t old[TLBSHOOTDOWN_MAX];
+	vaddr_t oldva[TLBSHOOTDOWN_MAX];
+	pte_t *pte;
+	vaddr_t va;
+	unsigned i, n;
+
+	va = start;
+	while (va < end) {
+		vm_tlbbatch_init(&tb);
+		n = 0;
+		for (; va < end && n < TLBSHOOTDOWN_MAX; va += PAGE_SIZE) {
+			pte = pt_lookup(as->as_pt, va, false);
+			if (pte == NULL) {
+				/* skip the rest of this table */
+				va = (va | (PT_NTABLE * PAGE_SIZE - 1))
+					- PAGE_SIZE + 1;
+				continue;
+			}
+
+			spinlock_acquire(&as->as_lock);
+			while (*pte & PTE_BUSY) {
+				/* Being paged out; let pageout finish. */
+				spinlock_release(&as->as_lock);
+				thread_yield();
+				spinlock_acquire(&as->as_lock);
+			}
+			old[n] = *pte;
+			*pte = 0;
+			spinlock_release(&as->as_lock);
+
+			if (old[n] & PTE_VALID) {
+				vm_tlbbatch_add(&tb, as, va);
+			}
+			if (old[n] != 0) {
+				oldva[n] = va;
+				n++;
+			}
+		}
+		vm_tlbbatch_flush(&tb);
+
+		for (i=0; i<n; i++) {
+			if (vr != NULL && (vr->vr_flags & VR_SHARED) &&
+			    (old[i] & (PTE_VALID | PTE_DIRTY)) ==
+			    (PTE_VALID | PTE_DIRTY)) {
+				as_write_page(vr, oldva[i],
+					      old[i] & PTE_FRAME);
+			}
+			if (old[i] & PTE_VALID) {
+				coremap_free(old[i] & PTE_FRAME);
+			}
+			else if (old[i] & PTE_SWAPPED) {
+				swap_free(PTE_SLOT(old[i]));
+			}
+		}
+	}
+}
+
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldtop)
+{
+	struct vm_region *vr, **pp;
+	vaddr_t top, end, oldend, limit;
+	size_t npages;
+	int result;
+
+	KASSERT(as->as_heapbase != 0);
+
+	top = as->as_heaptop + amount;
+	if (amount < 0 && (top > as->as_heaptop || top < as->as_heapbase)) {
+		return EINVAL;
+	}
+	limit = USERSTACK - (as->as_stacklimit + VM_STACKGUARD) * PAGE_SIZE;
+	if (amount > 0 && (top < as->as_heaptop || top > limit)) {
+		return ENOMEM;
+	}
+
+	/* Find the heap region, if it exists yet. */
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->vr_next) {
+		if ((*pp)->vr_flags & VR_HEAP) {
+			break;
+		}
+	}
+	vr = *pp;
+
+	npages = (top - as->as_heapbase + PAGE_SIZE - 1) / PAGE_SIZE;
+	end = as->as_heapbase + npages * PAGE_SIZE;
+
+	if (vr == NULL) {
+		if (npages > 0) {
+			result = as_add_region(as, as->as_heapbase, npages,
+					       VR_READ | VR_WRITE | VR_HEAP,
+					       NULL);
+			if (result) {
+				return result == EINVAL ? ENOMEM : result;
+			}
+		}
+	}
+	else if (npages > vr->vr_npages) {
+		if (vr->vr_next != NULL && end > vr->vr_next->vr_base) {
+			return ENOMEM;
+		}
+		spinlock_acquire(&as->as_lock);
+		vr->vr_npages = npages;
+		spinlock_release(&as->as_lock);
+	}
+	else if (npages < vr->vr_npages) {
+		/*
+		 * Take the pages out of the region before dropping them,
+		 * under as_lock as in as_munmap, and free the region only
+		 * once nothing can be paging them out.
+		 */
+		oldend = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		spinlock_acquire(&as->as_lock);
+		if (npages == 0) {
+			*pp = vr->vr_next;
+		}
+		else {
+			vr->vr_npages = npages;
+		}
+		spinlock_release(&as->as_lock);
+		as_drop_pages(as, NULL, end, oldend);
+		if (npages == 0) {
+			kfree(vr);
+		}
+	}
+
+	*oldtop = as->as_heaptop;
+	as->as_heaptop = top;
+	return 0;
+}
+
+int
+as_mmap(struct addrspace *as, struct vnode *v, size_t length,
+	unsigned flags, size_t filesz, vaddr_t *addr)
+{
+	struct vm_region *vr;
+	vaddr_t limit, bottom, top, base;
+	size_t npages;
+	int result;
+
+	npages = (length + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages == 0 || filesz > length) {
+		return EINVAL;
+	}
+
+	/*
+	 * Take the highest gap below the stack's range that fits, to
+	 * leave the heap as much room as possible.
+	 */
+	limit = USERSTACK - (as->as_stacklimit + VM_STACKGUARD) * PAGE_SIZE;
+	if (npages > limit / PAGE_SIZE) {
+		return ENOMEM;
+	}
+	base = 0;
+	bottom = as->as_heaptop;
+	for (vr = as->as_regions; ; vr = vr->vr_next) {
+		top = (vr == NULL || vr->vr_base > limit) ? limit : vr->vr_base;
+		bottom = (bottom + PAGE_SIZE - 1) & PAGE_FRAME;
+		if (top >= bottom && (top - bottom) / PAGE_SIZE >= npages) {
+			base = top - npages * PAGE_SIZE;
+		}
+		if (vr == NULL || top == limit) {
+			break;
+		}
+		if (vr->vr_base + vr->vr_npages * PAGE_SIZE > bottom) {
+			bottom = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+		}
+	}
+	if (base == 0) {
+		return ENOMEM;
+	}
+
+	result = as_add_region(as, base, npages, flags | VR_MMAP, &vr);
+	if (result) {
+		return result;
+	}
+	if (filesz > 0) {
+		VOP_INCREF(v);
+		vr->vr_vnode = v;
+		vr->vr_fileoff = 0;
+		vr->vr_filestart = base;
+		vr->vr_filesz = filesz;
+	}
+	*addr = base;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t length)
+{
+	struct vm_region *vr, **pp;
+
+	for (pp = &as->as_regions; *pp != NULL; pp = &(*pp)->vr_next) {
+		if ((*pp)->vr_base == addr) {
+			break;
+		}
+	}
+	vr = *pp;
+	if (vr == NULL || (vr->vr_flags & VR_MMAP) == 0 ||
+	    vr->vr_npages != (length + PAGE_SIZE - 1) / PAGE_SIZE) {
+		/* Only whole mappings can be removed. */
+		return EINVAL;
+	}
+
+	/*
+	 * Unlink it first so the pages cannot be faulted back in. Take
+	 * as_lock so pageout (see swap_unmap) never sees it half-gone.
+	 */
+	spinlock_acquire(&as->as_lock);
+	*pp = vr->vr_next;
+	spinlock_release(&as->as_lock);
+	as_drop_pages(as, vr, vr->vr_base,
+		      vr->vr_base + vr->vr_npages * PAGE_SIZE);
+	if (vr->vr_vnode != NULL) {
+		VOP_DECREF(vr->vr_vnode);
+	}
+	kfree(vr);
+	return 0;
+}
+
+int
+as_prepare_load(struct addrspace *as)
+{
+	/* Nothing to allocate up front; pages come in on first touch. */
+	as->as_loading = true;
+	return 0;
+}
+
+int
+as_complete_load(struct addrspace *as)
+{
+	struct vm_region *vr;
+
+	as->as_loading = false;
+
+	/* The heap starts where the last segment ends. */
+	for (vr = as->as_regions; vr != NULL; vr = vr->vr_next) {
+		as->as_heapbase = vr->vr_base + vr->vr_npages * PAGE_SIZE;
+	}
+	as->as_heaptop = as->as_heapbase;
+
+	/*
+	 * load_elf may have left writable TLB entries for read-only
+	 * segments behind; flush them.
+	 */
+	as_tlbflush(as);
+	return 0;
+}
+
+int
+as_define_stack(struct addrspace *as, vaddr_t *stackptr)
+{
+	int result;
+
+	/* One page to start with; as_grow_stack extends it on demand. */
+	result = as_add_region(as, USERSTACK - PAGE_SIZE, 1,
+			       VR_READ | VR_WRITE | VR_STACK, NULL);
+	if (result) {
+		return result;
+	}
+
+	*stackptr = USERSTACK;
+	return 0;
+}
+
+struct as_copyinfo {
+	struct addrspace *old;
+	struct addrspace *new;
+};
+
+/*
+ * Share one page of the old address space with the new one. Resident
+ * pages become copy-on-write in both; whoever writes first gets a copy
+ * (see vm_fault). Swapped-out pages just share the swap slot, since
+ * swapping in always makes a private copy anyway.
+ */
+static
+int
+as_share_page(vaddr_t vaddr, pte_t *oldpte, void *data)
+{
+	struct as_copyinfo *ci = data;
+	pte_t *newpte;
+
+	/* Allocate the new table, if needed, before taking the lock. */
+	newpte = pt_lookup(ci->new->as_pt, vaddr, true);
+	if (newpte == NULL) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&ci->old->as_lock);
+	while (*oldpte & PTE_BUSY) {
+		/* Being paged out; wait for pageout to finish with it. */
+		spinlock_release(&ci->old->as_lock);
+		thread_yield();
+		spinlock_acquire(&ci->old->as_lock);
+	}
+	if (*oldpte & PTE_VALID) {
+		coremap_share(*oldpte & PTE_FRAME);
+		if ((*oldpte & PTE_SHARED) == 0) {
+			*oldpte |= PTE_COW;
+		}
+	}
+	else if (*oldpte & PTE_SWAPPED) {
+		swap_share(PTE_SLOT(*oldpte));
+	}
+	*newpte = *oldpte;
+	spinlock_release(&ci->old->as_lock);
+	return 0;
+}
+
+int
+as_copy(struct addrspace *old, struct addrspace **ret)
+{
+	struct addrspace *new;
+	struct vm_region *vr, *newvr;
+	struct as_copyinfo ci;
+	int result;
+
+	new = as_create();
+	if (new==NULL) {
+		return ENOMEM;
+	}
+	new->as_stacklimit = old->as_stacklimit;
+	new->as_heapbase = old->as_heapbase;
+	new->as_heaptop = old->as_heaptop;
+
+	for (vr = old->as_regions; vr != NULL; vr = vr->vr_next) {
+		result = as_add_region(new, vr->vr_base, vr->vr_npages,
+				       vr->vr_flags, &newvr);
+		if (result) {
+			as_destroy(new);
+			return result;
+		}
+		if (vr->vr_vnode != NULL) {
+			VOP_INCREF(vr->vr_vnode);
+			newvr->vr_vnode = vr->vr_vnode;
+			newvr->vr_fileoff = vr->vr_fileoff;
+			newvr->vr_filestart = vr->vr_filestart;
+			newvr->vr_filesz = vr->vr_filesz;
+		}
+	}
+
+	/* No page is copied here; resident pages are shared instead. */
+	ci.old = old;
+	ci.new = new;
+	result = pt_foreach(old->as_pt, as_share_page, &ci);
+
+	/*
+	 * Even on failure some of the parent's pages may now be marked
+	 * copy-on-write, so its TLB must lose any writable entries.
+	 */
+	as_tlbflush(old);
+
+	if (result) {
+		as_destroy(new);
+		return result;
+	}
+
+	*ret = new;
+	return 0;
+}
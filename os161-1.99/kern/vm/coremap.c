@@ -0,0 +1,952 @@
+/*
+ * Physical page frame allocator (coremap + binary buddy system).
+ *
+ * See <coremap.h> for the interface.
+ *
+ * The coremap itself lives at the bottom of the memory handed to us by
+ * ram_getsize(); frame 0 of the coremap is the first page after it.
+ * Buddy arithmetic is done on frame numbers, not physical addresses,
+ * so the managed region does not itself need to be aligned to any
+ * particular power of two. Blocks that would run past the last frame
+ * are simply never built, which is how memory sizes that are not a
+ * power of two are handled.
+ *
+ * Each free block is threaded onto the free list for its order through
+ * the cm_next/cm_prev fields of its first frame. Only the first frame
+ * of a block (free or allocated) has cm_head set. A free block's head
+ * has its cm_order.
+ *
+ * Allocated memory is handed out in runs of exactly the size asked
+ * for: coremap_alloc takes the smallest buddy block that fits and
+ * gives back the tail, and the run's head records its length in
+ * cm_npages. Freeing a run breaks it back into aligned blocks, each
+ * of which merges with its buddies as usual. Since a run need not be
+ * a power of two, it can also grow into free frames after it
+ * (coremap_resize) or shrink.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <current.h>
+#include <thread.h>
+#include <vm.h>
+#include <coremap.h>
+
+static struct coremap_entry *coremap;
+static unsigned coremap_nframes;	/* number of managed frames */
+static paddr_t coremap_base;		/* physical address of frame 0 */
+static unsigned coremap_nfree;		/* frames currently free */
+
+/* Next frame the page replacement clock will look at. */
+static unsigned clock_hand;
+
+/* Heads of the per-order free lists (frame numbers, -1 = empty). */
+static int32_t freelists[COREMAP_MAXORDER+1];
+static unsigned freelist_counts[COREMAP_MAXORDER+1];
+
+#define FRAME_TO_PADDR(f)  (coremap_base + (paddr_t)(f) * PAGE_SIZE)
+#define PADDR_TO_FRAME(pa) ((int32_t)(((pa) - coremap_base) / PAGE_SIZE))
+
+/* Protects everything above once the coremap is set up. */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+////////////////////////////////////////////////////////////
+//
+// Free list primitives. Call with coremap_lock held.
+
+static
+void
+freelist_push(int32_t frame, unsigned order)
+{
+	struct coremap_entry *e = &coremap[frame];
+
+	KASSERT(order <= COREMAP_MAXORDER);
+
+	e->cm_state = CM_FREE;
+	e->cm_head = true;
+	e->cm_order = order;
+	e->cm_prev = -1;
+	e->cm_next = freelists[order];
+	if (freelists[order] >= 0) {
+		coremap[freelists[order]].cm_prev = frame;
+	}
+	freelists[order] = frame;
+	freelist_counts[order]++;
+}
+
+static
+void
+freelist_unlink(int32_t frame, unsigned order)
+{
+	struct coremap_entry *e = &coremap[frame];
+
+	KASSERT(e->cm_head && e->cm_state == CM_FREE);
+	KASSERT(e->cm_order == order);
+
+	if (e->cm_prev >= 0) {
+		coremap[e->cm_prev].cm_next = e->cm_next;
+	}
+	else {
+		KASSERT(freelists[order] == frame);
+		freelists[order] = e->cm_next;
+	}
+	if (e->cm_next >= 0) {
+		coremap[e->cm_next].cm_prev = e->cm_prev;
+	}
+	e->cm_next = e->cm_prev = -1;
+	e->cm_head = false;
+	KASSERT(freelist_counts[order] > 0);
+	freelist_counts[order]--;
+}
+
+/*
+ * Smallest order whose block holds NPAGES frames.
+ */
+static
+unsigned
+order_for(unsigned long npages)
+{
+	unsigned order = 0;
+
+	while (((unsigned long)1 << order) < npages) {
+		order++;
+	}
+	return order;
+}
+
+////////////////////////////////////////////////////////////
+
+void
+coremap_bootstrap(void)
+{
+	paddr_t lo, hi;
+	unsigned long total, mapbytes;
+	unsigned i, order;
+
+	ram_getsize(&lo, &hi);
+	lo = ROUNDUP(lo, PAGE_SIZE);
+	KASSERT(hi > lo);
+
+	/* Size the map for every page we got, then give up the pages it eats. */
+	total = (hi - lo) / PAGE_SIZE;
+	mapbytes = ROUNDUP(total * sizeof(struct coremap_entry), PAGE_SIZE);
+
+	coremap = (struct coremap_entry *)PADDR_TO_KVADDR(lo);
+	coremap_base = lo + mapbytes;
+	coremap_nframes = (hi - coremap_base) / PAGE_SIZE;
+
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		freelists[i] = -1;
+		freelist_counts[i] = 0;
+	}
+
+	for (i=0; i<coremap_nframes; i++) {
+		coremap[i].cm_state = CM_FREE;
+		coremap[i].cm_order = 0;
+		coremap[i].cm_head = false;
+		coremap[i].cm_npages = 0;
+		coremap[i].cm_refcount = 0;
+		coremap[i].cm_busy = false;
+		coremap[i].cm_referenced = false;
+		coremap[i].cm_next = -1;
+		coremap[i].cm_prev = -1;
+		coremap[i].cm_as = NULL;
+		coremap[i].cm_vaddr = 0;
+		coremap[i].cm_kdata = NULL;
+	}
+
+	/*
+	 * Carve the frames into the largest naturally aligned blocks
+	 * that fit, lowest address first.
+	 */
+	i = 0;
+	while (i < coremap_nframes) {
+		order = COREMAP_MAXORDER;
+		while ((i & ((1U << order) - 1)) != 0 ||
+		       i + (1U << order) > coremap_nframes) {
+			order--;
+		}
+		freelist_push(i, order);
+		i += 1U << order;
+	}
+	coremap_nfree = coremap_nframes;
+	clock_hand = 0;
+
+	kprintf("coremap: %u frames at 0x%x (%lu pages of map)\n",
+		coremap_nframes, coremap_base, mapbytes / PAGE_SIZE);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Buddy allocator proper. Call with coremap_lock held.
+
+/*
+ * Take a block of 2^ORDER frames off the free lists, splitting a
+ * larger block if need be. Returns the first frame, or -1. The block
+ * becomes an allocated run of 2^ORDER frames.
+ */
+static
+int32_t
+buddy_alloc(unsigned order)
+{
+	unsigned j, k;
+	int32_t frame;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	for (j = order; j <= COREMAP_MAXORDER; j++) {
+		if (freelists[j] >= 0) {
+			break;
+		}
+	}
+	if (j > COREMAP_MAXORDER) {
+		return -1;
+	}
+
+	frame = freelists[j];
+	freelist_unlink(frame, j);
+
+	/* Split off upper halves until the block is the right size. */
+	while (j > order) {
+		j--;
+		freelist_push(frame + (1 << j), j);
+	}
+
+	for (k = 0; k < (1U << order); k++) {
+		coremap[frame + k].cm_state = CM_KERNEL;
+		coremap[frame + k].cm_head = false;
+	}
+	coremap[frame].cm_head = true;
+	coremap[frame].cm_npages = 1U << order;
+	coremap[frame].cm_refcount = 1;
+	coremap_nfree -= 1U << order;
+
+	return frame;
+}
+
+/*
+ * Return the aligned block of 2^ORDER frames at FRAME to the free
+ * lists, merging it with its buddy for as long as the buddy is a whole
+ * free block.
+ */
+static
+void
+buddy_free_block(int32_t frame, unsigned order)
+{
+	struct coremap_entry *e;
+	int32_t buddy;
+	unsigned k;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	KASSERT((frame & ((1 << order) - 1)) == 0);
+
+	for (k = 0; k < (1U << order); k++) {
+		coremap[frame + k].cm_state = CM_FREE;
+		coremap[frame + k].cm_head = false;
+		coremap[frame + k].cm_busy = false;
+		coremap[frame + k].cm_as = NULL;
+		coremap[frame + k].cm_kdata = NULL;
+	}
+	coremap_nfree += 1U << order;
+
+	while (order < COREMAP_MAXORDER) {
+		buddy = frame ^ (1 << order);
+		if ((unsigned)buddy + (1U << order) > coremap_nframes) {
+			break;
+		}
+		e = &coremap[buddy];
+		if (!e->cm_head || e->cm_state != CM_FREE ||
+		    e->cm_order != order) {
+			break;
+		}
+		freelist_unlink(buddy, order);
+		if (buddy < frame) {
+			frame = buddy;
+		}
+		order++;
+	}
+	freelist_push(frame, order);
+}
+
+/*
+ * Free the NPAGES frames starting at FRAME, which need not be a
+ * block, by breaking them into the largest aligned blocks that fit.
+ */
+static
+void
+run_free(int32_t frame, unsigned npages)
+{
+	unsigned order;
+
+	while (npages > 0) {
+		order = 0;
+		while (order < COREMAP_MAXORDER &&
+		       (frame & ((2 << order) - 1)) == 0 &&
+		       (2U << order) <= npages) {
+			order++;
+		}
+		buddy_free_block(frame, order);
+		frame += 1 << order;
+		npages -= 1U << order;
+	}
+}
+
+/*
+ * Take the NPAGES frames starting at FRAME, all of which must be
+ * free, off the free lists. Each free block they are part of is
+ * unlinked whole, and whatever of it lies outside the range goes
+ * straight back.
+ */
+static
+void
+run_claim(int32_t frame, unsigned npages)
+{
+	struct coremap_entry *e;
+	int32_t f, end, head, blockend, k;
+	unsigned order;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	f = frame;
+	end = frame + npages;
+	while (f < end) {
+		KASSERT(coremap[f].cm_state == CM_FREE);
+
+		/* Find the free block F is in. */
+		head = -1;
+		order = 0;
+		for (k = 0; k <= COREMAP_MAXORDER; k++) {
+			head = f & ~((1 << k) - 1);
+			e = &coremap[head];
+			if (e->cm_head && e->cm_state == CM_FREE &&
+			    head + (1 << e->cm_order) > f) {
+				order = e->cm_order;
+				break;
+			}
+		}
+		KASSERT(k <= COREMAP_MAXORDER);
+
+		freelist_unlink(head, order);
+		blockend = head + (1 << order);
+		for (k = head; k < blockend; k++) {
+			coremap[k].cm_state = CM_KERNEL;
+			coremap[k].cm_head = false;
+		}
+		coremap_nfree -= 1U << order;
+
+		if (head < f) {
+			run_free(head, f - head);
+		}
+		if (blockend > end) {
+			run_free(end, blockend - end);
+			blockend = end;
+		}
+		f = blockend;
+	}
+}
+
+/*
+ * Free the allocated run starting at FRAME.
+ */
+static
+void
+buddy_free(int32_t frame)
+{
+	struct coremap_entry *e;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+
+	e = &coremap[frame];
+	if (!e->cm_head || e->cm_state == CM_FREE) {
+		panic("coremap_free: 0x%x is not an allocated block\n",
+		      FRAME_TO_PADDR(frame));
+	}
+	KASSERT(e->cm_npages > 0);
+	run_free(frame, e->cm_npages);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Per-cpu frame magazines.
+
+void
+coremap_cpu_init(struct frame_cache *fc)
+{
+	fc->fc_mags[0].fm_rounds = 0;
+	fc->fc_mags[1].fm_rounds = 0;
+	fc->fc_loaded = &fc->fc_mags[0];
+	fc->fc_previous = &fc->fc_mags[1];
+	fc->fc_hits = 0;
+	fc->fc_misses = 0;
+	fc->fc_frees = 0;
+	fc->fc_drains = 0;
+	fc->fc_flushes = 0;
+}
+
+static
+void
+framecache_swap(struct frame_cache *fc)
+{
+	struct frame_magazine *m;
+
+	m = fc->fc_loaded;
+	fc->fc_loaded = fc->fc_previous;
+	fc->fc_previous = m;
+}
+
+/*
+ * Fill an empty magazine from the buddy lists with one trip through
+ * the coremap lock. May come up short if memory is low.
+ */
+static
+void
+magazine_fill(struct frame_magazine *m)
+{
+	int32_t frame;
+
+	KASSERT(m->fm_rounds == 0);
+
+	spinlock_acquire(&coremap_lock);
+	while (m->fm_rounds < FRAMEMAG_SIZE) {
+		frame = buddy_alloc(0);
+		if (frame < 0) {
+			break;
+		}
+		m->fm_frames[m->fm_rounds++] = FRAME_TO_PADDR(frame);
+	}
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Give every frame in a magazine back to the buddy lists, again with
+ * one trip through the lock.
+ */
+static
+void
+magazine_drain(struct frame_magazine *m)
+{
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<m->fm_rounds; i++) {
+		buddy_free(PADDR_TO_FRAME(m->fm_frames[i]));
+	}
+	m->fm_rounds = 0;
+	spinlock_release(&coremap_lock);
+}
+
+static
+paddr_t
+framecache_alloc(void)
+{
+	struct frame_cache *fc;
+	struct frame_magazine *m;
+	paddr_t pa;
+	int spl;
+
+	/* Interrupts off so we stay on this cpu and own its cache. */
+	spl = splhigh();
+	fc = &curcpu->c_framecache;
+
+	if (fc->fc_loaded->fm_rounds == 0) {
+		if (fc->fc_previous->fm_rounds > 0) {
+			framecache_swap(fc);
+			fc->fc_hits++;
+		}
+		else {
+			fc->fc_misses++;
+			magazine_fill(fc->fc_loaded);
+			if (fc->fc_loaded->fm_rounds == 0) {
+				splx(spl);
+				return 0;
+			}
+		}
+	}
+	else {
+		fc->fc_hits++;
+	}
+
+	m = fc->fc_loaded;
+	pa = m->fm_frames[--m->fm_rounds];
+
+	/* Nobody else can see this frame yet, so no lock needed. */
+	coremap[PADDR_TO_FRAME(pa)].cm_refcount = 1;
+
+	splx(spl);
+	return pa;
+}
+
+static
+void
+framecache_free(paddr_t pa)
+{
+	struct frame_cache *fc;
+	struct frame_magazine *m;
+	int spl;
+
+	spl = splhigh();
+	fc = &curcpu->c_framecache;
+
+	if (fc->fc_loaded->fm_rounds == FRAMEMAG_SIZE) {
+		/* The previous magazine is always either full or empty. */
+		if (fc->fc_previous->fm_rounds > 0) {
+			magazine_drain(fc->fc_previous);
+			fc->fc_drains++;
+		}
+		framecache_swap(fc);
+	}
+
+	m = fc->fc_loaded;
+	m->fm_frames[m->fm_rounds++] = pa;
+	fc->fc_frees++;
+
+	splx(spl);
+}
+
+/*
+ * Send this cpu's cached frames back to the buddy lists, so they can
+ * coalesce into larger blocks.
+ */
+static
+void
+framecache_flush(void)
+{
+	struct frame_cache *fc;
+	int spl;
+
+	spl = splhigh();
+	fc = &curcpu->c_framecache;
+	magazine_drain(fc->fc_loaded);
+	magazine_drain(fc->fc_previous);
+	splx(spl);
+}
+
+void
+coremap_cpu_flush(void)
+{
+	framecache_flush();
+	curcpu->c_framecache.fc_flushes++;
+}
+
+void
+coremap_flushall(void)
+{
+	struct cpu *c;
+	struct frame_cache *fc;
+	unsigned seen[MAXCPUS];
+	bool asked[MAXCPUS];
+	unsigned i, n;
+
+	framecache_flush();
+
+	if (curthread->t_in_interrupt || curthread->t_curspl > 0) {
+		/* Can't wait for the others. */
+		return;
+	}
+
+	/*
+	 * Ask each cpu sitting on frames to let them go, then wait for
+	 * each to say it has. (This may also catch a flush somebody
+	 * else asked for, which does just as well.)
+	 */
+	n = cpu_count();
+	KASSERT(n <= MAXCPUS);
+	for (i=0; i<n; i++) {
+		c = cpu_get(i);
+		fc = &c->c_framecache;
+		seen[i] = fc->fc_flushes;
+		asked[i] = c != curcpu->c_self &&
+			fc->fc_loaded->fm_rounds + fc->fc_previous->fm_rounds > 0;
+		if (asked[i]) {
+			ipi_send(c, IPI_FRAMEFLUSH);
+		}
+	}
+	for (i=0; i<n; i++) {
+		fc = &cpu_get(i)->c_framecache;
+		while (asked[i] && fc->fc_flushes == seen[i]) {
+			thread_yield();
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+paddr_t
+coremap_alloc(unsigned long npages)
+{
+	unsigned order;
+	int32_t frame;
+
+	KASSERT(npages > 0);
+
+	if (npages == 1) {
+		return framecache_alloc();
+	}
+
+	order = order_for(npages);
+	if (order > COREMAP_MAXORDER) {
+		return 0;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	frame = buddy_alloc(order);
+	if (frame < 0) {
+		spinlock_release(&coremap_lock);
+
+		/* Our own cached frames might be what is missing. */
+		framecache_flush();
+		spinlock_acquire(&coremap_lock);
+		frame = buddy_alloc(order);
+		if (frame < 0) {
+			spinlock_release(&coremap_lock);
+			return 0;
+		}
+	}
+	/* Keep only what was asked for. */
+	if (npages < (1UL << order)) {
+		run_free(frame + npages, (1U << order) - npages);
+		coremap[frame].cm_npages = npages;
+	}
+	spinlock_release(&coremap_lock);
+
+	return FRAME_TO_PADDR(frame);
+}
+
+void
+coremap_free(paddr_t paddr)
+{
+	struct coremap_entry *e;
+	int32_t frame;
+	bool shared;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+
+	if (paddr < coremap_base) {
+		/*
+		 * Stolen with ram_stealmem before the coremap existed;
+		 * there is nowhere to give it back to.
+		 */
+		return;
+	}
+
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT((unsigned)frame < coremap_nframes);
+
+	/* The caller owns the block, so its head entry is stable. */
+	e = &coremap[frame];
+
+	/*
+	 * If we hold the only reference nobody can add another, so
+	 * only a shared frame needs the lock to drop its count. Whoever
+	 * takes it to zero goes on to free the frame.
+	 */
+	if (e->cm_refcount > 1) {
+		spinlock_acquire(&coremap_lock);
+		KASSERT(e->cm_refcount > 0);
+		e->cm_refcount--;
+		shared = e->cm_refcount > 0;
+		if (e->cm_refcount == 1) {
+			/*
+			 * We may have been the recorded owner. Forget it
+			 * until whoever is left claims the frame with
+			 * coremap_setuser, so pageout never follows a
+			 * pointer to an address space that is going away.
+			 */
+			e->cm_as = NULL;
+		}
+		spinlock_release(&coremap_lock);
+		if (shared) {
+			return;
+		}
+	}
+
+	if (e->cm_head && e->cm_state != CM_FREE && e->cm_npages == 1) {
+		/*
+		 * Take it off the clock before it goes in a magazine.
+		 * No lock: pageout only trusts the owner after checking
+		 * the owner's page table, which no longer maps us.
+		 */
+		e->cm_state = CM_KERNEL;
+		e->cm_busy = false;
+		e->cm_as = NULL;
+		e->cm_kdata = NULL;
+		framecache_free(paddr);
+		return;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	buddy_free(frame);
+	spinlock_release(&coremap_lock);
+}
+
+int
+coremap_resize(paddr_t paddr, unsigned long npages)
+{
+	struct coremap_entry *e;
+	int32_t frame;
+	unsigned long i, old;
+
+	KASSERT(npages > 0);
+	KASSERT(paddr >= coremap_base);
+	frame = PADDR_TO_FRAME(paddr);
+	KASSERT((unsigned)frame < coremap_nframes);
+
+	/* The caller owns the run, so its head entry is stable. */
+	e = &coremap[frame];
+	KASSERT(e->cm_head && e->cm_state == CM_KERNEL);
+	KASSERT(e->cm_refcount == 1);
+	old = e->cm_npages;
+
+	if (npages == old) {
+		return 0;
+	}
+	if (npages > coremap_nframes - frame) {
+		return ENOMEM;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	if (npages < old) {
+		run_free(frame + npages, old - npages);
+	}
+	else {
+		/* Frames in cpu magazines count as taken; that is fine. */
+		for (i = old; i < npages; i++) {
+			if (coremap[frame + i].cm_state != CM_FREE) {
+				spinlock_release(&coremap_lock);
+				return ENOMEM;
+			}
+		}
+		run_claim(frame + old, npages - old);
+	}
+	e->cm_npages = npages;
+	spinlock_release(&coremap_lock);
+
+	return 0;
+}
+
+unsigned long
+coremap_npages(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	if (coremap == NULL || paddr < coremap_base) {
+		return 0;
+	}
+	KASSERT((unsigned)PADDR_TO_FRAME(paddr) < coremap_nframes);
+
+	e = &coremap[PADDR_TO_FRAME(paddr)];
+	KASSERT(e->cm_head && e->cm_state != CM_FREE);
+	return e->cm_npages;
+}
+
+void
+coremap_share(paddr_t paddr)
+{
+	struct coremap_entry *e;
+
+	KASSERT(paddr % PAGE_SIZE == 0);
+	KASSERT(paddr >= coremap_base);
+	KASSERT((unsigned)PADDR_TO_FRAME(paddr) < coremap_nframes);
+
+	e = &coremap[PADDR_TO_FRAME(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(e->cm_head && e->cm_state != CM_FREE && e->cm_npages == 1);
+	KASSERT(e->cm_refcount > 0 && e->cm_refcount < 0xffff);
+	e->cm_refcount++;
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_refcount(paddr_t paddr)
+{
+	KASSERT(paddr >= coremap_base);
+	KASSERT((unsigned)PADDR_TO_FRAME(paddr) < coremap_nframes);
+
+	return coremap[PADDR_TO_FRAME(paddr)].cm_refcount;
+}
+
+void
+coremap_setkdata(paddr_t paddr, void *kdata)
+{
+	if (coremap == NULL || paddr < coremap_base) {
+		/* Not ours; coremap_kdata will say NULL. */
+		return;
+	}
+	KASSERT((unsigned)PADDR_TO_FRAME(paddr) < coremap_nframes);
+
+	/* The caller owns the frame, so nobody else is looking. */
+	coremap[PADDR_TO_FRAME(paddr)].cm_kdata = kdata;
+}
+
+void *
+coremap_kdata(paddr_t paddr)
+{
+	if (coremap == NULL || paddr < coremap_base) {
+		return NULL;
+	}
+	KASSERT((unsigned)PADDR_TO_FRAME(paddr) < coremap_nframes);
+
+	return coremap[PADDR_TO_FRAME(paddr)].cm_kdata;
+}
+
+void
+coremap_setuser(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	struct coremap_entry *e;
+
+	KASSERT(paddr >= coremap_base);
+	KASSERT((unsigned)PADDR_TO_FRAME(paddr) < coremap_nframes);
+
+	e = &coremap[PADDR_TO_FRAME(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(e->cm_head && e->cm_state != CM_FREE && e->cm_npages == 1);
+	e->cm_state = CM_USER;
+	e->cm_as = as;
+	e->cm_vaddr = vaddr;
+	e->cm_referenced = true;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_touch(paddr_t paddr)
+{
+	KASSERT(paddr >= coremap_base);
+	KASSERT((unsigned)PADDR_TO_FRAME(paddr) < coremap_nframes);
+
+	/* Only a hint, so a racy store is fine. */
+	coremap[PADDR_TO_FRAME(paddr)].cm_referenced = true;
+}
+
+paddr_t
+coremap_clock(struct addrspace **as, vaddr_t *vaddr)
+{
+	struct coremap_entry *e;
+	unsigned n, frame;
+
+	spinlock_acquire(&coremap_lock);
+
+	/* Two full turns: the first may only clear referenced bits. */
+	for (n = 0; n < 2 * coremap_nframes; n++) {
+		frame = clock_hand;
+		clock_hand = (clock_hand + 1) % coremap_nframes;
+
+		e = &coremap[frame];
+		if (e->cm_state != CM_USER || e->cm_busy) {
+			continue;
+		}
+		if (e->cm_referenced) {
+			e->cm_referenced = false;
+			continue;
+		}
+
+		e->cm_busy = true;
+		/*
+		 * The recorded owner of a shared frame may be gone (see
+		 * coremap_free), but every sharer maps it at cm_vaddr.
+		 */
+		*as = e->cm_refcount == 1 ? e->cm_as : NULL;
+		*vaddr = e->cm_vaddr;
+		spinlock_release(&coremap_lock);
+		return FRAME_TO_PADDR(frame);
+	}
+
+	spinlock_release(&coremap_lock);
+	return 0;
+}
+
+void
+coremap_release(paddr_t paddr, bool evicted)
+{
+	struct coremap_entry *e;
+
+	KASSERT(paddr >= coremap_base);
+	KASSERT((unsigned)PADDR_TO_FRAME(paddr) < coremap_nframes);
+
+	e = &coremap[PADDR_TO_FRAME(paddr)];
+
+	spinlock_acquire(&coremap_lock);
+	e->cm_busy = false;
+	if (evicted) {
+		KASSERT(e->cm_state == CM_USER);
+		e->cm_state = CM_KERNEL;
+		e->cm_refcount = 1;
+		e->cm_referenced = false;
+		e->cm_as = NULL;
+		e->cm_kdata = NULL;
+	}
+	spinlock_release(&coremap_lock);
+}
+
+unsigned
+coremap_freecount(void)
+{
+	struct frame_cache *fc;
+	unsigned i, n;
+
+	/* Racy snapshot, which is all anyone can use anyway. */
+	n = coremap_nfree;
+	for (i=0; i<cpu_count(); i++) {
+		fc = &cpu_get(i)->c_framecache;
+		n += fc->fc_loaded->fm_rounds + fc->fc_previous->fm_rounds;
+	}
+	return n;
+}
+
+void
+coremap_freeblocks(unsigned *counts)
+{
+	unsigned i;
+
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		counts[i] = freelist_counts[i];
+	}
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_printstats(void)
+{
+	struct frame_cache *fc;
+	unsigned i, counts[COREMAP_MAXORDER+1];
+	unsigned nfree, cached, hits, misses, frees, drains;
+
+	/* Snapshot under the lock, print without it. */
+	spinlock_acquire(&coremap_lock);
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		counts[i] = freelist_counts[i];
+	}
+	nfree = coremap_nfree;
+	spinlock_release(&coremap_lock);
+
+	cached = hits = misses = frees = drains = 0;
+	for (i=0; i<cpu_count(); i++) {
+		fc = &cpu_get(i)->c_framecache;
+		cached += fc->fc_loaded->fm_rounds + fc->fc_previous->fm_rounds;
+		hits += fc->fc_hits;
+		misses += fc->fc_misses;
+		frees += fc->fc_frees;
+		drains += fc->fc_drains;
+	}
+
+	kprintf("coremap: %u/%u frames free (%u in cpu magazines)\n",
+		nfree + cached, coremap_nframes, cached);
+	for (i=0; i<=COREMAP_MAXORDER; i++) {
+		if (counts[i] > 0) {
+			kprintf("    order %2u (%5u pages): %u free\n",
+				i, 1U << i, counts[i]);
+		}
+	}
+	kprintf("frame magazines: %u hits, %u misses", hits, misses);
+	if (hits + misses > 0) {
+		kprintf(" (%u%% hit rate)", hits * 100 / (hits + misses));
+	}
+	kprintf("; %u frees, %u drains\n", frees, drains);
+}
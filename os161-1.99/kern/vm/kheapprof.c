@@ -0,0 +1,259 @@
+/*
+ * Kernel heap profiling. See <kheapprof.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <coremap.h>
+#include <kheapprof.h>
+
+/* What kmalloc puts in front of each subpage block. */
+struct kheapprof_tag {
+	uint16_t kt_site;
+	uint8_t kt_blktype;
+	uint8_t kt_magic;
+	uint32_t kt_size;
+};
+
+#define KHEAPPROF_MAGIC  0xa7
+
+/*
+ * Multi-page blocks: site and page count packed into the first page's
+ * coremap kdata, with the low bit set to tell it from a pageref.
+ */
+#define PAGETAG(site, npages)  ((void *)(((site) << 17) | ((npages) << 1) | 1))
+#define PAGETAG_ISTAG(t)       (((vaddr_t)(t) & 1) != 0)
+#define PAGETAG_SITE(t)        ((vaddr_t)(t) >> 17)
+#define PAGETAG_NPAGES(t)      (((vaddr_t)(t) >> 1) & 0xffff)
+
+/* Slot 0 collects the sites that did not fit. */
+static struct kheapprof_site sites[KHEAPPROF_NSITES];
+static struct spinlock kheapprof_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Find (or claim) the slot for CALLER.
+ */
+static
+unsigned
+site_lookup(vaddr_t caller)
+{
+	unsigned i, hash, slot;
+
+	KASSERT(spinlock_do_i_hold(&kheapprof_lock));
+
+	hash = (caller >> 2) % (KHEAPPROF_NSITES - 1);
+	for (i=0; i<KHEAPPROF_NSITES-1; i++) {
+		slot = 1 + (hash + i) % (KHEAPPROF_NSITES - 1);
+		if (sites[slot].ks_caller == caller) {
+			return slot;
+		}
+		if (sites[slot].ks_caller == 0) {
+			sites[slot].ks_caller = caller;
+			return slot;
+		}
+	}
+	return 0;
+}
+
+static
+unsigned
+site_charge(vaddr_t caller, size_t bytes, size_t reqsize)
+{
+	struct kheapprof_site *ks;
+	unsigned slot;
+
+	spinlock_acquire(&kheapprof_lock);
+	slot = site_lookup(caller);
+	ks = &sites[slot];
+	ks->ks_liveblocks++;
+	ks->ks_livebytes += bytes;
+	if (ks->ks_livebytes > ks->ks_peakbytes) {
+		ks->ks_peakbytes = ks->ks_livebytes;
+	}
+	if (ks->ks_allocs == 0 || reqsize < ks->ks_minsize) {
+		ks->ks_minsize = reqsize;
+	}
+	if (ks->ks_allocs == 0 || reqsize > ks->ks_maxsize) {
+		ks->ks_maxsize = reqsize;
+	}
+	ks->ks_allocs++;
+	spinlock_release(&kheapprof_lock);
+
+	return slot;
+}
+
+static
+void
+site_credit(unsigned slot, size_t bytes)
+{
+	struct kheapprof_site *ks;
+
+	KASSERT(slot < KHEAPPROF_NSITES);
+
+	spinlock_acquire(&kheapprof_lock);
+	ks = &sites[slot];
+	KASSERT(ks->ks_liveblocks > 0);
+	KASSERT(ks->ks_livebytes >= bytes);
+	ks->ks_liveblocks--;
+	ks->ks_livebytes -= bytes;
+	spinlock_release(&kheapprof_lock);
+}
+
+void *
+kheapprof_tag(void *block, size_t sz, unsigned blktype, vaddr_t caller)
+{
+	struct kheapprof_tag *kt = block;
+
+	KASSERT(sz <= 0xffffffff && blktype <= 0xff);
+
+	kt->kt_site = site_charge(caller, sz, sz);
+	kt->kt_blktype = blktype;
+	kt->kt_magic = KHEAPPROF_MAGIC;
+	kt->kt_size = sz;
+	return kt + 1;
+}
+
+void
+kheapprof_tagpages(vaddr_t addr, unsigned npages, vaddr_t caller)
+{
+	unsigned slot;
+
+	KASSERT(npages <= 0xffff);
+
+	slot = site_charge(caller, npages * PAGE_SIZE, npages * PAGE_SIZE);
+	/* Ignored for early pages, which are never really freed anyway. */
+	coremap_setkdata(KVADDR_TO_PADDR(addr), PAGETAG(slot, npages));
+}
+
+void *
+kheapprof_untag(void *ptr)
+{
+	struct kheapprof_tag *kt;
+	paddr_t paddr;
+	void *tag;
+
+	if ((vaddr_t)ptr % PAGE_SIZE == 0) {
+		/* A tagged subpage pointer never is; see kheapprof_tag. */
+		paddr = KVADDR_TO_PADDR((vaddr_t)ptr);
+		tag = coremap_kdata(paddr);
+		if (tag != NULL) {
+			KASSERT(PAGETAG_ISTAG(tag));
+			/* Before kfree mistakes it for a pageref. */
+			coremap_setkdata(paddr, NULL);
+			site_credit(PAGETAG_SITE(tag),
+				    PAGETAG_NPAGES(tag) * PAGE_SIZE);
+		}
+		return ptr;
+	}
+
+	kt = (struct kheapprof_tag *)ptr - 1;
+	if (kt->kt_magic != KHEAPPROF_MAGIC) {
+		panic("kfree: %p has no heap profiling tag\n", ptr);
+	}
+	site_credit(kt->kt_site, kt->kt_size);
+	kt->kt_magic = 0;
+	return kt;
+}
+
+size_t
+kheapprof_size(void *ptr)
+{
+	struct kheapprof_tag *kt;
+	void *tag;
+
+	if ((vaddr_t)ptr % PAGE_SIZE == 0) {
+		tag = coremap_kdata(KVADDR_TO_PADDR((vaddr_t)ptr));
+		if (tag == NULL) {
+			/* From before the coremap; length unknown. */
+			panic("krealloc: cannot resize early block %p\n", ptr);
+		}
+		KASSERT(PAGETAG_ISTAG(tag));
+		return PAGETAG_NPAGES(tag) * PAGE_SIZE;
+	}
+
+	kt = (struct kheapprof_tag *)ptr - 1;
+	KASSERT(kt->kt_magic == KHEAPPROF_MAGIC);
+	return kt->kt_size;
+}
+
+void
+kheapprof_report(void)
+{
+	struct kheapprof_site *snap, tmp;
+	unsigned i, j, n;
+	size_t live, peak;
+	unsigned blocks, allocs;
+
+	snap = kmalloc(KHEAPPROF_NSITES * sizeof(*snap));
+	if (snap == NULL) {
+		kprintf("kheapprof: out of memory for the report\n");
+		return;
+	}
+
+	/* Copy the sites in use, so we can print without the lock. */
+	n = 0;
+	spinlock_acquire(&kheapprof_lock);
+	for (i=0; i<KHEAPPROF_NSITES; i++) {
+		if (sites[i].ks_allocs > 0 || sites[i].ks_liveblocks > 0) {
+			snap[n++] = sites[i];
+		}
+	}
+	spinlock_release(&kheapprof_lock);
+
+	/* Most live bytes first. */
+	for (i=1; i<n; i++) {
+		tmp = snap[i];
+		for (j=i; j>0 && snap[j-1].ks_livebytes < tmp.ks_livebytes;
+		     j--) {
+			snap[j] = snap[j-1];
+		}
+		snap[j] = tmp;
+	}
+
+	live = peak = 0;
+	blocks = allocs = 0;
+	kprintf("%-10s %7s %9s %9s %8s  %s\n", "caller", "blocks",
+		"live", "peak", "allocs", "sizes");
+	for (i=0; i<n; i++) {
+		if (i < KHEAPPROF_REPORT) {
+			kprintf("0x%08lx %7u %9lu %9lu %8u  %lu-%lu\n",
+				(unsigned long)snap[i].ks_caller,
+				snap[i].ks_liveblocks,
+				(unsigned long)snap[i].ks_livebytes,
+				(unsigned long)snap[i].ks_peakbytes,
+				snap[i].ks_allocs,
+				(unsigned long)snap[i].ks_minsize,
+				(unsigned long)snap[i].ks_maxsize);
+		}
+		blocks += snap[i].ks_liveblocks;
+		live += snap[i].ks_livebytes;
+		peak += snap[i].ks_peakbytes;
+		allocs += snap[i].ks_allocs;
+	}
+	if (n > KHEAPPROF_REPORT) {
+		kprintf("(%u more sites)\n", n - KHEAPPROF_REPORT);
+	}
+	kprintf("%-10s %7u %9lu %9lu %8u\n", "total", blocks,
+		(unsigned long)live, (unsigned long)peak, allocs);
+	if (sites[0].ks_allocs > 0) {
+		kprintf("Site table full; caller 0x00000000 is everything "
+			"that did not fit.\n");
+	}
+
+	kfree(snap);
+}
+
+void
+kheapprof_reset(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&kheapprof_lock);
+	for (i=0; i<KHEAPPROF_NSITES; i++) {
+		sites[i].ks_allocs = 0;
+		sites[i].ks_peakbytes = sites[i].ks_livebytes;
+	}
+	spinlock_release(&kheapprof_lock);
+}
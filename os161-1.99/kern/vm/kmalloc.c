@@ -29,8 +29,19 @@
 
 #include <types.h>
 #include <lib.h>
+#include <spl.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <platform/maxcpus.h>
+#include <current.h>
+#include <thread.h>
 #include <vm.h>
+#include <coremap.h>
+#include <kmalloc.h>
+#include "opt-kheapprof.h"
+#if OPT_KHEAPPROF
+#include <kheapprof.h>
+#endif
 
 /*
  * Kernel malloc.
@@ -83,7 +94,7 @@ fill_deadbeef(void *vptr, size_t len)
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
+#define NSIZES KMALLOC_NSIZES
 static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
 
 #define SMALLEST_SUBPAGE_SIZE 16
@@ -103,7 +114,9 @@ struct freelist {
 
 struct pageref {
 	struct pageref *next_samesize;
+	struct pageref **prev_samesize;	/* what points at us; NULL if off */
 	struct pageref *next_all;
+	struct pageref **prev_all;
 	vaddr_t pageaddr_and_blocktype;
 	uint16_t freelist_offset;
 	uint16_t nfree;
@@ -118,81 +131,135 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * This is cheesy. 
- *
- * The problem is not that it's wasteful - we can only allocate whole
- * pages of pageref structures at a time anyway. The problem is that
- * we really ought to be able to have more than one of these pages.
- *
- * However, for the time being, one page worth of pagerefs gives us
- * 256 pagerefs; this lets us manage 256 * 4k = 1M of kernel heap.
- * That would be twice as much memory as we get for *everything*.
- * Thus, we will cheat and not allow any mechanism for having a second
- * page of pageref structs.
- *
- * Then, since the size is fixed at one page, we'll simplify a bit
- * further by allocating the page in the kernel BSS instead of calling
- * alloc_kpages to get it.
+ * Pagerefs live in pages of their own, taken with alloc_kpages as the
+ * heap grows and carved onto a free list (linked through
+ * next_samesize). They are never given back: at one pageref per heap
+ * page that costs 1/170 of the heap's high-water mark.
  */
 
 #define NPAGEREFS (PAGE_SIZE / sizeof(struct pageref))
-static struct pageref pagerefs[NPAGEREFS];
 
-#define INUSE_WORDS (NPAGEREFS/32)
-static uint32_t pagerefs_inuse[INUSE_WORDS];
+static struct pageref *freerefs;
+static unsigned nrefpages;	/* pages of pagerefs */
 
 static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
+	struct pageref *pr;
 
-	for (i=0; i<INUSE_WORDS; i++) {
-		if (pagerefs_inuse[i]==0xffffffff) {
-			/* full */
-			continue;
-		}
-		for (k=1,j=0; k!=0; k<<=1,j++) {
-			if ((pagerefs_inuse[i] & k)==0) {
-				pagerefs_inuse[i] |= k;
-				return &pagerefs[i*32 + j];
-			}
-		}
-		KASSERT(0);
+	pr = freerefs;
+	if (pr != NULL) {
+		freerefs = pr->next_samesize;
 	}
-
-	/* ran out */
-	return NULL;
+	return pr;
 }
 
 static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
+	p->next_samesize = freerefs;
+	freerefs = p;
+}
 
-	j = p-pagerefs;
-	KASSERT(j < NPAGEREFS);  /* note: j is unsigned, don't test < 0 */
-	i = j/32;
-	k = ((uint32_t)1) << (j%32);
-	KASSERT((pagerefs_inuse[i] & k) != 0);
-	pagerefs_inuse[i] &= ~k;
+/*
+ * Put the pagerefs in the fresh page PAGE on the free list.
+ */
+static
+void
+addpagerefs(vaddr_t page)
+{
+	struct pageref *prs = (struct pageref *)page;
+	unsigned i;
+
+	for (i=0; i<NPAGEREFS; i++) {
+		freepageref(&prs[i]);
+	}
+	nrefpages++;
 }
 
+/*
+ * Pages carved up before the coremap existed have nowhere to record
+ * their pageref (see coremap_setkdata), so they are remembered here
+ * instead. There are only ever a handful, and they are never freed
+ * (free_kpages cannot take them back), so a short array does.
+ */
+#define NEARLYREFS 64
+
+static struct pageref *earlyrefs[NEARLYREFS];
+static unsigned nearlyrefs;
+static vaddr_t early_top;	/* above every early page */
+
 ////////////////////////////////////////
 
+/*
+ * Every subpage page is on allbase. Only the ones with free blocks
+ * are on sizebases[] too, so allocation never has to step over full
+ * pages: a page comes off its size list when its last block is taken
+ * and goes back on when one is returned. Both lists are doubly linked
+ * (each pageref points at whatever points at it) so that a page can be
+ * taken off either in constant time.
+ */
 static struct pageref *sizebases[NSIZES];
 static struct pageref *allbase;
 
+static
+void
+samesize_add(struct pageref *pr)
+{
+	struct pageref **head = &sizebases[PR_BLOCKTYPE(pr)];
+
+	KASSERT(pr->prev_samesize == NULL);
+	pr->next_samesize = *head;
+	if (*head != NULL) {
+		(*head)->prev_samesize = &pr->next_samesize;
+	}
+	*head = pr;
+	pr->prev_samesize = head;
+}
+
+static
+void
+samesize_remove(struct pageref *pr)
+{
+	KASSERT(pr->prev_samesize != NULL);
+	*pr->prev_samesize = pr->next_samesize;
+	if (pr->next_samesize != NULL) {
+		pr->next_samesize->prev_samesize = pr->prev_samesize;
+	}
+	pr->next_samesize = NULL;
+	pr->prev_samesize = NULL;
+}
+
+static
+void
+all_add(struct pageref *pr)
+{
+	pr->next_all = allbase;
+	if (allbase != NULL) {
+		allbase->prev_all = &pr->next_all;
+	}
+	allbase = pr;
+	pr->prev_all = &allbase;
+}
+
+static
+void
+all_remove(struct pageref *pr)
+{
+	*pr->prev_all = pr->next_all;
+	if (pr->next_all != NULL) {
+		pr->next_all->prev_all = pr->prev_all;
+	}
+}
+
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * One spinlock covers the page lists. Most kmalloc/kfree calls never
+ * get this far: they are served by the per-cpu magazines further down,
+ * which only come here to refill or drain a whole magazine at a time.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -260,18 +327,22 @@ checksubpages(void)
 	for (i=0; i<NSIZES; i++) {
 		for (pr = sizebases[i]; pr != NULL; pr = pr->next_samesize) {
 			checksubpage(pr);
-			KASSERT(sc < NPAGEREFS);
+			KASSERT(pr->nfree > 0);
+			KASSERT(*pr->prev_samesize == pr);
+			KASSERT(sc < nrefpages * NPAGEREFS);
 			sc++;
 		}
 	}
 
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
 		checksubpage(pr);
-		KASSERT(ac < NPAGEREFS);
+		KASSERT(*pr->prev_all == pr);
+		KASSERT((pr->nfree > 0) == (pr->prev_samesize != NULL));
+		KASSERT(ac < nrefpages * NPAGEREFS);
 		ac++;
 	}
 
-	KASSERT(sc==ac);
+	KASSERT(sc<=ac);
 }
 #else
 #define checksubpages() 
@@ -330,6 +401,8 @@ dumpsubpage(struct pageref *pr)
 	kprintf("\n");
 }
 
+static void kmcache_printstats(void);
+
 void
 kheap_printstats(void)
 {
@@ -345,33 +418,79 @@ kheap_printstats(void)
 	}
 
 	spinlock_release(&kmalloc_spinlock);
+
+	kmcache_printstats();
 }
 
 ////////////////////////////////////////
 
+/*
+ * Remember where to find PR, so kfree can go straight from a block's
+ * address to its pageref: in the coremap if it covers the page, or
+ * else in earlyrefs.
+ */
 static
 void
-remove_lists(struct pageref *pr, int blktype)
+pageref_record(struct pageref *pr)
 {
-	struct pageref **guy;
+	vaddr_t prpage = PR_PAGEADDR(pr);
 
-	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	for (guy = &sizebases[blktype]; *guy; guy = &(*guy)->next_samesize) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_samesize;
-			break;
-		}
+	coremap_setkdata(KVADDR_TO_PADDR(prpage), pr);
+	if (coremap_kdata(KVADDR_TO_PADDR(prpage)) == pr) {
+		return;
+	}
+
+	if (nearlyrefs == NEARLYREFS) {
+		panic("kmalloc: more than %u heap pages before the coremap\n",
+		      NEARLYREFS);
+	}
+	earlyrefs[nearlyrefs++] = pr;
+	if (prpage + PAGE_SIZE > early_top) {
+		early_top = prpage + PAGE_SIZE;
 	}
+}
+
+/*
+ * Find the pageref for the page PTRADDR is on, or NULL if it is not a
+ * subpage page (so PTRADDR is a large allocation).
+ */
+static
+struct pageref *
+pageref_lookup(vaddr_t ptraddr)
+{
+	struct pageref *pr;
+	vaddr_t page;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	for (guy = &allbase; *guy; guy = &(*guy)->next_all) {
-		checksubpage(*guy);
-		if (*guy == pr) {
-			*guy = pr->next_all;
-			break;
+	page = ptraddr & PAGE_FRAME;
+	pr = coremap_kdata(KVADDR_TO_PADDR(page));
+	if (pr != NULL || page >= early_top) {
+		return pr;
+	}
+	for (i=0; i<nearlyrefs; i++) {
+		if (PR_PAGEADDR(earlyrefs[i]) == page) {
+			return earlyrefs[i];
 		}
 	}
+	return NULL;
+}
+
+static
+void
+remove_lists(struct pageref *pr, int blktype)
+{
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(PR_BLOCKTYPE(pr) == (unsigned)blktype);
+	checksubpage(pr);
+
+	if (pr->prev_samesize != NULL) {
+		samesize_remove(pr);
+	}
+	all_remove(pr);
 }
 
 static
@@ -399,6 +518,7 @@ subpage_kmalloc(size_t sz)
 	unsigned blktype;	// index into sizes[] that we're using
 	struct pageref *pr;	// pageref for page we're allocating from
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t refpage;	// new page of pagerefs, if needed
 	vaddr_t fla;		// free list entry address
 	struct freelist *volatile fl;	// free list entry
 	void *retptr;		// our result
@@ -413,41 +533,42 @@ subpage_kmalloc(size_t sz)
 
 	checksubpages();
 
-	for (pr = sizebases[blktype]; pr != NULL; pr = pr->next_samesize) {
+	/* Every page on the size list has a free block. */
+	pr = sizebases[blktype];
+	if (pr != NULL) {
+
+	doalloc: /* comes here after getting a whole fresh page */
 
 		/* check for corruption */
 		KASSERT(PR_BLOCKTYPE(pr) == blktype);
 		checksubpage(pr);
+		KASSERT(pr->nfree > 0);
 
-		if (pr->nfree > 0) {
-
-		doalloc: /* comes here after getting a whole fresh page */
-
-			KASSERT(pr->freelist_offset < PAGE_SIZE);
-			prpage = PR_PAGEADDR(pr);
-			fla = prpage + pr->freelist_offset;
-			fl = (struct freelist *)fla;
+		KASSERT(pr->freelist_offset < PAGE_SIZE);
+		prpage = PR_PAGEADDR(pr);
+		fla = prpage + pr->freelist_offset;
+		fl = (struct freelist *)fla;
 
-			retptr = fl;
-			fl = fl->next;
-			pr->nfree--;
+		retptr = fl;
+		fl = fl->next;
+		pr->nfree--;
 
-			if (fl != NULL) {
-				KASSERT(pr->nfree > 0);
-				fla = (vaddr_t)fl;
-				KASSERT(fla - prpage < PAGE_SIZE);
-				pr->freelist_offset = fla - prpage;
-			}
-			else {
-				KASSERT(pr->nfree == 0);
-				pr->freelist_offset = INVALID_OFFSET;
-			}
+		if (fl != NULL) {
+			KASSERT(pr->nfree > 0);
+			fla = (vaddr_t)fl;
+			KASSERT(fla - prpage < PAGE_SIZE);
+			pr->freelist_offset = fla - prpage;
+		}
+		else {
+			KASSERT(pr->nfree == 0);
+			pr->freelist_offset = INVALID_OFFSET;
+			samesize_remove(pr);
+		}
 
-			checksubpages();
+		checksubpages();
 
-			spinlock_release(&kmalloc_spinlock);
-			return retptr;
-		}
+		spinlock_release(&kmalloc_spinlock);
+		return retptr;
 	}
 
 	/*
@@ -470,11 +591,18 @@ subpage_kmalloc(size_t sz)
 
 	pr = allocpageref();
 	if (pr==NULL) {
-		/* Couldn't allocate accounting space for the new page. */
+		/* Out of pagerefs; get a page of new ones, again unlocked. */
 		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
-		kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
-		return NULL;
+		refpage = alloc_kpages(1);
+		if (refpage==0) {
+			free_kpages(prpage);
+			kprintf("kmalloc: Subpage allocator couldn't get pageref\n"); 
+			return NULL;
+		}
+		spinlock_acquire(&kmalloc_spinlock);
+		addpagerefs(refpage);
+		pr = allocpageref();
+		KASSERT(pr != NULL);
 	}
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
@@ -498,16 +626,63 @@ subpage_kmalloc(size_t sz)
 	pr->freelist_offset = fla - prpage;
 	KASSERT(pr->freelist_offset == (pr->nfree-1)*sizes[blktype]);
 
-	pr->next_samesize = sizebases[blktype];
-	sizebases[blktype] = pr;
+	pr->prev_samesize = NULL;
+	samesize_add(pr);
+	all_add(pr);
 
-	pr->next_all = allbase;
-	allbase = pr;
+	pageref_record(pr);
 
 	/* This is kind of cheesy, but avoids duplicating the alloc code. */
 	goto doalloc;
 }
 
+/*
+ * Put the free block at OFFSET back on PR's free list. If that makes
+ * the whole page free, take the page off the lists and return its
+ * address, for the caller to free_kpages once it has dropped
+ * kmalloc_spinlock; otherwise return 0.
+ */
+static
+vaddr_t
+subpage_putback(struct pageref *pr, vaddr_t offset)
+{
+	int blktype;		// index into sizes[] that we're using
+	vaddr_t prpage;		// PR_PAGEADDR(pr)
+	vaddr_t fla;		// free list entry address
+	struct freelist *fl;	// free list entry
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	fla = prpage + offset;
+	fl = (struct freelist *)fla;
+	if (pr->freelist_offset == INVALID_OFFSET) {
+		fl->next = NULL;
+	} else {
+		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
+	}
+	pr->freelist_offset = offset;
+	pr->nfree++;
+	if (pr->nfree == 1) {
+		/* It was full; it has room again. */
+		samesize_add(pr);
+	}
+
+	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
+	if (pr->nfree == PAGE_SIZE / sizes[blktype] && prpage >= early_top) {
+		/*
+		 * Whole page is free. (Pages from before the coremap
+		 * stay put; free_kpages could not take them back.)
+		 */
+		remove_lists(pr, blktype);
+		freepageref(pr);
+		return prpage;
+	}
+	return 0;
+}
+
 static
 int
 subpage_kfree(void *ptr)
@@ -516,8 +691,6 @@ subpage_kfree(void *ptr)
 	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
-	vaddr_t fla;		// free list entry address
-	struct freelist *fl;	// free list entry
 	vaddr_t offset;		// offset into page
 
 	ptraddr = (vaddr_t)ptr;
@@ -526,25 +699,21 @@ subpage_kfree(void *ptr)
 
 	checksubpages();
 
-	for (pr = allbase; pr; pr = pr->next_all) {
-		prpage = PR_PAGEADDR(pr);
-		blktype = PR_BLOCKTYPE(pr);
-
-		/* check for corruption */
-		KASSERT(blktype>=0 && blktype<NSIZES);
-		checksubpage(pr);
-
-		if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
-			break;
-		}
-	}
-
+	pr = pageref_lookup(ptraddr);
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
 		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
+	prpage = PR_PAGEADDR(pr);
+	blktype = PR_BLOCKTYPE(pr);
+
+	/* check for corruption */
+	KASSERT(blktype>=0 && blktype<NSIZES);
+	KASSERT(prpage == (ptraddr & PAGE_FRAME));
+	checksubpage(pr);
+
 	offset = ptraddr - prpage;
 
 	/* Check for proper positioning and alignment */
@@ -563,28 +732,12 @@ subpage_kfree(void *ptr)
 	 * is already on the free list. But that's expensive, so we don't.
 	 */
 
-	fla = prpage + offset;
-	fl = (struct freelist *)fla;
-	if (pr->freelist_offset == INVALID_OFFSET) {
-		fl->next = NULL;
-	} else {
-		fl->next = (struct freelist *)(prpage + pr->freelist_offset);
-	}
-	pr->freelist_offset = offset;
-	pr->nfree++;
-
-	KASSERT(pr->nfree <= PAGE_SIZE / sizes[blktype]);
-	if (pr->nfree == PAGE_SIZE / sizes[blktype]) {
-		/* Whole page is free. */
-		remove_lists(pr, blktype);
-		freepageref(pr);
+	prpage = subpage_putback(pr, offset);
+	spinlock_release(&kmalloc_spinlock);
+	if (prpage != 0) {
 		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
-	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
 	spinlock_acquire(&kmalloc_spinlock);
@@ -597,34 +750,587 @@ subpage_kfree(void *ptr)
 
 //
 ////////////////////////////////////////////////////////////
+//
+// Per-cpu magazines and the depot. See <kmalloc.h>.
+//
+// A magazine is a chain of free blocks linked through struct
+// freelist. The blocks stay allocated as far as their pages are
+// concerned, so pages only go back to the system once their blocks
+// have drained out of the magazines.
+//
+// In the depot, full magazines are chained together through the
+// second word of their first block (every block size has room).
+//
+
+#define MAG_NEXT(fl)  (((struct freelist **)(fl))[1])
+
+/* Full magazines waiting for a cpu, for each size. */
+static struct freelist *depot_full[NSIZES];
+static unsigned depot_nfull[NSIZES];
+static struct spinlock depot_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Blocks in a full magazine of size BLKTYPE: up to KMALLOC_MAGSIZE,
+ * but fewer for big blocks so that each cpu does not sit on too much
+ * memory.
+ */
+static
+inline
+unsigned
+magsize(unsigned blktype)
+{
+	unsigned n;
+
+	n = KMALLOC_MAGBYTES / sizes[blktype];
+	if (n < 2) {
+		n = 2;
+	}
+	if (n > KMALLOC_MAGSIZE) {
+		n = KMALLOC_MAGSIZE;
+	}
+	return n;
+}
+
+void
+kmalloc_cpu_init(struct kmalloc_cache *kc)
+{
+	unsigned i;
+
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_loaded[i].km_head = NULL;
+		kc->kc_loaded[i].km_rounds = 0;
+		kc->kc_previous[i].km_head = NULL;
+		kc->kc_previous[i].km_rounds = 0;
+	}
+	kc->kc_hits = 0;
+	kc->kc_misses = 0;
+	kc->kc_frees = 0;
+	kc->kc_drains = 0;
+	kc->kc_flushes = 0;
+}
+
+static
+void
+kmcache_swap(struct kmalloc_cache *kc, unsigned blktype)
+{
+	struct kmalloc_magazine m;
+
+	m = kc->kc_loaded[blktype];
+	kc->kc_loaded[blktype] = kc->kc_previous[blktype];
+	kc->kc_previous[blktype] = m;
+}
+
+/*
+ * Fill an empty magazine from the page lists, with one trip through
+ * kmalloc_spinlock. Comes up short (maybe empty) if the pages we have
+ * are full; getting a new page is left to subpage_kmalloc.
+ */
+static
+void
+magazine_fill(struct kmalloc_magazine *m, unsigned blktype)
+{
+	struct pageref *pr;
+	struct freelist *fl;
+	vaddr_t prpage;
+	unsigned n;
+
+	KASSERT(m->km_rounds == 0);
+	n = magsize(blktype);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	checksubpages();
+	while (m->km_rounds < n && (pr = sizebases[blktype]) != NULL) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		prpage = PR_PAGEADDR(pr);
+		while (pr->nfree > 0 && m->km_rounds < n) {
+			fl = (struct freelist *)(prpage + pr->freelist_offset);
+			if (fl->next != NULL) {
+				pr->freelist_offset = (vaddr_t)fl->next - prpage;
+			}
+			else {
+				pr->freelist_offset = INVALID_OFFSET;
+			}
+			pr->nfree--;
 
+			fl->next = m->km_head;
+			m->km_head = fl;
+			m->km_rounds++;
+		}
+		if (pr->nfree == 0) {
+			samesize_remove(pr);
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+}
+
+/*
+ * Put every block in a magazine back on its page, with one trip
+ * through kmalloc_spinlock, and free the pages that become empty.
+ * Returns the number of pages freed.
+ */
+static
+unsigned
+magazine_drain(struct kmalloc_magazine *m)
+{
+	struct freelist *fl, *next, *freepages;
+	struct pageref *pr;
+	vaddr_t ptraddr, prpage;
+	unsigned n;
+
+	freepages = NULL;
+	spinlock_acquire(&kmalloc_spinlock);
+	for (fl = m->km_head; fl != NULL; fl = next) {
+		next = fl->next;
+		ptraddr = (vaddr_t)fl;
+		pr = pageref_lookup(ptraddr);
+		KASSERT(pr != NULL);
+		prpage = subpage_putback(pr, ptraddr - PR_PAGEADDR(pr));
+		if (prpage != 0) {
+			/* Nobody else can see the page; use it as a link. */
+			((struct freelist *)prpage)->next = freepages;
+			freepages = (struct freelist *)prpage;
+		}
+	}
+	checksubpages();
+	spinlock_release(&kmalloc_spinlock);
+
+	m->km_head = NULL;
+	m->km_rounds = 0;
+
+	n = 0;
+	while (freepages != NULL) {
+		fl = freepages;
+		freepages = fl->next;
+		free_kpages((vaddr_t)fl);
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Swap the empty magazine M for a full one from the depot. Returns
+ * false if the depot has none.
+ */
+static
+bool
+depot_get(struct kmalloc_magazine *m, unsigned blktype)
+{
+	struct freelist *fl;
+
+	KASSERT(m->km_rounds == 0);
+
+	spinlock_acquire(&depot_lock);
+	fl = depot_full[blktype];
+	if (fl == NULL) {
+		spinlock_release(&depot_lock);
+		return false;
+	}
+	depot_full[blktype] = MAG_NEXT(fl);
+	depot_nfull[blktype]--;
+	spinlock_release(&depot_lock);
+
+	MAG_NEXT(fl) = (struct freelist *)0xdeadbeef;
+	m->km_head = fl;
+	m->km_rounds = magsize(blktype);
+	return true;
+}
+
+/*
+ * Hand the full magazine M to the depot, or if the depot already has
+ * enough, drain it back to the page lists. Leaves M empty.
+ */
+static
+void
+depot_put(struct kmalloc_magazine *m, unsigned blktype)
+{
+	struct freelist *fl;
+
+	KASSERT(m->km_rounds == magsize(blktype));
+
+	spinlock_acquire(&depot_lock);
+	if (depot_nfull[blktype] < KMALLOC_DEPOTMAX) {
+		fl = m->km_head;
+		MAG_NEXT(fl) = depot_full[blktype];
+		depot_full[blktype] = fl;
+		depot_nfull[blktype]++;
+		spinlock_release(&depot_lock);
+		m->km_head = NULL;
+		m->km_rounds = 0;
+		return;
+	}
+	spinlock_release(&depot_lock);
+
+	magazine_drain(m);
+}
+
+/*
+ * Allocate a block of size BLKTYPE from this cpu's magazines, or the
+ * depot, or a refill from the page lists. Returns NULL if all of
+ * those are empty (or there is no cpu yet, early in boot).
+ */
+static
 void *
-kmalloc(size_t sz)
+kmcache_alloc(unsigned blktype)
 {
+	struct kmalloc_cache *kc;
+	struct kmalloc_magazine *m;
+	struct freelist *fl;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	/* Interrupts off so we stay on this cpu and own its cache. */
+	spl = splhigh();
+	kc = &curcpu->c_kmalloccache;
+	m = &kc->kc_loaded[blktype];
+
+	if (m->km_rounds == 0) {
+		if (kc->kc_previous[blktype].km_rounds > 0) {
+			kmcache_swap(kc, blktype);
+			kc->kc_hits++;
+		}
+		else if (depot_get(m, blktype)) {
+			kc->kc_hits++;
+		}
+		else {
+			kc->kc_misses++;
+			magazine_fill(m, blktype);
+			if (m->km_rounds == 0) {
+				splx(spl);
+				return NULL;
+			}
+		}
+	}
+	else {
+		kc->kc_hits++;
+	}
+
+	fl = m->km_head;
+	m->km_head = fl->next;
+	m->km_rounds--;
+
+	splx(spl);
+	return fl;
+}
+
+/*
+ * Free PTR into this cpu's magazines. Returns false, leaving it to
+ * the caller, if PTR is not on a page whose pageref the coremap knows
+ * (a large allocation, or a page from before the coremap).
+ */
+static
+bool
+kmcache_free(void *ptr)
+{
+	struct kmalloc_cache *kc;
+	struct kmalloc_magazine *m;
+	struct pageref *pr;
+	struct freelist *fl;
+	vaddr_t ptraddr;
+	unsigned blktype;
+	int spl;
+
+	ptraddr = (vaddr_t)ptr;
+	pr = coremap_kdata(KVADDR_TO_PADDR(ptraddr & PAGE_FRAME));
+	if (pr == NULL || !CURCPU_EXISTS()) {
+		return false;
+	}
+
+	blktype = PR_BLOCKTYPE(pr);
+	KASSERT(blktype < NSIZES);
+	KASSERT(PR_PAGEADDR(pr) == (ptraddr & PAGE_FRAME));
+	if ((ptraddr - PR_PAGEADDR(pr)) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	fill_deadbeef(ptr, sizes[blktype]);
+
+	spl = splhigh();
+	kc = &curcpu->c_kmalloccache;
+	m = &kc->kc_loaded[blktype];
+
+	if (m->km_rounds == magsize(blktype)) {
+		/* The previous magazine is always either full or empty. */
+		if (kc->kc_previous[blktype].km_rounds > 0) {
+			depot_put(&kc->kc_previous[blktype], blktype);
+			kc->kc_drains++;
+		}
+		kmcache_swap(kc, blktype);
+	}
+
+	fl = ptr;
+	fl->next = m->km_head;
+	m->km_head = fl;
+	m->km_rounds++;
+	kc->kc_frees++;
+
+	splx(spl);
+	return true;
+}
+
+/*
+ * Send this cpu's magazines back to the page lists. Returns the
+ * number of pages freed.
+ */
+static
+unsigned
+kmcache_flush(void)
+{
+	struct kmalloc_cache *kc;
+	unsigned i, n;
+	int spl;
+
+	n = 0;
+	spl = splhigh();
+	kc = &curcpu->c_kmalloccache;
+	for (i=0; i<NSIZES; i++) {
+		n += magazine_drain(&kc->kc_loaded[i]);
+		n += magazine_drain(&kc->kc_previous[i]);
+	}
+	splx(spl);
+	return n;
+}
+
+void
+kmalloc_cpu_flush(void)
+{
+	kmcache_flush();
+	curcpu->c_kmalloccache.kc_flushes++;
+}
+
+/*
+ * True if cpu C's magazines hold any blocks. Only a snapshot.
+ */
+static
+bool
+kmcache_holding(struct cpu *c)
+{
+	struct kmalloc_cache *kc = &c->c_kmalloccache;
+	unsigned i;
+
+	for (i=0; i<NSIZES; i++) {
+		if (kc->kc_loaded[i].km_rounds > 0 ||
+		    kc->kc_previous[i].km_rounds > 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Reclaim hook: send the depot's magazines, and every cpu's, back to
+ * the page lists. The other cpus are asked to drain their own with
+ * IPI_KMALLOCFLUSH, the way coremap_flushall gets their frames, and we
+ * wait for them, unless we can't sleep. The pages they free go into
+ * their frame magazines, where reclaim_ppages's coremap_flushall
+ * (after the hooks) picks them up; only the ones freed here are
+ * counted.
+ */
+static
+unsigned
+kmalloc_reclaim(void)
+{
+	struct kmalloc_magazine m;
+	struct cpu *c;
+	unsigned seen[MAXCPUS];
+	bool asked[MAXCPUS];
+	unsigned i, n, ncpus;
+
+	n = 0;
+	for (i=0; i<NSIZES; i++) {
+		spinlock_acquire(&depot_lock);
+		while (depot_full[i] != NULL) {
+			m.km_head = depot_full[i];
+			m.km_rounds = magsize(i);
+			depot_full[i] = MAG_NEXT(m.km_head);
+			depot_nfull[i]--;
+			spinlock_release(&depot_lock);
+
+			n += magazine_drain(&m);
+
+			spinlock_acquire(&depot_lock);
+		}
+		spinlock_release(&depot_lock);
+	}
+
+	n += kmcache_flush();
+
+	if (curthread->t_in_interrupt || curthread->t_curspl > 0) {
+		/* Can't wait for the others. */
+		return n;
+	}
+
+	ncpus = cpu_count();
+	KASSERT(ncpus <= MAXCPUS);
+	for (i=0; i<ncpus; i++) {
+		c = cpu_get(i);
+		seen[i] = c->c_kmalloccache.kc_flushes;
+		asked[i] = c != curcpu->c_self && kmcache_holding(c);
+		if (asked[i]) {
+			ipi_send(c, IPI_KMALLOCFLUSH);
+		}
+	}
+	for (i=0; i<ncpus; i++) {
+		c = cpu_get(i);
+		while (asked[i] && c->c_kmalloccache.kc_flushes == seen[i]) {
+			thread_yield();
+		}
+	}
+
+	return n;
+}
+
+static
+void
+kmcache_printstats(void)
+{
+	struct kmalloc_cache *kc;
+	unsigned i, j, cached, depot, hits, misses, frees, drains;
+
+	cached = hits = misses = frees = drains = 0;
+	for (i=0; i<cpu_count(); i++) {
+		kc = &cpu_get(i)->c_kmalloccache;
+		for (j=0; j<NSIZES; j++) {
+			cached += kc->kc_loaded[j].km_rounds +
+				kc->kc_previous[j].km_rounds;
+		}
+		hits += kc->kc_hits;
+		misses += kc->kc_misses;
+		frees += kc->kc_frees;
+		drains += kc->kc_drains;
+	}
+
+	depot = 0;
+	spinlock_acquire(&depot_lock);
+	for (j=0; j<NSIZES; j++) {
+		depot += depot_nfull[j] * magsize(j);
+	}
+	spinlock_release(&depot_lock);
+
+	kprintf("kmalloc magazines: %u blocks on cpus, %u in the depot\n",
+		cached, depot);
+	kprintf("    %u hits, %u misses", hits, misses);
+	if (hits + misses > 0) {
+		kprintf(" (%u%% hit rate)", hits * 100 / (hits + misses));
+	}
+	kprintf("; %u frees, %u drains\n", frees, drains);
+}
+
+void
+kmalloc_bootstrap(void)
+{
+	int result;
+
+	result = vm_reclaim_register("kmalloc", kmalloc_reclaim);
+	if (result) {
+		panic("kmalloc: cannot register reclaim hook: %s\n",
+		      strerror(result));
+	}
+}
+
+//
+////////////////////////////////////////////////////////////
+
+#if OPT_KHEAPPROF
+#define CALLER KMALLOC_CALLER
+#else
+#define CALLER ((vaddr_t)0)
+#endif
+
+/*
+ * True if PTRADDR is the start of a multi-page block: it is page
+ * aligned and its page has no pageref. Pages from before the coremap
+ * keep their pagerefs elsewhere, so those never qualify.
+ */
+static
+bool
+large_block(vaddr_t ptraddr)
+{
+	return ptraddr % PAGE_SIZE == 0 && ptraddr >= early_top &&
+		coremap_kdata(KVADDR_TO_PADDR(ptraddr)) == NULL;
+}
+
+/*
+ * kmalloc proper. CALLER is only used for heap profiling.
+ */
+void *
+kmalloc_caller(size_t sz, vaddr_t caller)
+{
+	void *ptr;
+#if OPT_KHEAPPROF
+	size_t reqsz = sz;
+
+	/* Room for the tag; multi-page blocks go without. */
+	sz += KHEAPPROF_TAGSIZE;
+#else
+	(void)caller;
+#endif
+
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		unsigned long npages;
 		vaddr_t address;
 
-		/* Round up to a whole number of pages. */
+#if OPT_KHEAPPROF
+		sz = reqsz;
+#endif
+		/*
+		 * Round up to a whole number of pages. The coremap
+		 * remembers how many, so kfree need not.
+		 */
 		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
 		address = alloc_kpages(npages);
 		if (address==0) {
 			return NULL;
 		}
+#if OPT_KHEAPPROF
+		kheapprof_tagpages(address, npages, caller);
+#endif
 
 		return (void *)address;
 	}
 
-	return subpage_kmalloc(sz);
+	ptr = kmcache_alloc(blocktype(sz));
+	if (ptr == NULL) {
+		ptr = subpage_kmalloc(sz);
+	}
+#if OPT_KHEAPPROF
+	if (ptr != NULL) {
+		ptr = kheapprof_tag(ptr, reqsz, blocktype(sz), caller);
+	}
+#endif
+	return ptr;
+}
+
+void *
+kmalloc(size_t sz)
+{
+	return kmalloc_caller(sz, CALLER);
 }
 
 void
 kfree(void *ptr)
 {
+	if (ptr == NULL) {
+		return;
+	}
+#if OPT_KHEAPPROF
+	ptr = kheapprof_untag(ptr);
+#endif
+
+	if (large_block((vaddr_t)ptr)) {
+		/* No locks here; the coremap knows the length. */
+		free_kpages((vaddr_t)ptr);
+		return;
+	}
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * Try the magazines, then the subpage lists; if both fail,
+	 * assume it's a big allocation (from before the coremap).
 	 */
-	if (ptr == NULL) {
+	if (kmcache_free(ptr)) {
 		return;
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
@@ -632,3 +1338,75 @@ kfree(void *ptr)
 	}
 }
 
+#if !OPT_KHEAPPROF
+/*
+ * How many bytes the block at PTR can hold.
+ */
+static
+size_t
+kmalloc_blocksize(void *ptr)
+{
+	struct pageref *pr;
+	vaddr_t ptraddr = (vaddr_t)ptr;
+
+	if (large_block(ptraddr)) {
+		return coremap_npages(KVADDR_TO_PADDR(ptraddr)) * PAGE_SIZE;
+	}
+
+	spinlock_acquire(&kmalloc_spinlock);
+	pr = pageref_lookup(ptraddr);
+	spinlock_release(&kmalloc_spinlock);
+	if (pr == NULL) {
+		/* Multi-page, from before the coremap; length unknown. */
+		panic("krealloc: cannot resize early block %p\n", ptr);
+	}
+	KASSERT(PR_BLOCKTYPE(pr) < NSIZES);
+	return sizes[PR_BLOCKTYPE(pr)];
+}
+#endif
+
+void *
+krealloc(void *ptr, size_t sz)
+{
+	return krealloc_caller(ptr, sz, CALLER);
+}
+
+void *
+krealloc_caller(void *ptr, size_t sz, vaddr_t caller)
+{
+	void *newptr;
+	size_t oldsz;
+
+	if (ptr == NULL) {
+		return kmalloc_caller(sz, caller);
+	}
+	if (sz == 0) {
+		kfree(ptr);
+		return NULL;
+	}
+
+#if OPT_KHEAPPROF
+	/* Every block is tagged; just move it. */
+	oldsz = kheapprof_size(ptr);
+#else
+	oldsz = kmalloc_blocksize(ptr);
+	if (large_block((vaddr_t)ptr) && sz >= LARGEST_SUBPAGE_SIZE) {
+		/* Grow or shrink the run where it is, if we can. */
+		if (coremap_resize(KVADDR_TO_PADDR((vaddr_t)ptr),
+				   DIVROUNDUP(sz, PAGE_SIZE)) == 0) {
+			return ptr;
+		}
+	}
+	else if (sz <= oldsz) {
+		return ptr;
+	}
+#endif
+
+	newptr = kmalloc_caller(sz, caller);
+	if (newptr == NULL) {
+		return NULL;
+	}
+	memcpy(newptr, ptr, oldsz < sz ? oldsz : sz);
+	kfree(ptr);
+	return newptr;
+}
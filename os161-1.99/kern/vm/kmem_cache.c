@@ -0,0 +1,297 @@
+/*
+ * Object caches. See <kmem_cache.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <kmem_cache.h>
+
+/*
+ * All caches that have ever had a slab, for reclaim and statistics.
+ * Caches are never destroyed, so the list only grows.
+ */
+static struct kmem_cache *kmem_caches;
+static struct spinlock kmem_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Set once the coremap is up. Until then there is nowhere to give a
+ * slab back to, so empty slabs are all kept. (Slabs from before then
+ * came from ram_stealmem; free_kpages quietly keeps them later on.)
+ */
+static bool kmem_ready;
+
+#define SLAB_OBJ(kc, ks, i) \
+	((void *)((char *)(ks) + KMEM_SLABHDR + (i) * (kc)->kc_objsize))
+
+static
+void
+slab_push(struct kmem_slab **head, struct kmem_slab *ks)
+{
+	ks->ks_prev = NULL;
+	ks->ks_next = *head;
+	if (*head != NULL) {
+		(*head)->ks_prev = ks;
+	}
+	*head = ks;
+}
+
+static
+void
+slab_unlink(struct kmem_slab **head, struct kmem_slab *ks)
+{
+	if (ks->ks_prev != NULL) {
+		ks->ks_prev->ks_next = ks->ks_next;
+	}
+	else {
+		KASSERT(*head == ks);
+		*head = ks->ks_next;
+	}
+	if (ks->ks_next != NULL) {
+		ks->ks_next->ks_prev = ks->ks_prev;
+	}
+	ks->ks_next = ks->ks_prev = NULL;
+}
+
+/*
+ * Give a slab, now off every list, back to the system, destructing
+ * the objects that were ever constructed.
+ */
+static
+void
+slab_release(struct kmem_cache *kc, struct kmem_slab *ks)
+{
+	unsigned i;
+
+	KASSERT(ks->ks_nfree == kc->kc_perslab);
+
+	if (kc->kc_dtor != NULL) {
+		for (i=0; i<kc->kc_perslab; i++) {
+			if (ks->ks_constructed[i]) {
+				kc->kc_dtor(SLAB_OBJ(kc, ks, i));
+			}
+		}
+	}
+	free_kpages((vaddr_t)ks);
+}
+
+/*
+ * Add an empty slab to KC. Called without the cache lock.
+ */
+static
+int
+kmem_cache_grow(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	vaddr_t page;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return ENOMEM;
+	}
+	ks = (struct kmem_slab *)page;
+	ks->ks_cache = kc;
+	ks->ks_next = ks->ks_prev = NULL;
+	/* Hand out the lowest indexes first. */
+	ks->ks_nfree = kc->kc_perslab;
+	for (i=0; i<kc->kc_perslab; i++) {
+		ks->ks_free[i] = kc->kc_perslab - 1 - i;
+		ks->ks_constructed[i] = 0;
+	}
+
+	spinlock_acquire(&kc->kc_lock);
+	slab_push(&kc->kc_empty, ks);
+	kc->kc_nempty++;
+	kc->kc_nslabs++;
+	spinlock_release(&kc->kc_lock);
+
+	spinlock_acquire(&kmem_lock);
+	if (!kc->kc_listed) {
+		kc->kc_listed = true;
+		kc->kc_next = kmem_caches;
+		kmem_caches = kc;
+	}
+	spinlock_release(&kmem_lock);
+
+	return 0;
+}
+
+void *
+kmem_cache_alloc(struct kmem_cache *kc)
+{
+	struct kmem_slab *ks;
+	unsigned i;
+	bool constructed;
+	void *obj;
+	int result;
+
+	KASSERT(kc->kc_perslab > 0 && kc->kc_perslab <= KMEM_SLABMAX);
+
+	spinlock_acquire(&kc->kc_lock);
+	while (kc->kc_partial == NULL && kc->kc_empty == NULL) {
+		spinlock_release(&kc->kc_lock);
+		if (kmem_cache_grow(kc)) {
+			return NULL;
+		}
+		spinlock_acquire(&kc->kc_lock);
+	}
+
+	/* Fill partly used slabs first, so free ones stay free. */
+	ks = kc->kc_partial;
+	if (ks == NULL) {
+		ks = kc->kc_empty;
+		slab_unlink(&kc->kc_empty, ks);
+		kc->kc_nempty--;
+		slab_push(&kc->kc_partial, ks);
+	}
+	KASSERT(ks->ks_nfree > 0);
+	ks->ks_nfree--;
+	i = ks->ks_free[ks->ks_nfree];
+	if (ks->ks_nfree == 0) {
+		/* Full slabs are on no list; kmem_cache_free finds them. */
+		slab_unlink(&kc->kc_partial, ks);
+	}
+	constructed = ks->ks_constructed[i];
+	kc->kc_inuse++;
+	kc->kc_allocs++;
+	if (!constructed && kc->kc_ctor != NULL) {
+		kc->kc_ctors++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	obj = SLAB_OBJ(kc, ks, i);
+	if (!constructed) {
+		if (kc->kc_ctor != NULL) {
+			result = kc->kc_ctor(obj);
+			if (result) {
+				/* Goes back unconstructed. */
+				kmem_cache_free(kc, obj);
+				return NULL;
+			}
+		}
+		/* The slot is ours, so nobody else touches this byte. */
+		ks->ks_constructed[i] = 1;
+	}
+	return obj;
+}
+
+void
+kmem_cache_free(struct kmem_cache *kc, void *obj)
+{
+	struct kmem_slab *ks;
+	size_t offset;
+	unsigned i;
+	bool release;
+
+	ks = (struct kmem_slab *)((vaddr_t)obj & PAGE_FRAME);
+	KASSERT(ks->ks_cache == kc);
+	offset = (vaddr_t)obj - (vaddr_t)ks;
+	KASSERT(offset >= KMEM_SLABHDR);
+	KASSERT((offset - KMEM_SLABHDR) % kc->kc_objsize == 0);
+	i = (offset - KMEM_SLABHDR) / kc->kc_objsize;
+	KASSERT(i < kc->kc_perslab);
+
+	release = false;
+	spinlock_acquire(&kc->kc_lock);
+	KASSERT(ks->ks_nfree < kc->kc_perslab);
+	if (ks->ks_nfree == 0) {
+		slab_push(&kc->kc_partial, ks);
+	}
+	ks->ks_free[ks->ks_nfree++] = i;
+	KASSERT(kc->kc_inuse > 0);
+	kc->kc_inuse--;
+	if (ks->ks_nfree == kc->kc_perslab) {
+		slab_unlink(&kc->kc_partial, ks);
+		if (kc->kc_nempty < KMEM_EMPTYMAX || !kmem_ready) {
+			slab_push(&kc->kc_empty, ks);
+			kc->kc_nempty++;
+		}
+		else {
+			kc->kc_nslabs--;
+			release = true;
+		}
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (release) {
+		slab_release(kc, ks);
+	}
+}
+
+/*
+ * Reclaim hook: release every cache's free slabs.
+ */
+static
+unsigned
+kmem_cache_reclaim(void)
+{
+	struct kmem_cache *kc;
+	struct kmem_slab *ks, *next;
+	unsigned n;
+
+	n = 0;
+	spinlock_acquire(&kmem_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_lock);
+
+	while (kc != NULL) {
+		spinlock_acquire(&kc->kc_lock);
+		ks = kc->kc_empty;
+		kc->kc_empty = NULL;
+		kc->kc_nslabs -= kc->kc_nempty;
+		kc->kc_nempty = 0;
+		spinlock_release(&kc->kc_lock);
+
+		for (; ks != NULL; ks = next) {
+			next = ks->ks_next;
+			slab_release(kc, ks);
+			n++;
+		}
+
+		spinlock_acquire(&kmem_lock);
+		kc = kc->kc_next;
+		spinlock_release(&kmem_lock);
+	}
+	return n;
+}
+
+void
+kmem_cache_bootstrap(void)
+{
+	int result;
+
+	kmem_ready = true;
+
+	result = vm_reclaim_register("kmem_cache", kmem_cache_reclaim);
+	if (result) {
+		panic("kmem_cache: cannot register reclaim hook: %s\n",
+		      strerror(result));
+	}
+}
+
+void
+kmem_cache_printstats(void)
+{
+	struct kmem_cache *kc;
+
+	spinlock_acquire(&kmem_lock);
+	kc = kmem_caches;
+	spinlock_release(&kmem_lock);
+
+	kprintf("%-12s %6s %5s %6s %7s %6s %8s %7s\n", "cache", "size",
+		"/slab", "slabs", "empty", "inuse", "allocs", "ctors");
+	while (kc != NULL) {
+		/* Racy snapshot; good enough for statistics. */
+		kprintf("%-12s %6u %5u %6u %7u %6u %8u %7u\n", kc->kc_name,
+			kc->kc_objsize, kc->kc_perslab, kc->kc_nslabs,
+			kc->kc_nempty, kc->kc_inuse, kc->kc_allocs,
+			kc->kc_ctors);
+
+		spinlock_acquire(&kmem_lock);
+		kc = kc->kc_next;
+		spinlock_release(&kmem_lock);
+	}
+}
@@ -0,0 +1,322 @@
+/*
+ * Page cache for read-only file pages. See <pagecache.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagecache.h>
+
+/*
+ * A cached page. The frame's coremap_kdata points back at its entry,
+ * so pageout can find it (see pagecache_evict); it is set and cleared
+ * under pc_lock. The page's contents depend on where the file data
+ * sits in it, not just on the vnode, so the key is the file offset
+ * the page starts at plus the number of file bytes it holds. (Two
+ * mappings of the same file at different alignments don't match.)
+ */
+struct pc_entry {
+	struct vnode *pe_vnode;
+	off_t pe_offset;		/* file offset of the page's start */
+	size_t pe_len;			/* bytes of file data in the page */
+	paddr_t pe_paddr;
+	struct pc_entry *pe_next;	/* hash chain */
+};
+
+static struct pc_entry *pc_table[PAGECACHE_HASHSIZE];
+static struct spinlock pc_lock = SPINLOCK_INITIALIZER;
+
+static unsigned pc_count;		/* pages cached */
+static unsigned pc_hits, pc_misses, pc_reclaimed, pc_evicted;
+
+void
+pagecache_bootstrap(void)
+{
+	int result;
+
+	result = vm_reclaim_register("pagecache", pagecache_reclaim);
+	if (result) {
+		panic("pagecache: cannot register reclaim hook: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Work out the key for page VADDR of VR.
+ */
+static
+void
+pc_key(struct vm_region *vr, vaddr_t vaddr, off_t *offset, size_t *len)
+{
+	vaddr_t start, end;
+
+	start = vaddr < vr->vr_filestart ? vr->vr_filestart : vaddr;
+	end = vaddr + PAGE_SIZE;
+	if (end > vr->vr_filestart + vr->vr_filesz) {
+		end = vr->vr_filestart + vr->vr_filesz;
+	}
+
+	/* May be "before" the file if the data starts mid-page. */
+	*offset = vr->vr_fileoff + ((off_t)vaddr - (off_t)vr->vr_filestart);
+	*len = end > start ? end - start : 0;
+}
+
+static
+unsigned
+pc_hash(struct vnode *v, off_t offset)
+{
+	return ((uintptr_t)v / sizeof(void *) + (unsigned)(offset / PAGE_SIZE))
+		& (PAGECACHE_HASHSIZE - 1);
+}
+
+/*
+ * Find an entry. Call with pc_lock held.
+ */
+static
+struct pc_entry *
+pc_find(struct vnode *v, off_t offset, size_t len)
+{
+	struct pc_entry *pe;
+
+	for (pe = pc_table[pc_hash(v, offset)]; pe != NULL;
+	     pe = pe->pe_next) {
+		if (pe->pe_vnode == v && pe->pe_offset == offset &&
+		    pe->pe_len == len) {
+			return pe;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Only program text: it's what gets shared, and nobody expects to see
+ * writes to a running executable. A read-only mmap of a file somebody
+ * else is writing must see the writes, so leave those alone.
+ */
+bool
+pagecache_cacheable(struct vm_region *vr)
+{
+	return vr->vr_vnode != NULL &&
+		(vr->vr_flags & (VR_EXEC | VR_WRITE | VR_MMAP)) == VR_EXEC;
+}
+
+paddr_t
+pagecache_lookup(struct vm_region *vr, vaddr_t vaddr, unsigned *gen)
+{
+	struct pc_entry *pe;
+	off_t offset;
+	size_t len;
+	paddr_t paddr;
+
+	KASSERT(pagecache_cacheable(vr));
+
+	*gen = 0;
+	pc_key(vr, vaddr, &offset, &len);
+	if (len == 0) {
+		/* all zeros; not worth caching */
+		return 0;
+	}
+
+	spinlock_acquire(&pc_lock);
+	pe = pc_find(vr->vr_vnode, offset, len);
+	if (pe == NULL) {
+		*gen = vr->vr_vnode->vn_pcgen;
+		pc_misses++;
+		spinlock_release(&pc_lock);
+		return 0;
+	}
+	/* Take our reference before reclaim can see the count drop. */
+	paddr = pe->pe_paddr;
+	coremap_share(paddr);
+	pc_hits++;
+	spinlock_release(&pc_lock);
+	return paddr;
+}
+
+bool
+pagecache_insert(struct vm_region *vr, vaddr_t vaddr, paddr_t paddr,
+		 unsigned gen)
+{
+	struct pc_entry *pe;
+	unsigned h;
+
+	KASSERT(pagecache_cacheable(vr));
+
+	pe = kmalloc(sizeof(*pe));
+	if (pe == NULL) {
+		/* Not caching it is always an option. */
+		return false;
+	}
+	pe->pe_vnode = vr->vr_vnode;
+	pc_key(vr, vaddr, &pe->pe_offset, &pe->pe_len);
+	pe->pe_paddr = paddr;
+	if (pe->pe_len == 0) {
+		kfree(pe);
+		return false;
+	}
+
+	spinlock_acquire(&pc_lock);
+	if (pe->pe_vnode->vn_pcgen != gen) {
+		/* The file was written since; what we read may be stale. */
+		spinlock_release(&pc_lock);
+		kfree(pe);
+		return false;
+	}
+	if (pc_find(pe->pe_vnode, pe->pe_offset, pe->pe_len) != NULL) {
+		/* Somebody else read it in at the same time. */
+		spinlock_release(&pc_lock);
+		kfree(pe);
+		return false;
+	}
+	coremap_share(paddr);
+	coremap_setkdata(paddr, pe);
+	pe->pe_vnode->vn_pcpages++;
+	h = pc_hash(pe->pe_vnode, pe->pe_offset);
+	pe->pe_next = pc_table[h];
+	pc_table[h] = pe;
+	pc_count++;
+	spinlock_release(&pc_lock);
+	return true;
+}
+
+unsigned
+pagecache_reclaim(void)
+{
+	struct pc_entry *pe, **pp, *dead;
+	unsigned i, n;
+
+	/*
+	 * Unhook every entry whose frame only the cache refers to. Since
+	 * lookups take their reference under pc_lock, nobody can pick up
+	 * such a frame once we have seen the count at 1.
+	 */
+	dead = NULL;
+	spinlock_acquire(&pc_lock);
+	for (i=0; i<PAGECACHE_HASHSIZE; i++) {
+		pp = &pc_table[i];
+		while (*pp != NULL) {
+			pe = *pp;
+			if (coremap_refcount(pe->pe_paddr) == 1) {
+				*pp = pe->pe_next;
+				pe->pe_next = dead;
+				dead = pe;
+				coremap_setkdata(pe->pe_paddr, NULL);
+				pe->pe_vnode->vn_pcpages--;
+				pc_count--;
+				pc_reclaimed++;
+			}
+			else {
+				pp = &pe->pe_next;
+			}
+		}
+	}
+	spinlock_release(&pc_lock);
+
+	/* Don't free frames with a spinlock held. */
+	n = 0;
+	while (dead != NULL) {
+		pe = dead;
+		dead = pe->pe_next;
+		coremap_free(pe->pe_paddr);
+		kfree(pe);
+		n++;
+	}
+	return n;
+}
+
+void
+pagecache_invalidate(struct vnode *v)
+{
+	struct pc_entry *pe, **pp, *dead;
+	unsigned i;
+
+	dead = NULL;
+	spinlock_acquire(&pc_lock);
+	/* Fail any pagecache_insert of a page read before now. */
+	v->vn_pcgen++;
+	for (i=0; i<PAGECACHE_HASHSIZE && v->vn_pcpages > 0; i++) {
+		pp = &pc_table[i];
+		while (*pp != NULL) {
+			pe = *pp;
+			if (pe->pe_vnode == v) {
+				*pp = pe->pe_next;
+				pe->pe_next = dead;
+				dead = pe;
+				coremap_setkdata(pe->pe_paddr, NULL);
+				v->vn_pcpages--;
+				pc_count--;
+			}
+			else {
+				pp = &pe->pe_next;
+			}
+		}
+	}
+	spinlock_release(&pc_lock);
+
+	/*
+	 * This only drops the cache's reference. Processes already
+	 * running the old text keep their copy of it.
+	 */
+	while (dead != NULL) {
+		pe = dead;
+		dead = pe->pe_next;
+		coremap_free(pe->pe_paddr);
+		kfree(pe);
+	}
+}
+
+bool
+pagecache_evict(paddr_t paddr, unsigned nmapped, bool *cached)
+{
+	struct pc_entry *pe, **pp;
+
+	spinlock_acquire(&pc_lock);
+	pe = coremap_kdata(paddr);
+	/* Lookups take their reference under pc_lock, so this holds. */
+	if (coremap_refcount(paddr) != nmapped + (pe != NULL ? 1 : 0)) {
+		spinlock_release(&pc_lock);
+		return false;
+	}
+	if (pe != NULL) {
+		KASSERT(pe->pe_paddr == paddr);
+		pp = &pc_table[pc_hash(pe->pe_vnode, pe->pe_offset)];
+		while (*pp != pe) {
+			KASSERT(*pp != NULL);
+			pp = &(*pp)->pe_next;
+		}
+		*pp = pe->pe_next;
+		coremap_setkdata(paddr, NULL);
+		pe->pe_vnode->vn_pcpages--;
+		pc_count--;
+		pc_evicted++;
+	}
+	spinlock_release(&pc_lock);
+
+	/* The cache's reference to the frame is now the caller's. */
+	*cached = pe != NULL;
+	if (pe != NULL) {
+		kfree(pe);
+	}
+	return true;
+}
+
+void
+pagecache_printstats(void)
+{
+	unsigned count, hits, misses, reclaimed, evicted;
+
+	spinlock_acquire(&pc_lock);
+	count = pc_count;
+	hits = pc_hits;
+	misses = pc_misses;
+	reclaimed = pc_reclaimed;
+	evicted = pc_evicted;
+	spinlock_release(&pc_lock);
+
+	kprintf("Page cache: %u pages, %u hits, %u misses, %u reclaimed, "
+		"%u paged out\n", count, hits, misses, reclaimed, evicted);
+}
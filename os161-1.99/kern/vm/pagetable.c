@@ -0,0 +1,87 @@
+/*
+ * Two-level page tables. See <pagetable.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct pagetable *
+pt_create(void)
+{
+	struct pagetable *pt;
+	unsigned i;
+
+	pt = kmalloc(sizeof(*pt));
+	if (pt == NULL) {
+		return NULL;
+	}
+	for (i=0; i<PT_NDIR; i++) {
+		pt->pt_dir[i] = NULL;
+	}
+	return pt;
+}
+
+void
+pt_destroy(struct pagetable *pt)
+{
+	unsigned i;
+
+	for (i=0; i<PT_NDIR; i++) {
+		if (pt->pt_dir[i] != NULL) {
+			kfree(pt->pt_dir[i]);
+		}
+	}
+	kfree(pt);
+}
+
+pte_t *
+pt_lookup(struct pagetable *pt, vaddr_t vaddr, bool create)
+{
+	pte_t *table;
+	unsigned i;
+
+	table = pt->pt_dir[PT_DIRINDEX(vaddr)];
+	if (table == NULL) {
+		if (!create) {
+			return NULL;
+		}
+		table = kmalloc(PT_NTABLE * sizeof(pte_t));
+		if (table == NULL) {
+			return NULL;
+		}
+		for (i=0; i<PT_NTABLE; i++) {
+			table[i] = 0;
+		}
+		pt->pt_dir[PT_DIRINDEX(vaddr)] = table;
+	}
+	return &table[PT_TABLEINDEX(vaddr)];
+}
+
+int
+pt_foreach(struct pagetable *pt,
+	   int (*func)(vaddr_t vaddr, pte_t *pte, void *data),
+	   void *data)
+{
+	pte_t *table;
+	unsigned i, j;
+	int result;
+
+	for (i=0; i<PT_NDIR; i++) {
+		table = pt->pt_dir[i];
+		if (table == NULL) {
+			continue;
+		}
+		for (j=0; j<PT_NTABLE; j++) {
+			if (table[j] == 0) {
+				continue;
+			}
+			result = func((i << 22) | (j << 12), &table[j], data);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
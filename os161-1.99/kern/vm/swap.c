@@ -0,0 +1,588 @@
+/*
+ * Swap space and pageout. See <swap.h>.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <coremap.h>
+#include <pagetable.h>
+#include <pagecache.h>
+#include <swap.h>
+#include <uw-vmstats.h>
+
+static struct vnode *swap_vnode;	/* NULL if there is no swap */
+static unsigned swap_nslots;
+static uint16_t *swap_refs;		/* per-slot reference counts */
+static unsigned swap_nfree;
+static unsigned swap_hint;		/* where to start looking for a slot */
+static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+
+static struct lock *pageout_lock;
+
+void
+swap_bootstrap(void)
+{
+	char path[] = SWAP_DEVICE;
+	struct stat st;
+	unsigned i;
+	int result;
+
+	pageout_lock = lock_create("pageout");
+	if (pageout_lock == NULL) {
+		panic("swap: cannot create pageout lock\n");
+	}
+
+	result = vfs_open(path, O_RDWR, 0, &swap_vnode);
+	if (result) {
+		kprintf("swap: cannot open %s: %s; running without swap\n",
+			SWAP_DEVICE, strerror(result));
+		swap_vnode = NULL;
+		return;
+	}
+
+	result = VOP_STAT(swap_vnode, &st);
+	if (result) {
+		panic("swap: cannot stat %s: %s\n", SWAP_DEVICE,
+		      strerror(result));
+	}
+
+	swap_nslots = st.st_size / PAGE_SIZE;
+	/* A slot number has to fit where the frame number goes. */
+	if (swap_nslots > PTE_SLOT(PTE_FRAME) + 1) {
+		swap_nslots = PTE_SLOT(PTE_FRAME) + 1;
+	}
+
+	swap_refs = kmalloc(swap_nslots * sizeof(swap_refs[0]));
+	if (swap_refs == NULL) {
+		panic("swap: out of memory for %u slots\n", swap_nslots);
+	}
+	for (i=0; i<swap_nslots; i++) {
+		swap_refs[i] = 0;
+	}
+	swap_nfree = swap_nslots;
+	swap_hint = 0;
+
+	kprintf("swap: %s, %u pages\n", SWAP_DEVICE, swap_nslots);
+}
+
+void
+pageout_lock_acquire(void)
+{
+	lock_acquire(pageout_lock);
+}
+
+void
+pageout_lock_release(void)
+{
+	lock_release(pageout_lock);
+}
+
+bool
+pageout_lock_held(void)
+{
+	return pageout_lock != NULL && lock_do_i_hold(pageout_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Slots
+
+static
+int
+swap_slot_alloc(unsigned *ret)
+{
+	unsigned i, slot;
+
+	spinlock_acquire(&swap_lock);
+	if (swap_nfree == 0) {
+		spinlock_release(&swap_lock);
+		return ENOSPC;
+	}
+	for (i=0; i<swap_nslots; i++) {
+		slot = (swap_hint + i) % swap_nslots;
+		if (swap_refs[slot] == 0) {
+			swap_refs[slot] = 1;
+			swap_nfree--;
+			swap_hint = slot + 1;
+			spinlock_release(&swap_lock);
+			*ret = slot;
+			return 0;
+		}
+	}
+	panic("swap: free count is %u but no free slot\n", swap_nfree);
+	return ENOSPC;
+}
+
+void
+swap_share(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0 && swap_refs[slot] < 0xffff);
+	swap_refs[slot]++;
+	spinlock_release(&swap_lock);
+}
+
+void
+swap_free(unsigned slot)
+{
+	KASSERT(slot < swap_nslots);
+
+	spinlock_acquire(&swap_lock);
+	KASSERT(swap_refs[slot] > 0);
+	swap_refs[slot]--;
+	if (swap_refs[slot] == 0) {
+		swap_nfree++;
+	}
+	spinlock_release(&swap_lock);
+}
+
+static
+int
+swap_io(paddr_t paddr, unsigned slot, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	KASSERT(swap_vnode != NULL);
+	KASSERT(slot < swap_nslots);
+
+	uio_kinit(&iov, &u, (void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t)slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ) {
+		result = VOP_READ(swap_vnode, &u);
+	}
+	else {
+		result = VOP_WRITE(swap_vnode, &u);
+	}
+	if (result) {
+		return result;
+	}
+	if (u.uio_resid != 0) {
+		return EIO;
+	}
+	return 0;
+}
+
+int
+swap_in(unsigned slot, paddr_t paddr)
+{
+	int result;
+
+	result = swap_io(paddr, slot, UIO_READ);
+	if (result) {
+		return result;
+	}
+	vmstats_inc(VMSTAT_SWAP_FILE_READ);
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Pageout
+
+/* One page on its way out. */
+struct pageout {
+	struct addrspace *po_as;	/* owner, or NULL if shared */
+	vaddr_t po_vaddr;
+	paddr_t po_paddr;
+	pte_t *po_pte;		/* the owner's entry */
+	pte_t po_old;		/* entry before we marked it busy */
+	unsigned po_nmapped;	/* entries marked busy, if shared */
+	bool po_cached;		/* we took the page cache's reference */
+	struct vm_region *po_vr; /* shared mapping to write back to, or NULL */
+};
+
+/*
+ * Take page VADDR of AS, which coremap_clock says is in the frame at
+ * PADDR, out of the page table, marking the entry busy. Fails (leaving
+ * the page where it is) if the page table no longer agrees, the page is
+ * busy, or it is dirty and there is no swap. A dirty page of a shared
+ * file mapping goes back to its file instead, so it needs no swap; its
+ * region can't be freed while the entry is busy (as_drop_pages waits).
+ * The caller must shoot down TLB entries before touching the frame.
+ */
+static
+int
+swap_unmap(struct addrspace *as, vaddr_t vaddr, paddr_t paddr,
+	   struct pageout *po)
+{
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(pageout_lock));
+
+	spinlock_acquire(&as->as_lock);
+	pte = pt_lookup(as->as_pt, vaddr, false);
+	if (pte == NULL ||
+	    (*pte & (PTE_VALID | PTE_BUSY)) != PTE_VALID ||
+	    (*pte & PTE_FRAME) != paddr ||
+	    coremap_refcount(paddr) != 1) {
+		/* Stale owner, or someone else is working on it. */
+		spinlock_release(&as->as_lock);
+		return EBUSY;
+	}
+	po->po_vr = NULL;
+	if ((*pte & (PTE_DIRTY | PTE_SHARED)) == (PTE_DIRTY | PTE_SHARED)) {
+		/* as_munmap unlinks regions under as_lock. */
+		po->po_vr = as_find_region(as, vaddr);
+		if (po->po_vr == NULL) {
+			/* Being unmapped, which writes it back anyway. */
+			spinlock_release(&as->as_lock);
+			return EBUSY;
+		}
+		KASSERT(po->po_vr->vr_flags & VR_SHARED);
+	}
+	else if ((*pte & PTE_DIRTY) && swap_vnode == NULL) {
+		spinlock_release(&as->as_lock);
+		return ENOSPC;
+	}
+	po->po_as = as;
+	po->po_vaddr = vaddr;
+	po->po_paddr = paddr;
+	po->po_pte = pte;
+	po->po_old = *pte;
+	po->po_nmapped = 1;
+	po->po_cached = false;
+	*pte = (*pte & ~PTE_VALID) | PTE_BUSY;
+	spinlock_release(&as->as_lock);
+	return 0;
+}
+
+/*
+ * Pages shared by several address spaces (after fork) have no single
+ * owner to go to. Every sharer maps the frame at the same address,
+ * though, since fork doesn't move anything, so pageout looks for it
+ * there in every address space (as_foreach) and marks each entry it
+ * finds busy. An entry we marked is the only kind that is busy, not
+ * valid and not swapped, and still names a frame, which is how the
+ * later passes find them again.
+ */
+struct sharers {
+	struct pageout *sh_po;
+	struct tlbbatch *sh_tb;	/* marking: where the entries go */
+	bool sh_restore;	/* updating: put them back as they were */
+	pte_t sh_new;		/* updating: otherwise, replace them with this */
+	unsigned sh_count;	/* updating: entries changed */
+};
+
+#define PTE_OURS(pte, paddr) \
+	(((pte) & (PTE_VALID | PTE_SWAPPED | PTE_BUSY | PTE_FRAME)) == \
+	 (PTE_BUSY | (paddr)))
+
+static
+int
+swap_marksharer(struct addrspace *as, void *data)
+{
+	struct sharers *sh = data;
+	struct pageout *po = sh->sh_po;
+	struct vm_region *vr;
+	pte_t *pte;
+
+	spinlock_acquire(&as->as_lock);
+	pte = pt_lookup(as->as_pt, po->po_vaddr, false);
+	if (pte == NULL || (*pte & PTE_VALID) == 0 ||
+	    (*pte & PTE_FRAME) != po->po_paddr) {
+		spinlock_release(&as->as_lock);
+		return 0;
+	}
+	if (*pte & PTE_BUSY) {
+		/* A fault is copying it. */
+		spinlock_release(&as->as_lock);
+		return EBUSY;
+	}
+	if ((*pte & (PTE_DIRTY | PTE_SHARED)) == (PTE_DIRTY | PTE_SHARED)) {
+		/* Any sharer's region will do; they map the same file. */
+		vr = as_find_region(as, po->po_vaddr);
+		if (vr == NULL) {
+			spinlock_release(&as->as_lock);
+			return EBUSY;
+		}
+		KASSERT(vr->vr_flags & VR_SHARED);
+		po->po_vr = vr;
+	}
+	po->po_old |= *pte & PTE_DIRTY;
+	po->po_nmapped++;
+	*pte = (*pte & ~PTE_VALID) | PTE_BUSY;
+	spinlock_release(&as->as_lock);
+
+	/* This may flush the batch, so no spinlocks. */
+	vm_tlbbatch_add(sh->sh_tb, as, po->po_vaddr);
+	return 0;
+}
+
+static
+int
+swap_updatesharer(struct addrspace *as, void *data)
+{
+	struct sharers *sh = data;
+	struct pageout *po = sh->sh_po;
+	pte_t *pte;
+
+	spinlock_acquire(&as->as_lock);
+	pte = pt_lookup(as->as_pt, po->po_vaddr, false);
+	if (pte != NULL && PTE_OURS(*pte, po->po_paddr)) {
+		if (sh->sh_restore) {
+			*pte = (*pte & ~PTE_BUSY) | PTE_VALID;
+		}
+		else {
+			*pte = sh->sh_new;
+		}
+		sh->sh_count++;
+	}
+	spinlock_release(&as->as_lock);
+	return 0;
+}
+
+/*
+ * Put back (if RESTORE) or set to NEW every entry marked busy for the
+ * shared page PO.
+ */
+static
+void
+swap_updatesharers(struct pageout *po, bool restore, pte_t new)
+{
+	struct sharers sh;
+
+	sh.sh_po = po;
+	sh.sh_tb = NULL;
+	sh.sh_restore = restore;
+	sh.sh_new = new;
+	sh.sh_count = 0;
+	as_foreach(swap_updatesharer, &sh);
+	KASSERT(sh.sh_count == po->po_nmapped);
+}
+
+/*
+ * swap_unmap for a frame that is shared, or whose owner coremap_clock
+ * doesn't know: mark every entry mapping it busy, adding each to TB.
+ * Fails, putting them all back, if a fault has one of them busy or
+ * the entries found don't account for every reference to the frame
+ * (somebody is about to map it or has just unmapped it, or maps it at
+ * a different address).
+ */
+static
+int
+swap_unmapshared(vaddr_t vaddr, paddr_t paddr, struct pageout *po,
+		 struct tlbbatch *tb)
+{
+	struct sharers sh;
+	int result;
+
+	KASSERT(lock_do_i_hold(pageout_lock));
+
+	po->po_as = NULL;
+	po->po_vaddr = vaddr;
+	po->po_paddr = paddr;
+	po->po_pte = NULL;
+	po->po_old = 0;
+	po->po_nmapped = 0;
+	po->po_cached = false;
+	po->po_vr = NULL;
+
+	sh.sh_po = po;
+	sh.sh_tb = tb;
+	result = as_foreach(swap_marksharer, &sh);
+
+	if (result == 0 && (po->po_old & PTE_DIRTY) && po->po_vr == NULL &&
+	    swap_vnode == NULL) {
+		result = ENOSPC;
+	}
+
+	/*
+	 * With every mapping busy nobody can take a new reference but
+	 * the page cache, so if the count matches now it stays that way.
+	 * If the cache has the frame (program text), take it from the
+	 * cache too; it is clean, so the cache can read it again.
+	 */
+	if (result == 0 &&
+	    !pagecache_evict(paddr, po->po_nmapped, &po->po_cached)) {
+		result = EBUSY;
+	}
+	if (result) {
+		swap_updatesharers(po, true, 0);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Put the entries for PO back as they were, or set them to NEW.
+ */
+static
+void
+swap_putback(struct pageout *po)
+{
+	struct addrspace *as = po->po_as;
+
+	if (as == NULL) {
+		swap_updatesharers(po, true, 0);
+		if (po->po_cached) {
+			/*
+			 * Out of the cache now, so drop its reference. Only
+			 * a dirty page can get here, and somebody maps that,
+			 * so this is never the last one.
+			 */
+			KASSERT(po->po_nmapped > 0);
+			coremap_free(po->po_paddr);
+		}
+		return;
+	}
+	spinlock_acquire(&as->as_lock);
+	*po->po_pte = po->po_old;
+	spinlock_release(&as->as_lock);
+}
+
+static
+void
+swap_finish(struct pageout *po, pte_t new)
+{
+	struct addrspace *as = po->po_as;
+
+	if (as == NULL) {
+		swap_updatesharers(po, false, new);
+		return;
+	}
+	spinlock_acquire(&as->as_lock);
+	*po->po_pte = new;
+	spinlock_release(&as->as_lock);
+}
+
+/*
+ * Second half of pageout, once no TLB can reach the frame: write the
+ * page to swap if it is dirty and point the entries at the slot, or
+ * just clear them if it is clean. A shared page goes to one slot with
+ * a reference for each sharer. A dirty shared-mapping page is written
+ * to its file and then treated as clean, since vm_fault will read it
+ * back from there. On failure the page is put back.
+ */
+static
+int
+swap_writeout(struct pageout *po)
+{
+	pte_t new;
+	unsigned i, slot;
+	int result;
+
+	if (po->po_vr != NULL) {
+		result = as_write_page(po->po_vr, po->po_vaddr, po->po_paddr);
+		if (result) {
+			swap_putback(po);
+			return result;
+		}
+		new = 0;
+	}
+	else if (po->po_old & PTE_DIRTY) {
+		result = swap_slot_alloc(&slot);
+		if (result == 0) {
+			result = swap_io(po->po_paddr, slot, UIO_WRITE);
+			if (result) {
+				swap_free(slot);
+			}
+		}
+		if (result) {
+			swap_putback(po);
+			return result;
+		}
+		vmstats_inc(VMSTAT_SWAP_FILE_WRITE);
+		for (i=1; i<po->po_nmapped; i++) {
+			swap_share(slot);
+		}
+		new = PTE_FROMSLOT(slot) | PTE_SWAPPED;
+	}
+	else {
+		/* Clean; vm_fault can refill it from the region. */
+		new = 0;
+	}
+
+	swap_finish(po, new);
+	return 0;
+}
+
+paddr_t
+swap_evict(void)
+{
+	struct pageout victims[SWAP_CLUSTER];
+	struct tlbbatch tb;
+	struct addrspace *as;
+	vaddr_t vaddr;
+	paddr_t paddr, ret;
+	unsigned i, n, refused;
+	int result;
+
+	if (pageout_lock == NULL || curthread->t_in_interrupt ||
+	    curthread->t_curspl > 0 || curthread->t_iplhigh_count > 0) {
+		/* Too early, or we are not allowed to sleep. */
+		return 0;
+	}
+	if (lock_do_i_hold(pageout_lock)) {
+		/* Pageout (or as_destroy) needs memory itself. */
+		return 0;
+	}
+
+	lock_acquire(pageout_lock);
+
+	/*
+	 * Unmap a cluster of victims and shoot their TLB entries down in
+	 * one round, rather than interrupting every cpu once per page.
+	 */
+	vm_tlbbatch_init(&tb);
+	n = refused = 0;
+	while (n < SWAP_CLUSTER && refused < SWAP_EVICT_TRIES) {
+		paddr = coremap_clock(&as, &vaddr);
+		if (paddr == 0) {
+			break;
+		}
+		if (as != NULL) {
+			result = swap_unmap(as, vaddr, paddr, &victims[n]);
+			if (result == 0) {
+				vm_tlbbatch_add(&tb, as, vaddr);
+			}
+		}
+		else {
+			result = swap_unmapshared(vaddr, paddr, &victims[n],
+						  &tb);
+		}
+		if (result == 0) {
+			n++;
+		}
+		else {
+			coremap_release(paddr, false);
+			refused++;
+		}
+	}
+	vm_tlbbatch_flush(&tb);
+
+	/* Hand the first frame to the caller; the rest go back free. */
+	ret = 0;
+	for (i=0; i<n; i++) {
+		paddr = victims[i].po_paddr;
+		if (swap_writeout(&victims[i])) {
+			coremap_release(paddr, false);
+			continue;
+		}
+		coremap_release(paddr, true);
+		if (ret == 0) {
+			ret = paddr;
+		}
+		else {
+			coremap_free(paddr);
+		}
+	}
+
+	lock_release(pageout_lock);
+	return ret;
+}
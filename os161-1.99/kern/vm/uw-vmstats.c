@@ -2,24 +2,25 @@
 
 /* belongs in kern/vm/uw-vmstats.c */
 
-/* NOTE !!!!!! WARNING !!!!!
- * All of the functions whose names begin with '_'
- * assume that atomicity is ensured elsewhere
- * (i.e., outside of these routines) by acquiring stats_lock.
- * All of the functions whose names do not begin
- * with '_' ensure atomicity locally.
+/* Counters are kept per cpu (struct cpu's c_vmstats) and per process
+ * (struct proc's p_vmstats), and only summed when someone reads them.
+ * Each cpu only ever touches its own shard, with interrupts off, so
+ * counting needs no lock and never bounces a cache line between cpus.
+ * A process's counters are bumped by whichever cpu its thread is
+ * running on; a process only runs one thread in this kernel.
  */
 
 #include <types.h>
 #include <lib.h>
-#include <synch.h>
 #include <spl.h>
+#include <cpu.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
 #include <uw-vmstats.h>
 
-/* Counters for tracking statistics */
-static unsigned int stats_counts[VMSTAT_COUNT];
-
-struct spinlock stats_lock = SPINLOCK_INITIALIZER;
+/* Print each process's counters when it exits (menu command "vmp"). */
+bool vmstats_perproc = false;
 
 /* Strings used in printing out the statistics */
 static const char *stats_names[] = {
@@ -33,6 +34,10 @@ static const char *stats_names[] = {
  /*  7 */ "Page Faults from ELF",
  /*  8 */ "Page Faults from Swapfile",
  /*  9 */ "Swapfile Writes",
+ /* 10 */ "TLB Fault-around Loads",
+ /* 11 */ "Page Faults (Page Cache)",
+ /* 12 */ "Zeroed Frame Pool Hits",
+ /* 13 */ "Zeroed Frame Pool Misses",
 };
 
 
@@ -41,38 +46,63 @@ static const char *stats_names[] = {
 void
 vmstats_inc(unsigned int index)
 {
-    spinlock_acquire(&stats_lock);
-      _vmstats_inc(index);
-    spinlock_release(&stats_lock);
+  int spl;
+
+  /* Interrupts off so we stay on this cpu and the IPI handler's
+   * counts can't interleave with ours. */
+  spl = splhigh();
+  _vmstats_inc(index);
+  splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
 void
 vmstats_init(void)
 {
-  /* Although the spinlock is initialized at declaration time we do it here
-   * again in case we want use/reset these stats repeatedly without shutting down the kernel.
-   */
-  spinlock_init(&stats_lock);
-
-  spinlock_acquire(&stats_lock);
-    _vmstats_init();
-  spinlock_release(&stats_lock);
+  int spl;
+
+  spl = splhigh();
+  _vmstats_init();
+  splx(spl);
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_inc(unsigned int index)
 {
+  struct thread *t = curthread;
+
   KASSERT(index < VMSTAT_COUNT);
-  stats_counts[index]++;
+  curcpu->c_vmstats[index]++;
+  /* Interrupt work (e.g. shootdowns) isn't the interrupted process's doing. */
+  if (!t->t_in_interrupt && t->t_proc != NULL) {
+    t->t_proc->p_vmstats[index]++;
+  }
+}
+
+/* ---------------------------------------------------------------------- */
+/* Add up the per-cpu shards. */
+static
+void
+vmstats_sum(unsigned int *counts)
+{
+  unsigned int i, c;
+
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    counts[i] = 0;
+  }
+  for (c=0; c<cpu_count(); c++) {
+    for (i=0; i<VMSTAT_COUNT; i++) {
+      counts[i] += cpu_get(c)->c_vmstats[i];
+    }
+  }
 }
 
 /* ---------------------------------------------------------------------- */
 void
 _vmstats_init(void)
 {
-  int i = 0;
+  unsigned int i, c;
 
   if (sizeof(stats_names) / sizeof(char *) != VMSTAT_COUNT) {
     kprintf("vmstats_init: number of stats_names = %d != VMSTAT_COUNT = %d\n",
@@ -80,22 +110,24 @@ _vmstats_init(void)
     panic("Should really fix this before proceeding\n");
   }
 
-  for (i=0; i<VMSTAT_COUNT; i++) {
-    stats_counts[i] = 0;
+  for (c=0; c<cpu_count(); c++) {
+    for (i=0; i<VMSTAT_COUNT; i++) {
+      cpu_get(c)->c_vmstats[i] = 0;
+    }
   }
 
 }
 
 /* ---------------------------------------------------------------------- */
 /* Assumes vmstat_init has already been called */
-/* NOTE: We do not grab the spinlock here because kprintf may block
- * and we can't block while holding a spinlock.
- * Just use this when there is only one thread remaining.
+/* NOTE: The shards are read without stopping the other cpus, so
+ * the totals are only exact when the system is quiet.
  */
 
 void
 vmstats_print(void)
 {
+  unsigned int stats_counts[VMSTAT_COUNT];
   int i = 0;
   int free_plus_replace = 0;
   int disk_plus_zeroed_plus_reload = 0;
@@ -103,6 +135,8 @@ vmstats_print(void)
   int elf_plus_swap_reads = 0;
   int disk_reads = 0;
 
+  vmstats_sum(stats_counts);
+
   kprintf("VMSTATS:\n");
   for (i=0; i<VMSTAT_COUNT; i++) {
     kprintf("VMSTAT %25s = %10d\n", stats_names[i], stats_counts[i]);
@@ -111,7 +145,8 @@ vmstats_print(void)
   tlb_faults = stats_counts[VMSTAT_TLB_FAULT];
   free_plus_replace = stats_counts[VMSTAT_TLB_FAULT_FREE] + stats_counts[VMSTAT_TLB_FAULT_REPLACE];
   disk_plus_zeroed_plus_reload = stats_counts[VMSTAT_PAGE_FAULT_DISK] +
-    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD];
+    stats_counts[VMSTAT_PAGE_FAULT_ZERO] + stats_counts[VMSTAT_TLB_RELOAD] +
+    stats_counts[VMSTAT_PAGE_FAULT_CACHED];
   elf_plus_swap_reads = stats_counts[VMSTAT_ELF_FILE_READ] + stats_counts[VMSTAT_SWAP_FILE_READ];
   disk_reads = stats_counts[VMSTAT_PAGE_FAULT_DISK];
 
@@ -135,3 +170,18 @@ vmstats_print(void)
   }
 }
 /* ---------------------------------------------------------------------- */
+
+/* ---------------------------------------------------------------------- */
+/* Print the counters of one process. */
+void
+vmstats_print_proc(struct proc *p)
+{
+  int i;
+
+  kprintf("VMSTATS for %s:\n", p->p_name);
+  for (i=0; i<VMSTAT_COUNT; i++) {
+    if (p->p_vmstats[i] != 0) {
+      kprintf("VMSTAT %25s = %10d\n", stats_names[i], p->p_vmstats[i]);
+    }
+  }
+}
@@ -0,0 +1,150 @@
+/*
+ * Pre-zeroed frame pool. See <zeropool.h>.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <vm.h>
+#include <coremap.h>
+#include <zeropool.h>
+#include <uw-vmstats.h>
+
+static paddr_t zp_frames[ZEROPOOL_SIZE];
+static unsigned zp_count;
+static struct spinlock zp_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * The zeroing thread sleeps here when the pool is full or memory is
+ * short; zeropool_get wakes it when the pool runs low.
+ */
+static struct wchan *zp_wchan;
+
+/*
+ * True if the zeroing thread has work: the pool is not full and there
+ * is free memory to spare.
+ */
+static
+bool
+zeropool_wanted(void)
+{
+	bool wanted;
+
+	spinlock_acquire(&zp_lock);
+	wanted = zp_count < ZEROPOOL_SIZE;
+	spinlock_release(&zp_lock);
+	return wanted && coremap_freecount() > ZEROPOOL_RESERVE;
+}
+
+/*
+ * The zeroing thread. It runs at the bottom scheduling level, and only
+ * zeroes when nothing else on its cpu wants to run; otherwise it gets
+ * out of the way.
+ */
+static
+void
+zeropool_thread(void *data1, unsigned long data2)
+{
+	paddr_t paddr;
+
+	(void)data1;
+	(void)data2;
+
+	thread_setbackground();
+
+	while (1) {
+		wchan_lock(zp_wchan);
+		if (!zeropool_wanted()) {
+			wchan_sleep(zp_wchan);
+			continue;
+		}
+		wchan_unlock(zp_wchan);
+
+		if (thread_others_ready()) {
+			thread_yield();
+			continue;
+		}
+
+		paddr = coremap_alloc(1);
+		if (paddr == 0) {
+			/* Raced with someone else; wait for the next miss. */
+			wchan_lock(zp_wchan);
+			wchan_sleep(zp_wchan);
+			continue;
+		}
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+
+		spinlock_acquire(&zp_lock);
+		if (zp_count < ZEROPOOL_SIZE) {
+			zp_frames[zp_count++] = paddr;
+			paddr = 0;
+		}
+		spinlock_release(&zp_lock);
+		if (paddr != 0) {
+			/* Filled up behind our back. */
+			coremap_free(paddr);
+		}
+	}
+}
+
+void
+zeropool_bootstrap(void)
+{
+	int result;
+
+	zp_wchan = wchan_create("zeropool");
+	if (zp_wchan == NULL) {
+		panic("zeropool: cannot create wchan\n");
+	}
+
+	result = vm_reclaim_register("zeropool", zeropool_reclaim);
+	if (result) {
+		panic("zeropool: cannot register reclaim hook: %s\n",
+		      strerror(result));
+	}
+
+	result = thread_fork("pagezero", NULL, zeropool_thread, NULL, 0);
+	if (result) {
+		panic("zeropool: thread_fork failed: %s\n", strerror(result));
+	}
+}
+
+paddr_t
+zeropool_get(void)
+{
+	paddr_t paddr;
+	bool refill;
+
+	spinlock_acquire(&zp_lock);
+	paddr = zp_count > 0 ? zp_frames[--zp_count] : 0;
+	refill = zp_count < ZEROPOOL_SIZE / 2;
+	spinlock_release(&zp_lock);
+
+	vmstats_inc(paddr != 0 ? VMSTAT_ZERO_POOL_HIT : VMSTAT_ZERO_POOL_MISS);
+	if (refill && zp_wchan != NULL) {
+		wchan_wakeone(zp_wchan);
+	}
+	return paddr;
+}
+
+unsigned
+zeropool_reclaim(void)
+{
+	paddr_t frames[ZEROPOOL_SIZE];
+	unsigned i, n;
+
+	spinlock_acquire(&zp_lock);
+	n = zp_count;
+	for (i=0; i<n; i++) {
+		frames[i] = zp_frames[i];
+	}
+	zp_count = 0;
+	spinlock_release(&zp_lock);
+
+	for (i=0; i<n; i++) {
+		coremap_free(frames[i]);
+	}
+	return n;
+}
@@ -0,0 +1,22 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+#include <kern/mman.h>
+
+/*
+ * Map the file at PATH into memory; see <kern/mman.h>. Returns the
+ * address of the mapping, or MAP_FAILED with errno set.
+ *
+ * A MAP_SHARED mapping is shared with children made by fork, but each
+ * separate mmap of a file gets its own copy of the pages. Changes
+ * reach the file only when the page is paged out, at munmap, or when
+ * the process exits; read() and other mappings of the file don't see
+ * them before that.
+ */
+void *mmap(const char *path, size_t length, int prot, int flags);
+
+/* Remove a mapping made by mmap. ADDR and LENGTH must match it. */
+int munmap(void *addr, size_t length);
+
+#endif /* _SYS_MMAN_H_ */
@@ -30,10 +30,13 @@
 /*
  * User-level malloc and free implementation.
  *
- * This is a basic first-fit allocator. It's intended to be simple and
- * easy to follow. It performs abysmally if the heap becomes larger than
- * physical memory. To get (much) better out-of-core performance, port
- * the kernel's malloc. :-)
+ * Blocks are laid out end to end in the heap, each with a header
+ * giving the offsets to its neighbours, so free can coalesce with the
+ * blocks on either side. Free blocks are also kept on segregated free
+ * lists, one per power-of-two size class, threaded through the free
+ * blocks' data areas; malloc looks only at free blocks of a suitable
+ * size instead of walking the whole heap. When nothing fits, the heap
+ * is grown with sbrk, extending the topmost block if it is free.
  */
 
 #include <stdlib.h>
@@ -133,6 +136,22 @@ struct mheader {
 
 #define M_MKFIELD(off)	((off)>>MBLOCKSHIFT)
 
+/*
+ * Free list links, kept in the data area of a free block. The smallest
+ * block has MBLOCKSIZE bytes of data, which is room for two pointers.
+ *
+ * Free blocks of N units of MBLOCKSIZE bytes live on list floor(log2(N)),
+ * or the last list if that is bigger.
+ */
+struct mfree {
+	struct mheader *mf_next;
+	struct mheader *mf_prev;
+};
+
+#define M_FREE(mh)	((struct mfree *)M_DATA(mh))
+
+#define NFREELISTS	24
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -140,6 +159,12 @@ struct mheader {
  */
 static uintptr_t __heapbase, __heaptop;
 
+/*
+ * The topmost block (NULL if the heap is empty), and the free lists.
+ */
+static struct mheader *__heaplast;
+static struct mheader *__freelists[NFREELISTS];
+
 /*
  * Setup function.
  */
@@ -254,6 +279,63 @@ __malloc_dump(void)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Free list for a block with SIZE bytes of data.
+ */
+static
+unsigned
+__malloc_freelist(size_t size)
+{
+	size_t units;
+	unsigned n;
+
+	units = size >> MBLOCKSHIFT;
+	for (n = 0; units > 1 && n < NFREELISTS-1; n++) {
+		units >>= 1;
+	}
+	return n;
+}
+
+/*
+ * Put a free block on its free list.
+ */
+static
+void
+__malloc_link(struct mheader *mh)
+{
+	unsigned n;
+
+	n = __malloc_freelist(M_SIZE(mh));
+	M_FREE(mh)->mf_prev = NULL;
+	M_FREE(mh)->mf_next = __freelists[n];
+	if (__freelists[n] != NULL) {
+		M_FREE(__freelists[n])->mf_prev = mh;
+	}
+	__freelists[n] = mh;
+}
+
+/*
+ * Take a free block off its free list.
+ */
+static
+void
+__malloc_unlink(struct mheader *mh)
+{
+	struct mfree *mf = M_FREE(mh);
+
+	if (mf->mf_prev != NULL) {
+		M_FREE(mf->mf_prev)->mf_next = mf->mf_next;
+	}
+	else {
+		__freelists[__malloc_freelist(M_SIZE(mh))] = mf->mf_next;
+	}
+	if (mf->mf_next != NULL) {
+		M_FREE(mf->mf_next)->mf_prev = mf->mf_prev;
+	}
+}
+
+////////////////////////////////////////////////////////////
+
 /*
  * Get more memory (at the top of the heap) using sbrk, and 
  * return a pointer to it.
@@ -324,6 +406,12 @@ __malloc_split(struct mheader *mh, size_t size)
 	if (mhnext != (struct mheader *) __heaptop) {
 		mhnext->mh_prevblock = mhnew->mh_nextblock;
 	}
+	else {
+		__heaplast = mhnew;
+	}
+
+	/* The leftover piece is free. */
+	__malloc_link(mhnew);
 }
 
 /*
@@ -333,8 +421,7 @@ void *
 malloc(size_t size)
 {
 	struct mheader *mh;
-	uintptr_t i;
-	size_t rightprevblock;
+	unsigned n;
 
 	if (__heapbase==0) {
 		__malloc_init();
@@ -353,72 +440,73 @@ malloc(size_t size)
 
 	/* Round size up to an integral number of blocks. */
 	size = ((size + MBLOCKSIZE - 1) & ~(size_t)(MBLOCKSIZE-1));
+	if (size == 0) {
+		/* every block has room for the free list links */
+		size = MBLOCKSIZE;
+	}
 
 	/*
-	 * First-fit search algorithm for available blocks.
-	 * Check to make sure the next/previous sizes all agree.
+	 * First fit within the free list for this size; every block on
+	 * the lists above it is big enough.
 	 */
-	rightprevblock = 0;
-	for (i=__heapbase; i<__heaptop; i += M_NEXTOFF(mh)) {
-		mh = (struct mheader *) i;
-		if (!M_OK(mh)) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad magic bits",
-			     (unsigned long) i);
-		}
-		if (mh->mh_prevblock != rightprevblock) {
-			errx(1, "malloc: Heap corrupt; header at 0x%lx"
-			     " has bad previous-block size %lu "
-			     "(should be %lu)",
-			     (unsigned long) i, 
-			     (unsigned long) mh->mh_prevblock << MBLOCKSHIFT,
-			     (unsigned long) rightprevblock << MBLOCKSHIFT);
-		}
-		rightprevblock = mh->mh_nextblock;
+	for (n = __malloc_freelist(size); n < NFREELISTS; n++) {
+		for (mh = __freelists[n]; mh != NULL;
+		     mh = M_FREE(mh)->mf_next) {
+			if (!M_OK(mh) || mh->mh_inuse) {
+				errx(1, "malloc: Heap corrupt; free block "
+				     "at %p is bad", mh);
+			}
+			if (M_SIZE(mh) < size) {
+				continue;
+			}
+
+			__malloc_unlink(mh);
+			mh->mh_inuse = 1;
+
+			/* Try splitting block. */
+			__malloc_split(mh, size);
 
-		/* Can't allocate a block that's in use. */
-		if (mh->mh_inuse) {
-			continue;
-		}
-
-		/* Can't allocate a block that isn't big enough. */
-		if (M_SIZE(mh) < size) {
-			continue;
+#ifdef MALLOCDEBUG
+			warnx("malloc: allocating at %p", M_DATA(mh));
+			__malloc_dump();
+#endif
+			return M_DATA(mh);
 		}
+	}
 
-		/* Try splitting block. */
-		__malloc_split(mh, size);
+	/*
+	 * Didn't find anything. Expand the heap. If the top block is
+	 * free, only get what it is short by.
+	 */
 
-		/*
-		 * Now, allocate.
-		 */
+	mh = __heaplast;
+	if (mh != NULL && !mh->mh_inuse) {
+		if (__malloc_sbrk(size - M_SIZE(mh)) == NULL) {
+			return NULL;
+		}
+		__malloc_unlink(mh);
 		mh->mh_inuse = 1;
-
+		mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
 #ifdef MALLOCDEBUG
 		warnx("malloc: allocating at %p", M_DATA(mh));
 		__malloc_dump();
 #endif
 		return M_DATA(mh);
 	}
-	if (i!=__heaptop) {
-		errx(1, "malloc: Heap corrupt; ran off end");
-	}
-
-	/*
-	 * Didn't find anything. Expand the heap.
-	 */
 
 	mh = __malloc_sbrk(size + MBLOCKSIZE);
 	if (mh == NULL) {
 		return NULL;
 	}
 
-	mh->mh_prevblock = rightprevblock;
+	mh->mh_prevblock = __heaplast == NULL ? 0 :
+		__heaplast->mh_nextblock;
 	mh->mh_magic1 = MMAGIC;
 	mh->mh_magic2 = MMAGIC;
 	mh->mh_pad = 0;
 	mh->mh_inuse = 1;
 	mh->mh_nextblock = M_MKFIELD(size + MBLOCKSIZE);
+	__heaplast = mh;
 
 #ifdef MALLOCDEBUG
 	warnx("malloc: allocating at %p", M_DATA(mh));
@@ -470,6 +558,9 @@ __malloc_trymerge(struct mheader *mh, struct mheader *mhnext)
 	if (mhnextnext != (struct mheader *)__heaptop) {
 		mhnextnext->mh_prevblock = mh->mh_nextblock;
 	}
+	else {
+		__heaplast = mh;
+	}
 
 	/* Deadbeef out the memory used by the now-obsolete header */
 	__malloc_deadbeef(mhnext, sizeof(struct mheader));
@@ -520,18 +611,29 @@ free(void *x)
 	/* wipe it */
 	__malloc_deadbeef(M_DATA(mh), M_SIZE(mh));
 
-	/* Try merging with the block above (but not if we're at the top) */
+	/*
+	 * Try merging with the block above (but not if we're at the
+	 * top) and the block below (but not if we're at the bottom).
+	 * Free neighbours come off their free lists first, since the
+	 * merged block will have a different size.
+	 */
 	mhnext = M_NEXT(mh);
-	if (mhnext != (struct mheader *)__heaptop) {
+	if (mhnext != (struct mheader *)__heaptop && !mhnext->mh_inuse) {
+		__malloc_unlink(mhnext);
 		__malloc_trymerge(mh, mhnext);
 	}
 
-	/* Try merging with the block below (but not if we're at the bottom) */
 	if (mh != (struct mheader *)__heapbase) {
 		mhprev = M_PREV(mh);
-		__malloc_trymerge(mhprev, mh);
+		if (!mhprev->mh_inuse) {
+			__malloc_unlink(mhprev);
+			__malloc_trymerge(mhprev, mh);
+			mh = mhprev;
+		}
 	}
 
+	__malloc_link(mh);
+
 #ifdef MALLOCDEBUG
 	warnx("free: freed %p", x);
 	__malloc_dump();
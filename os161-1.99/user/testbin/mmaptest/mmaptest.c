@@ -0,0 +1,163 @@
+/*
+ * mmaptest - check mmap and munmap.
+ *
+ * OS/161's mmap takes a pathname rather than a file descriptor and
+ * always maps from the start of the file; see <sys/mman.h>.
+ *
+ * Checks that:
+ *    - a read-only mapping shows the file's bytes, and zeros past
+ *      the end of the file;
+ *    - writes to a MAP_SHARED mapping reach the file by munmap;
+ *    - munmap of part of a mapping fails with EINVAL;
+ *    - a device can't be mapped (ENODEV).
+ *
+ * Usage: mmaptest [scratchfile]
+ */
+
+#include <sys/mman.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE     4096
+#define FILESZ   (2 * PAGE + PAGE / 2)	/* ends mid-page */
+#define MAPSZ    (3 * PAGE)
+
+static char buf[FILESZ];
+
+/* Byte I of the file as written, and as changed through the mapping. */
+#define ORIG(i)  ((char)('a' + (i) % 23))
+#define NEW(i)   ((char)('A' + (i) % 19))
+
+static
+void
+makefile(const char *path)
+{
+	int fd, i;
+
+	for (i=0; i<FILESZ; i++) {
+		buf[i] = ORIG(i);
+	}
+	fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s: create", path);
+	}
+	if (write(fd, buf, FILESZ) != FILESZ) {
+		err(1, "%s: write", path);
+	}
+	close(fd);
+}
+
+static
+void
+test_readonly(const char *path)
+{
+	char *p;
+	int i;
+
+	p = mmap(path, MAPSZ, PROT_READ, MAP_PRIVATE);
+	if (p == MAP_FAILED) {
+		err(1, "mmap read-only");
+	}
+	for (i=0; i<FILESZ; i++) {
+		if (p[i] != ORIG(i)) {
+			errx(1, "read-only: byte %d is %d, should be %d",
+			     i, p[i], ORIG(i));
+		}
+	}
+	for (; i<MAPSZ; i++) {
+		if (p[i] != 0) {
+			errx(1, "read-only: byte %d past EOF is %d", i, p[i]);
+		}
+	}
+	if (munmap(p, MAPSZ)) {
+		err(1, "munmap read-only");
+	}
+	printf("read-only mapping ok\n");
+}
+
+static
+void
+test_shared(const char *path)
+{
+	char *p;
+	int fd, i;
+
+	p = mmap(path, FILESZ, PROT_READ|PROT_WRITE, MAP_SHARED);
+	if (p == MAP_FAILED) {
+		err(1, "mmap shared");
+	}
+	for (i=0; i<FILESZ; i++) {
+		p[i] = NEW(i);
+	}
+	if (munmap(p, FILESZ)) {
+		err(1, "munmap shared");
+	}
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s: open", path);
+	}
+	if (read(fd, buf, FILESZ) != FILESZ) {
+		err(1, "%s: read", path);
+	}
+	close(fd);
+	for (i=0; i<FILESZ; i++) {
+		if (buf[i] != NEW(i)) {
+			errx(1, "shared: byte %d is %d in the file, "
+			     "should be %d", i, buf[i], NEW(i));
+		}
+	}
+	printf("shared mapping ok\n");
+}
+
+static
+void
+test_errors(const char *path)
+{
+	char *p;
+
+	p = mmap(path, MAPSZ, PROT_READ, MAP_PRIVATE);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	if (munmap(p, PAGE) != -1 || errno != EINVAL) {
+		errx(1, "munmap of the first page: expected EINVAL");
+	}
+	if (munmap(p + PAGE, MAPSZ - PAGE) != -1 || errno != EINVAL) {
+		errx(1, "munmap of the tail: expected EINVAL");
+	}
+	/* Still mapped after both failures. */
+	if (p[0] != NEW(0)) {
+		errx(1, "mapping damaged by failed munmap");
+	}
+	if (munmap(p, MAPSZ)) {
+		err(1, "munmap");
+	}
+
+	p = mmap("con:", PAGE, PROT_READ, MAP_PRIVATE);
+	if (p != MAP_FAILED || errno != ENODEV) {
+		errx(1, "mmap of con:: expected ENODEV");
+	}
+	printf("error checks ok\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path;
+
+	path = argc > 1 ? argv[1] : "mmaptest.dat";
+
+	makefile(path);
+	test_readonly(path);
+	test_shared(path);
+	test_errors(path);
+	remove(path);
+
+	printf("mmaptest: passed\n");
+	return 0;
+}
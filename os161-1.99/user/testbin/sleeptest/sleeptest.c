@@ -0,0 +1,84 @@
+/*
+ * sleeptest - check nanosleep.
+ *
+ * Sleeps for no time, for less than one timer tick, and for a second
+ * and a half, timing each with __time: none may come back early, or
+ * much later than asked. Then checks that out-of-range nanoseconds
+ * fail with EINVAL.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+/* How late a sleep may come back: a few 10ms timer ticks. */
+#define SLACK_USEC  50000
+
+/*
+ * Microseconds from (S1, N1) to (S2, N2).
+ */
+static
+long
+elapsed(time_t s1, unsigned long n1, time_t s2, unsigned long n2)
+{
+	return (long)(s2 - s1) * 1000000 + ((long)n2 - (long)n1) / 1000;
+}
+
+static
+void
+timedsleep(time_t sec, long nsec)
+{
+	struct timespec ts;
+	time_t s1, s2;
+	unsigned long n1, n2;
+	long want, took;
+
+	ts.tv_sec = sec;
+	ts.tv_nsec = nsec;
+	want = (long)sec * 1000000 + nsec / 1000;
+
+	__time(&s1, &n1);
+	if (nanosleep(&ts, NULL)) {
+		err(1, "nanosleep %ld.%09ld", (long)sec, nsec);
+	}
+	__time(&s2, &n2);
+
+	took = elapsed(s1, n1, s2, n2);
+	if (took < want) {
+		errx(1, "nanosleep %ld.%09ld: back after only %ld usec",
+		     (long)sec, nsec, took);
+	}
+	if (took > want + SLACK_USEC) {
+		errx(1, "nanosleep %ld.%09ld: took %ld usec",
+		     (long)sec, nsec, took);
+	}
+	printf("nanosleep %ld.%09ld: %ld usec\n", (long)sec, nsec, took);
+}
+
+static
+void
+badsleep(long nsec)
+{
+	struct timespec ts;
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = nsec;
+	if (nanosleep(&ts, NULL) != -1 || errno != EINVAL) {
+		errx(1, "nanosleep with tv_nsec %ld: expected EINVAL", nsec);
+	}
+}
+
+int
+main(void)
+{
+	timedsleep(0, 0);
+	timedsleep(0, 1000000);		/* 1ms, a tenth of a tick */
+	timedsleep(1, 500000000);
+
+	badsleep(-1);
+	badsleep(1000000000);
+
+	printf("sleeptest: passed\n");
+	return 0;
+}